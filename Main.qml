@@ -9,7 +9,6 @@ import observe
 
 /*
 Todo list
-- rewrite planet repeater to use instancing like the star
 - selection of objects and information showing up.
 - texture for the stars
 - controls for heliocentric/geocentric
@@ -28,7 +27,39 @@ Window {
     color: "#848895"
     property var planetModel
     property var starInstanceTable
+    property var planetInstanceTable
+    property var trailGeometry
     property var selectionHandler
+    property var metricsModel
+
+    // The stars outside the view aren't drawn, and the tiled star catalog loads the stars around it.
+    function updateStarView() {
+        window.starInstanceTable.setView(camera.forward, camera.up, camera.fieldOfView,
+                                         main_view3d.width / Math.max(1, main_view3d.height));
+    }
+
+    // The animation runs on a worker thread. Each rendered frame takes the latest positions it computed and
+    // lets it compute the next. Nothing runs while the animation is stopped.
+    FrameAnimation {
+        running: window.planetModel.animating
+        onTriggered: window.planetModel.fetchFrame()
+    }
+
+    // Only does something with OBSERVE_TRACE set, see main.cpp.
+    Shortcut {
+        sequence: "Ctrl+Shift+T"
+        onActivated: window.planetModel.saveTrace()
+    }
+
+    Shortcut {
+        sequence: "F3"
+        onActivated: perf_hud.visible = !perf_hud.visible
+    }
+
+    Connections {
+        target: window.planetModel
+        function onDateChanged() { window.starInstanceTable.setDate(window.planetModel.date) }
+    }
 
     /*PlanetModel {
         id: coordinates_model
@@ -43,35 +74,31 @@ Window {
             brightness: 1
         }
 
-        component PlanetDelegate : Node {
-            required property double x
-            required property double y
-            required property double z
-            required property color p_color;
-            required property real p_radius;
-            position: Qt.vector3d(x, y, z)
-
-            /*Text {
-                text: qsTr(name)
-                anchors.top: parent.top
-                anchors.bottom: parent.bottom
-                font.pixelSize: 1
-            }*/
-
-            Model {
-                source: "#Sphere"
-                scale: Qt.vector3d(parent.p_radius, parent.p_radius, parent.p_radius)
-
-                materials: [ DefaultMaterial {
-                            diffuseColor: p_color
-                        }
-                    ]
-            }
+        Model {
+            id: instanced_planets
+            source: "#Sphere"
+            instancing: window.planetInstanceTable
+
+            materials: [ DefaultMaterial {
+                    diffuseColor: "white" // times the color of each body
+                }
+            ]
         }
 
-        Repeater3D {
-            model: window.planetModel
-            delegate: PlanetDelegate {}
+        // All trails in one mesh of lines, in the colors of the bodies.
+        Model {
+            id: trails
+            geometry: window.trailGeometry
+            scale: Qt.vector3d(window.planetModel.distanceScale, window.planetModel.distanceScale,
+                               window.planetModel.distanceScale)
+            castsShadows: false
+            castsReflections: false
+
+            materials: [ DefaultMaterial {
+                    lighting: DefaultMaterial.NoLighting
+                    vertexColorsEnabled: true
+                }
+            ]
         }
 
         CustomMaterial {
@@ -79,6 +106,10 @@ Window {
             shadingMode: CustomMaterial.Unshaded
             vertexShader: "qrc:/shaders/star.vert"
             fragmentShader: "qrc:/shaders/star.frag"
+
+            // Uniforms for star.vert, changing them moves the stars without touching the instance data.
+            property real epoch: window.starInstanceTable.epoch
+            property matrix4x4 precession: window.starInstanceTable.precession
         }
 
         Model {
@@ -95,6 +126,10 @@ Window {
             id: camera
             position: Qt.vector3d(0, 0, 0)
             fieldOfView: 90
+
+            onForwardChanged: window.updateStarView()
+            onUpChanged: window.updateStarView()
+            onFieldOfViewChanged: window.updateStarView()
         }
     }
 
@@ -108,6 +143,8 @@ Window {
             anchors.fill: parent
             importScene: main_scene
             camera: camera
+            onWidthChanged: window.updateStarView()
+            onHeightChanged: window.updateStarView()
             environment: SceneEnvironment {
                 backgroundMode: SceneEnvironment.SkyBox
                 lightProbe: Texture {
@@ -126,18 +163,79 @@ Window {
             id: main_mouse
             anchors.fill: main_view3d
 
+            hoverEnabled: true
+
             property real last_x
             property real last_y
+            property var hovered: ({})
+            property var selected: ({})
+
+            // What's under the mouse, allowing a few pixels of slack.
+            function pick(x, y) {
+                let near = main_view3d.mapTo3DScene(Qt.vector3d(x, y, 0.0));
+                let far = main_view3d.mapTo3DScene(Qt.vector3d(x, y, 1.0));
+                let pixel_angle = camera.fieldOfView / main_view3d.height;
+                return window.selectionHandler.rayPick(camera.position, far.minus(near), 6 * pixel_angle);
+            }
 
             onWheel: event => {
                          let new_fov = camera.fieldOfView - event.angleDelta.y * 0.05;
                          camera.fieldOfView = Math.max(10.0, Math.min(150.0, new_fov));
                      }
 
-            onClicked: event => {
-                           let ray = main_view3d.mapTo3DScene(Qt.vector3d(event.x, event.y, 0.0));
-                           window.selectionHandler.rayPick(camera.position, ray);
-                       }
+            onPositionChanged: event => hovered = pick(event.x, event.y)
+            onExited: hovered = ({})
+            onClicked: event => selected = pick(event.x, event.y)
+        }
+
+        Text {
+            id: hover_label
+            visible: main_mouse.hovered.name !== undefined
+            x: main_mouse.mouseX + 12
+            y: main_mouse.mouseY + 12
+            color: "white"
+            text: main_mouse.hovered.name ?? ""
+        }
+
+        // Live performance numbers, shown with F3. Sampled only while visible, see MetricsModel.
+        Rectangle {
+            id: perf_hud
+            visible: false
+            x: 12
+            y: 12
+            width: perf_text.implicitWidth + 16
+            height: perf_text.implicitHeight + 12
+            color: "#B0000000"
+            radius: 4
+
+            function ms(value) { return isNaN(value) ? "-" : value.toFixed(2) }
+            function megabytes(bytes) { return bytes < 0 ? "-" : (bytes / (1024 * 1024)).toFixed(1) + " MB" }
+
+            Timer {
+                interval: 500
+                repeat: true
+                running: perf_hud.visible
+                triggeredOnStart: true
+                onTriggered: window.metricsModel.sample()
+            }
+
+            Text {
+                id: perf_text
+                x: 8
+                y: 6
+                color: "white"
+                font.family: "monospace"
+                text: {
+                    let m = window.metricsModel;
+                    return ["Worker      " + m.ticksPerSecond.toFixed(1) + " frames/s",
+                            "Ephemeris   p50 " + perf_hud.ms(m.ephemerisP50) + " ms, p99 " + perf_hud.ms(m.ephemerisP99) + " ms",
+                            "Latency     p50 " + perf_hud.ms(m.latencyP50) + " ms, p99 " + perf_hud.ms(m.latencyP99) + " ms",
+                            "Stars       " + m.starsDrawn + " drawn, " + m.catalogStars + " in BSC5",
+                            "Uploads     " + (m.uploadRate / 1024).toFixed(1) + " KB/s, " + perf_hud.megabytes(m.uploadedBytes) + " in total",
+                            "Memory      " + perf_hud.megabytes(m.processMemory) + ", star tiles " + perf_hud.megabytes(m.starDataBytes)
+                           ].join("\n");
+                }
+            }
         }
 
         Rectangle {
@@ -174,6 +272,7 @@ Window {
                     id: calendar
                     anchors.horizontalCenter: parent.horizontalCenter
                     onDateSelected: date => window.planetModel.calculatePositions(date)
+                    onMonthShown: (year, month) => window.planetModel.showMonth(year, month)
                     titleFont.bold: true
                     titleFont.pointSize: 13.0
                 }
@@ -204,9 +303,82 @@ Window {
                     onToggled: window.planetModel.calculatePositionsRepeatedly()
                 }
 
+                Text {
+                    visible: window.planetModel.animating
+                    text: window.planetModel.frameInterval.toFixed(1) + " ms/frame, jitter "
+                          + window.planetModel.frameJitter.toFixed(2) + " ms, worker "
+                          + (100 * window.planetModel.workerLoad).toFixed(0) + "%"
+                }
+
+                Text {
+                    text: "Trails: " + window.trailGeometry.length + " frames"
+                }
+
+                Slider {
+                    id: trail_length_slider
+                    value: window.trailGeometry.length
+                    from: 0
+                    to: 32768
+                    stepSize: 256
+                    width: parent.width * 0.9
+
+                    onMoved: window.trailGeometry.length = trail_length_slider.value
+                }
+
+                Text {
+                    text: "Date cache: " + window.planetModel.cacheHits + " hits, "
+                          + window.planetModel.cacheMisses + " misses"
+                }
+
+                CheckBox {
+                    text: "High precision"
+                    onToggled: window.planetModel.setHighPrecision(checked)
+                }
+
+                CheckBox {
+                    text: "Interpolate between keyframes"
+                    onToggled: window.planetModel.setKeyframes(checked)
+                }
+
+                Text {
+                    text: "Accuracy of the formulae"
+                }
+
+                // In the order of AccuracyLevel, see observe-accuracy for what each costs.
+                ComboBox {
+                    model: ["full", "fast", "coarse", "float", "rough"]
+                    onActivated: index => window.planetModel.setAccuracy(index)
+                }
+
+                Text {
+                    text: "Terms of the high precision series"
+                }
+
+                // In the order of SeriesTruncation, PlanetModel starts with "arcsecond".
+                ComboBox {
+                    model: ["full", "fine", "arcsecond", "coarse"]
+                    currentIndex: 2
+                    onActivated: index => window.planetModel.setTruncation(index)
+                }
+
                 RadioButton {
                     text: "hello"
                 }
+
+                Text {
+                    id: selection_info
+                    visible: main_mouse.selected.name !== undefined
+                    width: parent.width * 0.9
+                    wrapMode: Text.Wrap
+                    text: {
+                        let s = main_mouse.selected;
+                        if (s.name === undefined) return "";
+                        let lines = [s.name,
+                                     "RA " + s.rightAscension.toFixed(3) + " h, dec " + s.declination.toFixed(2) + "°"];
+                        if (s.type === "star") lines.push("mag " + s.magnitude.toFixed(2) + " " + s.spectralType);
+                        return lines.join("\n");
+                    }
+                }
             }
         }
     }
@@ -6,6 +6,7 @@ import QtQuick.Layouts
 Column {
     id: calendar
     signal dateSelected(date date)
+    signal monthShown(int year, int month) // month from 1 to 12
     property font titleFont
 
     Text {
@@ -86,6 +87,9 @@ Column {
 
             property var selected_date: new Date();
 
+            onMonthChanged: calendar.monthShown(grid.year, grid.month + 1)
+            onYearChanged: calendar.monthShown(grid.year, grid.month + 1)
+
             delegate: Text {
                 id: month_day_text
                 horizontalAlignment: Text.AlignHCenter
@@ -4,14 +4,20 @@
 #include <QVector3D>
 #include <QDateTime>
 #include <QtGlobal>
+#include <QVarLengthArray>
 #include <cmath>
+#include "simd.h"
+#include "kepler.h"
+#include "position_kernel.h"
+#include "trace.h"
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h> // __cpuid and _xgetbv
+#endif
 
 #define TWO_PI 6.283185
 
-double normalizeDegrees(double degrees) {
-    if (degrees >= 0) return fmod(degrees, 360.0);
-    else              return fmod(degrees, 360.0) + 360;
-}
+using namespace POSITION_KERNEL;
 
 double normalizeRadians(double radians) {
     if (radians >= 0) return fmod(radians, TWO_PI);
@@ -51,30 +57,7 @@ void printDeclination(double Decl_radians) {
 }
 
 
-// d is the days since 2000 expressed as a decimal number, calculated separately.
-OrbitalElements elements_for_day(CelestialBody body, double d) {
-    OrbitalElements el;
-    el = body.base_elements;
-    el.N += d * body.delta.N;
-    el.i += d * body.delta.i;
-    el.w += d * body.delta.w;
-    el.a += d * body.delta.a;
-    el.e += d * body.delta.e;
-    el.M += d * body.delta.M;
-
-    // all angles need to be radians and in [0,2pi]
-    el.N = qDegreesToRadians(normalizeDegrees(el.N));
-    el.i = qDegreesToRadians(normalizeDegrees(el.i));
-    el.w = qDegreesToRadians(normalizeDegrees(el.w));
-    el.M = qDegreesToRadians(normalizeDegrees(el.M));
-
-    return el;
-}
-
-
-// Method from Paul Schlyter: http://stjarnhimlen.se/comp/ppcomp.html#0
-// Bodies is a list of CelestialBody, where the first is assumed to be the sun.
-QList<dVector3D> calc::calculatePositions(QList<CelestialBody> bodies, QDateTime datetime) {
+double calc::daysSinceJ2000(QDateTime datetime) {
     int year  = datetime.date().year();
     int month = datetime.date().month();
     int day   = datetime.date().day();
@@ -82,9 +65,7 @@ QList<dVector3D> calc::calculatePositions(QList<CelestialBody> bodies, QDateTime
     int mins  = datetime.time().minute();
     int secs  = datetime.time().second();
 
-    QList<dVector3D> positions;
-
-    // Calculate days since J2000. NOTE: this uses integer divisions
+    // NOTE: this uses integer divisions
     double d = 367*year -
             7 * ( year + (month+9)/12 ) / 4 -
             3 * ( ( year + (month-9)/7 ) / 100 + 1 ) / 4 +
@@ -92,177 +73,176 @@ QList<dVector3D> calc::calculatePositions(QList<CelestialBody> bodies, QDateTime
 
     double decimal_hours = (double)hours + (double)mins / 60.0 + (double)secs / 3600.0;
     d += decimal_hours / 24.0;
+    return d;
+}
 
-    double ecliptic_obliquity = qDegreesToRadians(23.4393 - 3.563E-7 * d);
 
-    // Compute for the sun first, because it is needed for the other bodies, and simpler to compute.
-    CelestialBody sun = bodies[0];
-    OrbitalElements sun_el = elements_for_day(sun, d);
-    double E_sun = sun_el.M + sun_el.e * sin(sun_el.M) * (1.0 + sun_el.e * cos(sun_el.M));
+// Each level only changes one thing from the one before, so the table of errors shows what each change costs.
+AccuracyTier calc::accuracyTier(AccuracyLevel level) {
+    switch (level) {
+        case FastAccuracy:   return {"fast",   1E-6, AllPerturbations,  false};
+        case CoarseAccuracy: return {"coarse", 1E-6, MoonPerturbations, false};
+        case FloatAccuracy:  return {"float",  1E-6, MoonPerturbations, true};
+        case RoughAccuracy:  return {"rough",  1E-4, NoPerturbations,   true};
+        default:             return {"full",   KEPLER_TOLERANCE, AllPerturbations, false};
+    }
+}
 
-    double xv = cos(E_sun) - sun_el.e;
-    double yv = sqrt(1.0 - sun_el.e*sun_el.e) * sin(E_sun);
 
-    double v_sun = atan2(yv, xv);
-    double r_sun = sqrt(xv*xv + yv*yv);
-    double lon_sun = v_sun + sun_el.w;
+ResolvedBodies calc::resolveBodies(const QList<CelestialBody> &bodies, AccuracyTier tier) {
+    ResolvedBodies resolved;
+    resolved.perturbation.resize(bodies.size());
+    resolved.float_perturbation.resize(bodies.size());
+    resolved.perturbations = tier.perturbations;
+    resolved.kepler_tolerance = tier.kepler_tolerance;
+    resolved.single_precision = tier.single_precision;
+    resolved.moon    = -1;
+    resolved.jupiter = -1;
+    resolved.saturn  = -1;
+    resolved.uranus  = -1;
+
+    for (int i = 0; i < bodies.size(); i++) {
+        const QString &name = bodies[i].name;
+        if (name == "moon") resolved.moon = i;
+        else if (name == "jupiter") resolved.jupiter = i;
+        else if (name == "saturn") resolved.saturn = i;
+        else if (name == "uranus") resolved.uranus = i;
+    }
+    for (int i = 0; i < bodies.size(); i++) {
+        resolved.perturbation[i] = boundPerturbation<f64>(resolved, i);
+        resolved.float_perturbation[i] = boundPerturbation<f32>(resolved, i);
+    }
+    return resolved;
+}
 
-    double xs = r_sun * cos(lon_sun);
-    double ys = r_sun * sin(lon_sun);
 
-    double xe = xs;
-    double ye = ys * cos(ecliptic_obliquity);
-    double ze = ys * sin(ecliptic_obliquity);
+void calc::calculatePositions(const QList<CelestialBody> &bodies, const ResolvedBodies &resolved, double d,
+                              KeplerState *kepler_state, dVector3D *positions, const bool *mask) {
+    TRACE_SCOPE("calc::calculatePositions");
+    qsizetype count = bodies.size();
+    if (count == 0) return;
+
+    // The sun only needs the series approximation, so it is left out of the solve. The masked out bodies stay in
+    // it, a solve is a few SIMD iterations for all of them and the warm start keeps its indices.
+    QVarLengthArray<f64, 16> M(count);
+    QVarLengthArray<f64, 16> e(count);
+    QVarLengthArray<f64, 16> sin_E(count);
+    QVarLengthArray<f64, 16> cos_E(count);
+    for (qsizetype i = 1; i < count; i++) {
+        Elements<f64> el = elements_for_day(bodies[i], d);
+        M[i] = el.M;
+        e[i] = el.e;
+    }
+    solveKepler(M.data() + 1, e.data() + 1, nullptr, sin_E.data() + 1, cos_E.data() + 1, count - 1, kepler_state,
+                resolved.kepler_tolerance);
+    SolvedAnomalies solved = {sin_E.data(), cos_E.data(), resolved.kepler_tolerance};
 
-    positions.append({xe, ye, ze});
-    //double RA  = atan2(ye, xe);
-    //double dec = atan2(ze, sqrt(xe*xe+ye*ye));
-    //RA = qRadiansToDegrees(RA) / 15.0; // RA uses hours, mins, secs.
-    //dec = qRadiansToDegrees(dec);
+    QVarLengthArray<f64, 3 * 16> xyz(3 * count);
+    if (resolved.single_precision) {
+        positionsForDay<f32>(bodies.constData(), count, resolved, (f32)d, &solved, xyz.data(), xyz.data() + count, xyz.data() + 2 * count, 1, mask);
+    }
+    else {
+        positionsForDay<f64>(bodies.constData(), count, resolved, d, &solved, xyz.data(), xyz.data() + count, xyz.data() + 2 * count, 1, mask);
+    }
 
-    // Compute all orbital elements first
-    QHash<QString, OrbitalElements> elements;
-    for (int i = 1; i < bodies.size(); i++) {
-        CelestialBody body = bodies[i];
-        elements[body.name] = elements_for_day(body, d);
+    for (qsizetype i = 0; i < count; i++) {
+        if (mask && !mask[i]) continue;
+        positions[i] = {xyz[i], xyz[count + i], xyz[2 * count + i]};
     }
+}
+
 
-    // Compute coordinates
-    for (int i = 1; i < bodies.size(); i++) {
-        const CelestialBody body = bodies[i];
-        const OrbitalElements el = elements.value(body.name);
+QList<dVector3D> calc::calculatePositions(const QList<CelestialBody> &bodies, QDateTime datetime, KeplerState *kepler_state) {
+    QList<dVector3D> positions;
+    if (bodies.isEmpty()) return positions;
+
+    QVarLengthArray<dVector3D, 16> all_positions(bodies.size());
+    calculatePositions(bodies, resolveBodies(bodies), daysSinceJ2000(datetime), kepler_state, all_positions.data());
 
-        if (el.e > 0.98) {
+    positions.reserve(bodies.size());
+    for (const dVector3D &position : all_positions) {
+        if (std::isnan(position.x)) {
             qWarning() << "Too eccentric, we need to use formula for parabolic orbits";
             continue;
         }
-        // Solve Kepler's equation numerically for the eccentric anomaly E
-        double E = el.M + el.e * sin(el.M) * (1.0 + el.e * cos(el.M));
-        for (int i = 0; i < 100; i++) {
-            double E_new = E - (E - el.e * sin(E) - el.M) / (1.0 - el.e * cos(E));
-            if (qAbs(E_new - E) <= qDegreesToRadians(1E-7)) {
-                E = E_new;
-                break;
-            }
-            E = E_new;
-        }
+        positions.append(position);
+    }
+    return positions;
+}
 
-        double xv = el.a * (cos(E) - el.e);
-        double yv = el.a * (sqrt(1.0 - el.e*el.e) * sin(E));
-
-        double v = atan2(yv, xv);
-        double r = sqrt(xv*xv + yv*yv);
-
-        double xh = r * (cos(el.N) * cos(v+el.w) - sin(el.N) * sin(v+el.w) * cos(el.i));
-        double yh = r * (sin(el.N) * cos(v+el.w) + cos(el.N) * sin(v+el.w) * cos(el.i));
-        double zh = r * (sin(v+el.w) * sin(el.i));
-
-        // Corrections for significant perturbations for certain bodies.
-        double lon_ecl = atan2(yh, xh);
-        double lat_ecl = atan2(zh, sqrt(xh*xh+yh*yh));
-        {
-            if (body.name == "moon") {
-                double sun_M = sun_el.M;
-                double lon_moon = el.M + el.w + el.N; // Mean longitude
-                double D = lon_moon - lon_sun; // Mean elongation
-                double F = lon_moon - el.N; // Argument of latitude
-
-                lon_ecl -= qDegreesToRadians(1.274) * sin(el.M - 2*D);
-                lon_ecl += qDegreesToRadians(0.658) * sin(2*D);
-                lon_ecl -= qDegreesToRadians(0.186) * sin(sun_M);
-                lon_ecl -= qDegreesToRadians(0.059) * sin(2*el.M - 2*D);
-                lon_ecl -= qDegreesToRadians(0.057) * sin(el.M - 2*D + sun_M);
-                lon_ecl += qDegreesToRadians(0.053) * sin(el.M + 2*D);
-                lon_ecl += qDegreesToRadians(0.046) * sin(2*D - sun_M);
-                lon_ecl += qDegreesToRadians(0.041) * sin(el.M - sun_M);
-                lon_ecl -= qDegreesToRadians(0.035) * sin(D);
-                lon_ecl -= qDegreesToRadians(0.031) * sin(el.M + sun_M);
-                lon_ecl -= qDegreesToRadians(0.015) * sin(2*F - 2*D);
-                lon_ecl += qDegreesToRadians(0.011) * sin(el.M - 4*D);
-                lat_ecl -= qDegreesToRadians(0.173) * sin(F - 2*D);
-                lat_ecl -= qDegreesToRadians(0.055) * sin(el.M - F - 2*D);
-                lat_ecl -= qDegreesToRadians(0.046) * sin(el.M + F - 2*D);
-                lat_ecl += qDegreesToRadians(0.033) * sin(F + 2*D);
-                lat_ecl += qDegreesToRadians(0.017) * sin(2*el.M + F);
-                r -= qDegreesToRadians(0.58) * cos(el.M - 2*D);
-                r -= qDegreesToRadians(0.46) * cos(2*D);
-            }
-            else if (body.name == "jupiter") {
-                double M_saturn = elements.value("saturn").M;
-                lon_ecl -= qDegreesToRadians(0.332) * sin(2*el.M - 5*M_saturn - qDegreesToRadians(67.6));
-                lon_ecl -= qDegreesToRadians(0.056) * sin(2*el.M - 2*M_saturn + qDegreesToRadians(21));
-                lon_ecl += qDegreesToRadians(0.042) * sin(3*el.M - 5*M_saturn + qDegreesToRadians(21));
-                lon_ecl -= qDegreesToRadians(0.036) * sin(el.M - 2*M_saturn);
-                lon_ecl += qDegreesToRadians(0.022) * cos(el.M - M_saturn);
-                lon_ecl += qDegreesToRadians(0.023) * sin(2*el.M - 3*M_saturn + qDegreesToRadians(52));
-                lon_ecl -= qDegreesToRadians(0.016) * sin(el.M - 5*M_saturn - qDegreesToRadians(69));
-            }
-            else if (body.name == "saturn") {
-                double M_jupiter = elements.value("jupiter").M;
-                lon_ecl += qDegreesToRadians(0.812) * sin(2*M_jupiter - 5*el.M - qDegreesToRadians(67.6));
-                lon_ecl -= qDegreesToRadians(0.229) * cos(2*M_jupiter - 4*el.M - qDegreesToRadians(2));
-                lon_ecl += qDegreesToRadians(0.119) * sin(M_jupiter - 2*el.M - qDegreesToRadians(3));
-                lon_ecl += qDegreesToRadians(0.046) * sin(2*M_jupiter - 6*el.M - qDegreesToRadians(69));
-                lon_ecl += qDegreesToRadians(0.014) * sin(M_jupiter - 3*el.M + qDegreesToRadians(32));
-                lat_ecl -= qDegreesToRadians(0.020) * cos(2*M_jupiter - 4*el.M - qDegreesToRadians(2));
-                lat_ecl += qDegreesToRadians(0.018) * sin(2*M_jupiter - 6*el.M - qDegreesToRadians(49));
-            }
-            else if (body.name == "uranus") {
-                double M_saturn = elements.value("saturn").M;
-                double M_jupiter = elements.value("jupiter").M;
-                lon_ecl += qDegreesToRadians(0.040) * sin(M_saturn - 2*el.M + qDegreesToRadians(6));
-                lon_ecl += qDegreesToRadians(0.035) * sin(M_saturn - 3*el.M + qDegreesToRadians(33));
-                lon_ecl -= qDegreesToRadians(0.015) * sin(M_jupiter - el.M + qDegreesToRadians(20));
-            }
-        }
 
-        // heliocentric, ecliptic. For the moon this is geocentric.
-        xh = r * cos(lon_ecl) * cos(lat_ecl);
-        yh = r * sin(lon_ecl) * cos(lat_ecl);
-        zh = r                 * sin(lat_ecl);
+// The batch kernel built with AVX2 and FMA runs on CPUs that have them, whatever the rest of the program was
+// compiled for. OBSERVE_DISABLE_AVX2 in the environment keeps to the baseline kernel, to test it on such a CPU.
+static bool useAvx2Kernel() {
+#if defined(OBSERVE_AVX2_KERNEL) && defined(__GNUC__)
+    static const bool supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+                                  && qEnvironmentVariableIsEmpty("OBSERVE_DISABLE_AVX2");
+    return supported;
+#elif defined(OBSERVE_AVX2_KERNEL) && defined(_MSC_VER) && defined(_M_X64)
+    static const bool supported = []() {
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) return false;
+        __cpuid(info, 1);
+        bool fma = info[2] & (1 << 12), os_saves_ymm = info[2] & (1 << 27), avx = info[2] & (1 << 28);
+        if (!fma || !os_saves_ymm || !avx || (_xgetbv(0) & 6) != 6) return false;
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0 && qEnvironmentVariableIsEmpty("OBSERVE_DISABLE_AVX2");
+    }();
+    return supported;
+#else
+    return false;
+#endif
+}
 
-        double xg;
-        double yg;
-        double zg;
+int calc::positionSeriesLanes() {
+    return useAvx2Kernel() ? 4 : SIMD_LANES;
+}
 
-        if (body.name == "moon") {
-            // The moon is already in geocentric. We just convert from Earth radii to AU.
-            xg = xh * 4.258750455597227e-5;
-            yg = yh * 4.258750455597227e-5;
-            zg = zh * 4.258750455597227e-5;
-        }
-        else {
-            double xs = r_sun * cos(lon_sun);
-            double ys = r_sun * sin(lon_sun);
-
-            // geocentric, ecliptic
-            xg = xh + xs;
-            yg = yh + ys;
-            zg = zh;
+void calc::calculatePositionSeries(const QList<CelestialBody> &bodies, const double *days, qsizetype count, PositionSeries *series,
+                                   AccuracyTier tier) {
+    qsizetype body_count = bodies.size();
+    series->body_count = body_count;
+    series->count = count;
+    series->x.resize(body_count * count);
+    series->y.resize(body_count * count);
+    series->z.resize(body_count * count);
+    if (body_count == 0 || count == 0) return;
+
+    ResolvedBodies resolved = resolveBodies(bodies, tier);
+    auto kernel = POSITION_KERNEL::positionBlocks;
+#if defined(OBSERVE_AVX2_KERNEL)
+    if (useAvx2Kernel()) kernel = calc::positionBlocksAvx2;
+#endif
+    int lanes = positionSeriesLanes();
+    f64 *x = series->x.data();
+    f64 *y = series->y.data();
+    f64 *z = series->z.data();
+
+    qsizetype blocks = count - count % lanes;
+    kernel(bodies.constData(), body_count, resolved, days, blocks, x, y, z, count);
+
+    if (blocks < count) {
+        // Pad the last block by repeating the last instant, and only copy out the lanes we asked for.
+        f64 tail_days[4];
+        for (int lane = 0; lane < lanes; lane++) {
+            tail_days[lane] = days[qMin(blocks + lane, count - 1)];
         }
 
-        // geocentric, equatorial
-        double xe = xg;
-        double ye = yg * cos(ecliptic_obliquity) - zg * sin(ecliptic_obliquity);
-        double ze = yg * sin(ecliptic_obliquity) + zg * cos(ecliptic_obliquity);
-
-        double len = sqrt(xe*xe + ye*ye + ze*ze);
-        xe *= 1.0 / len;
-        ye *= 1.0 / len;
-        ze *= 1.0 / len;
-
-        positions.append({xe, ye, ze});
-
-        //if (body.name == "jupiter") {
-        //    double RA   = atan2(ye, xe);
-        //    double decl = atan2(ze, sqrt(xe*xe + ye*ye));
-        //    qDebug() << body.name;
-        //    printRightAscension(RA);
-        //    printDeclination(decl);
-        //    qDebug() << "";
-        //}
+        QVarLengthArray<f64, 3 * 16 * 4> tail(3 * body_count * lanes);
+        f64 *tail_x = tail.data();
+        f64 *tail_y = tail_x + body_count * lanes;
+        f64 *tail_z = tail_y + body_count * lanes;
+        kernel(bodies.constData(), body_count, resolved, tail_days, lanes, tail_x, tail_y, tail_z, lanes);
+
+        for (qsizetype b = 0; b < body_count; b++) {
+            for (qsizetype t = blocks; t < count; t++) {
+                x[b * count + t] = tail_x[b * lanes + t - blocks];
+                y[b * count + t] = tail_y[b * lanes + t - blocks];
+                z[b * count + t] = tail_z[b * lanes + t - blocks];
+            }
+        }
     }
-    return positions;
 }
 
 
@@ -279,6 +259,60 @@ dVector3D calc::RADeclinationToCartesian(double RA, double declination, double d
     return result;
 }
 
+// Same swap as RADeclinationToCartesian: scene (x, y, z) is equatorial (x, z, -y).
+static void equatorialToScene(const double equatorial[3][3], double matrix[3][3]) {
+    const int axis[3] = {0, 2, 1};
+    const double sign[3] = {1.0, 1.0, -1.0};
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            matrix[i][j] = sign[i] * sign[j] * equatorial[axis[i]][axis[j]];
+        }
+    }
+}
+
+void calc::precessionMatrix(double years, double matrix[3][3]) {
+    // IAU 1976 precession angles (Lieske 1979), Meeus chapter 21, with J2000 as the starting epoch.
+    double T = years / 100.0;
+    double zeta  = qDegreesToRadians((2306.2181 * T + 0.30188 * T * T + 0.017998 * T * T * T) / 3600.0);
+    double z     = qDegreesToRadians((2306.2181 * T + 1.09468 * T * T + 0.018203 * T * T * T) / 3600.0);
+    double theta = qDegreesToRadians((2004.3109 * T - 0.42665 * T * T - 0.041833 * T * T * T) / 3600.0);
+
+    // P = Rz(z) * Ry(-theta) * Rz(zeta) in the equatorial frame, Z towards the pole.
+    double cz = cos(zeta), sz = sin(zeta);
+    double cZ = cos(z),    sZ = sin(z);
+    double ct = cos(theta), st = sin(theta);
+    double P[3][3] = {
+        { cZ * ct * cz - sZ * sz, -cZ * ct * sz - sZ * cz, -cZ * st},
+        { sZ * ct * cz + cZ * sz, -sZ * ct * sz + cZ * cz, -sZ * st},
+        { st * cz,                -st * sz,                 ct     },
+    };
+
+    equatorialToScene(P, matrix);
+}
+
+// Meeus chapter 22, the low accuracy series: good to about half an arcsecond in longitude and a tenth of one in
+// obliquity. N = R1(-eps) * R3(-dpsi) * R1(eps0), rotating mean places of the date to true ones.
+void calc::nutationMatrix(double years, double matrix[3][3]) {
+    double T = years / 100.0;
+    double omega = qDegreesToRadians(125.04452 - 1934.136261 * T);
+    double L     = qDegreesToRadians(280.4665 + 36000.7698 * T);    // mean longitude of the sun
+    double L_moon = qDegreesToRadians(218.3165 + 481267.8813 * T);
+    double delta_psi = qDegreesToRadians((-17.20 * sin(omega) - 1.32 * sin(2.0 * L) - 0.23 * sin(2.0 * L_moon) + 0.21 * sin(2.0 * omega)) / 3600.0);
+    double delta_eps = qDegreesToRadians((9.20 * cos(omega) + 0.57 * cos(2.0 * L) + 0.10 * cos(2.0 * L_moon) - 0.09 * cos(2.0 * omega)) / 3600.0);
+    double eps0 = qDegreesToRadians(23.4392911 - (46.8150 * T + 0.00059 * T * T - 0.001813 * T * T * T) / 3600.0);
+    double eps = eps0 + delta_eps;
+
+    double cp = cos(delta_psi), sp = sin(delta_psi);
+    double ce = cos(eps),       se = sin(eps);
+    double c0 = cos(eps0),      s0 = sin(eps0);
+    double N[3][3] = {
+        { cp,      -sp * c0,                -sp * s0               },
+        { sp * ce,  cp * ce * c0 + se * s0,  cp * ce * s0 - se * c0},
+        { sp * se,  cp * se * c0 - ce * s0,  cp * se * s0 + ce * c0},
+    };
+    equatorialToScene(N, matrix);
+}
+
 float calc::magnitudeToScale(int16_t magnitude, int16_t max_magnitude) {
     // The magnitude scale is inverse logarithmic. We set a reference size for magnitude 1,
     // and then calculate a size from the difference in magnitude.
@@ -3,11 +3,92 @@
 
 #include <QList>
 #include <QDateTime>
+#include <QVarLengthArray>
 #include "datastructures.h"
+#include "kepler.h"
+#include "simd.h"
+
+// Positions of every body at many instants, stored as a structure of arrays. The position of body b
+// at instant t is (x[b * count + t], y[b * count + t], z[b * count + t]). Reusing the same series for
+// repeated sweeps of the same size doesn't reallocate.
+struct PositionSeries {
+    qsizetype body_count;
+    qsizetype count;
+    QList<double> x;
+    QList<double> y;
+    QList<double> z;
+};
+
+// Corrections for the perturbations between bodies, for one instant in f64 or f32, or SIMD_LANES instants (f64xN).
+template <typename Real> struct PerturbationArguments;
+template <typename Real>
+using PerturbationHandler = void (*)(const PerturbationArguments<Real> &args, Real *lon_ecl, Real *lat_ecl, Real *r);
+
+// Which of the perturbation corrections the approximate formulae apply.
+enum PerturbationTerms {
+    AllPerturbations,  // the moon's, and those between Jupiter, Saturn and Uranus
+    MoonPerturbations, // only the moon's, which are by far the largest
+    NoPerturbations,
+};
+
+// Presets of AccuracyTier, from the most accurate to the fastest.
+enum AccuracyLevel {
+    FullAccuracy,
+    FastAccuracy,
+    CoarseAccuracy,
+    FloatAccuracy,
+    RoughAccuracy,
+    AccuracyLevelCount,
+};
+
+// How much of the approximate formulae's accuracy to trade for speed. observe-accuracy measures what each
+// preset costs against a table of reference positions.
+struct AccuracyTier {
+    const char *name;
+    double kepler_tolerance; // radians
+    PerturbationTerms perturbations;
+    bool single_precision; // the single instant path in f32 after the Kepler solve, which stays in f64
+};
+
+// A body list resolved once, so that the per-frame code works with indices and handlers bound up front
+// instead of comparing names. The handlers are null for bodies without perturbation terms.
+struct ResolvedBodies {
+    QVarLengthArray<PerturbationHandler<f64>, 16> perturbation;
+    QVarLengthArray<PerturbationHandler<f32>, 16> float_perturbation;
+    PerturbationTerms perturbations; // the batch path binds its f64xN handlers from these and the indices
+    double kepler_tolerance;
+    bool single_precision;
+    int moon; // index into the body list, or -1 if not present
+    int jupiter;
+    int saturn;
+    int uranus;
+};
 
 namespace calc {
-    QList<dVector3D> calculatePositions(QList<CelestialBody> bodies, QDateTime datetime);
+    AccuracyTier accuracyTier(AccuracyLevel level);
+    // The handlers of the perturbations the tier leaves out are null.
+    ResolvedBodies resolveBodies(const QList<CelestialBody> &bodies, AccuracyTier tier = accuracyTier(FullAccuracy));
+    // The per-frame form of calculatePositions, which doesn't allocate for up to 16 bodies. resolved comes from
+    // resolveBodies(bodies), d from daysSinceJ2000, and positions holds one entry per body. Bodies too eccentric
+    // for the elliptic formulae get NaN. With a mask only the bodies whose entry is true are written.
+    void calculatePositions(const QList<CelestialBody> &bodies, const ResolvedBodies &resolved, double d,
+                            KeplerState *kepler_state, dVector3D *positions, const bool *mask = nullptr);
+    // Pass the same kepler_state for consecutive frames to warm-start the Kepler solver and collect its iteration counts.
+    QList<dVector3D> calculatePositions(const QList<CelestialBody> &bodies, QDateTime datetime, KeplerState *kepler_state = nullptr);
+    // Same math as calculatePositions, evaluated for count instants given as days since J2000 (see daysSinceJ2000).
+    // Consecutive instants are computed together in SIMD lanes. Bodies too eccentric for the elliptic formulae get NaN.
+    // The tier's Kepler tolerance and perturbations apply, the math is always f64.
+    void calculatePositionSeries(const QList<CelestialBody> &bodies, const double *days, qsizetype count, PositionSeries *series,
+                                 AccuracyTier tier = accuracyTier(FullAccuracy));
+    // Instants per block of calculatePositionSeries on this CPU: 4 where the AVX2 kernel runs, else SIMD_LANES.
+    int positionSeriesLanes();
+    double daysSinceJ2000(QDateTime datetime);
     dVector3D RADeclinationToCartesian(double RA, double declination, double distance); // Right ascension and declination expressed in radians.
+    // Rotation from the J2000 mean equator and equinox to those of the date, years Julian years after J2000,
+    // for vectors in the frame of RADeclinationToCartesian. Row major.
+    void precessionMatrix(double years, double matrix[3][3]);
+    // Rotation from the mean equator and equinox of the date to the true ones, in the same frame. Row major.
+    void nutationMatrix(double years, double matrix[3][3]);
     float magnitudeToScale(int16_t magnitude, int16_t max_magnitude = -124);
 }
 
@@ -3,19 +3,15 @@
 
 #include <QString>
 #include <QList>
+#include <QDate>
 #include "datastructures.h"
-
-struct StarEntry {
-    float id;
-    double right_ascension;
-    double declination;
-    char spectral_type[2];
-    int16_t magnitude;
-    float proper_motion_ra;
-    float proper_motion_decl;
-    float scale;
-};
-
+#include "ephemeris_cache.h"
+#include "series_ephemeris.h"
+#include "star_store.h"
+#include "star_tiles.h"
+#include "sky_index.h"
+#include "star_places.h"
+#include "trail_buffer.h"
 
 /*
  * This class loads and holds the data that the other parts of the application need. It's a singleton because
@@ -26,17 +22,34 @@ class DataManager
 {
 public:
     static DataManager *getInstance();
+    // Everything the app shows. Call it before anything reads the data.
+    void loadAppFiles();
     void loadBodies(QString path);
     void loadStarCatalog(QString path);
+    void loadStarTiles(QString path);
+    void loadEphemerisCache(QString path, QDate first, QDate last);
+    void loadSeriesEphemeris(QString directory, SeriesTruncation truncation);
+    // The mean places of m_stars at years since J2000, where StarInstanceTable draws them. Computed when another
+    // epoch is asked for than last time, so only call it when the places are needed.
+    StarPlaces starPlaces(double years);
 
     int m_planet_count;
     QList<CelestialBody> m_planets; // We use the term "planet" here to also include the moon and the sun.
     QList<dVector3D> m_planet_positions;
-    QList<StarEntry> m_stars; // Star catalog data
-    QList<dVector3D> m_star_positions;
+    EphemerisCache m_ephemeris_cache; // Fitted positions of m_planets, used instead of the analytic formulae where available.
+    SeriesEphemeris m_series_ephemeris; // VSOP87 and ELP2000 series for m_planets, if the coefficient files are present.
+    StarStore m_stars; // Star catalog data
+    SkyIndex m_star_index; // of m_stars, for picking
+    float m_star_epoch; // Julian years since J2000 the stars are drawn for
+    StarPlaceKernel m_star_kernel; // moves m_stars to the places of a date
+    StarPlaceBuffer m_star_positions; // places of m_stars from the last call of starPlaces
+    TrailBuffer m_trails; // recent positions of m_planets, appended by the worker every frame
+    StarTileCatalog m_star_tiles; // Larger catalog streamed in around the view, drawn instead of m_stars if present.
 private:
     DataManager();
 
+    StarPlaces m_star_scratch; // the places starPlaces computes into, the previous ones after the swap
+
     static DataManager *instance;
 };
 
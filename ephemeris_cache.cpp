@@ -0,0 +1,359 @@
+#include "ephemeris_cache.h"
+#include "calculate_positions.h"
+#include "types.h"
+#include <QDebug>
+#include <QSaveFile>
+#include <cmath>
+#include <string.h>
+
+#define CACHE_MAGIC "OBSEPHEM"
+#define CACHE_VERSION 1
+#define CHEBYSHEV_DEGREE 12
+#define MAX_SEGMENT_DAYS 256.0
+#define MIN_SEGMENT_DAYS 0.5
+#define SEGMENTS_PER_BATCH 1024
+
+/*
+   File layout. Everything is little-endian and 8 byte aligned, so the coefficients can be read
+   straight from the mapping.
+
+   CacheHeader
+   CacheBody   body_count times, in the same order as the body list
+   f64         coefficients. For each segment of a body: degree+1 for x, then y, then z.
+*/
+struct CacheHeader {
+    char magic[8];
+    u32 version;
+    u32 body_count;
+    f64 first_day;
+    f64 last_day;
+    u64 fingerprint; // of the names and orbital elements the fits were made from
+};
+
+struct CacheBody {
+    f64 segment_days;
+    u32 segment_count;
+    u32 degree;
+    u64 offset; // from the start of the file to the first coefficient
+};
+
+
+static u64 fingerprint(const QList<CelestialBody> &bodies) {
+    // FNV-1a
+    u64 hash = 14695981039346656037ULL;
+    auto mix = [&hash](const void *data, size_t size) {
+        const u8 *bytes = (const u8 *)data;
+        for (size_t i = 0; i < size; i++) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+    };
+
+    for (const CelestialBody &body : bodies) {
+        QByteArray name = body.name.toUtf8();
+        mix(name.constData(), name.size());
+        mix(&body.base_elements, sizeof(body.base_elements));
+        mix(&body.delta, sizeof(body.delta));
+    }
+    return hash;
+}
+
+static double dayNumber(QDate date) {
+    return calc::daysSinceJ2000(QDateTime(date, QTime(0, 0)));
+}
+
+// Chebyshev nodes of the first kind, mapped to the segment [start, start + length].
+static void segmentNodes(double start, double length, double *nodes) {
+    const int n = CHEBYSHEV_DEGREE + 1;
+    for (int k = 0; k < n; k++) {
+        double x = cos(M_PI * (k + 0.5) / n);
+        nodes[k] = start + 0.5 * length * (x + 1.0);
+    }
+}
+
+// Interpolating coefficients from the values at the nodes, i.e. a discrete cosine transform.
+static void fitCoefficients(const double *values, double *coefficients) {
+    const int n = CHEBYSHEV_DEGREE + 1;
+    for (int j = 0; j < n; j++) {
+        double sum = 0.0;
+        for (int k = 0; k < n; k++) {
+            sum += values[k] * cos(M_PI * j * (k + 0.5) / n);
+        }
+        coefficients[j] = (j == 0 ? 1.0 : 2.0) / n * sum;
+    }
+}
+
+// Clenshaw's recurrence for sum(c[j] * T_j(t)), t in [-1, 1].
+static inline double evaluateChebyshev(const double *c, int degree, double t) {
+    double b1 = 0.0;
+    double b2 = 0.0;
+    double two_t = 2.0 * t;
+    for (int j = degree; j >= 1; j--) {
+        double b0 = c[j] + two_t * b1 - b2;
+        b2 = b1;
+        b1 = b0;
+    }
+    return c[0] + t * b1 - b2;
+}
+
+static bool hasNaN(const double *values, int count) {
+    for (int i = 0; i < count; i++) {
+        if (std::isnan(values[i])) return true;
+    }
+    return false;
+}
+
+
+// Picks the longest power of two segment length for each body for which the fit stays within max_error
+// on a sample of segments spread across the range. Bodies that can't be fitted (too eccentric) get 0.
+static QList<double> chooseSegmentLengths(const QList<CelestialBody> &bodies, double first_day, double last_day, double max_error) {
+    const int samples = 16;
+    const int checks  = 8; // points per sample segment, in between the nodes
+    const int n = CHEBYSHEV_DEGREE + 1;
+
+    QList<double> lengths(bodies.size(), 0.0);
+    PositionSeries node_series;
+    PositionSeries check_series;
+
+    for (double length = MAX_SEGMENT_DAYS; length >= MIN_SEGMENT_DAYS; length *= 0.5) {
+        double starts[samples];
+        QList<double> node_days(samples * n);
+        QList<double> check_days(samples * checks);
+        for (int s = 0; s < samples; s++) {
+            double start = first_day + qMax(0.0, last_day - first_day - length) * s / (samples - 1);
+            starts[s] = start;
+            segmentNodes(start, length, node_days.data() + s * n);
+            for (int k = 0; k < checks; k++) {
+                check_days[s * checks + k] = start + length * (k + 0.5) / checks;
+            }
+        }
+        calc::calculatePositionSeries(bodies, node_days.constData(), node_days.size(), &node_series);
+        calc::calculatePositionSeries(bodies, check_days.constData(), check_days.size(), &check_series);
+
+        for (int b = 0; b < bodies.size(); b++) {
+            if (lengths[b] > 0.0) continue;
+
+            double error = 0.0;
+            for (int s = 0; s < samples; s++) {
+                double c[3][CHEBYSHEV_DEGREE + 1];
+                fitCoefficients(node_series.x.constData() + b * node_series.count + s * n, c[0]);
+                fitCoefficients(node_series.y.constData() + b * node_series.count + s * n, c[1]);
+                fitCoefficients(node_series.z.constData() + b * node_series.count + s * n, c[2]);
+
+                for (int k = 0; k < checks; k++) {
+                    qsizetype i = b * check_series.count + s * checks + k;
+                    double t = 2.0 * (check_days[s * checks + k] - starts[s]) / length - 1.0;
+                    double dx = evaluateChebyshev(c[0], CHEBYSHEV_DEGREE, t) - check_series.x[i];
+                    double dy = evaluateChebyshev(c[1], CHEBYSHEV_DEGREE, t) - check_series.y[i];
+                    double dz = evaluateChebyshev(c[2], CHEBYSHEV_DEGREE, t) - check_series.z[i];
+                    error = qMax(error, sqrt(dx*dx + dy*dy + dz*dz));
+                }
+            }
+            // NaN errors never pass, which leaves unfittable bodies at 0.
+            if (error <= max_error) lengths[b] = length;
+        }
+    }
+
+    for (int b = 0; b < bodies.size(); b++) {
+        if (lengths[b] == 0.0) {
+            qWarning() << "Ephemeris cache: no segment length fits" << bodies[b].name << "within" << max_error;
+        }
+    }
+    return lengths;
+}
+
+
+EphemerisCache::EphemerisCache() :
+    m_data(nullptr),
+    m_size(0),
+    m_body_count(0),
+    m_first_day(0.0),
+    m_last_day(0.0)
+{
+}
+
+EphemerisCache::~EphemerisCache() {
+    close();
+}
+
+
+bool EphemerisCache::build(const QList<CelestialBody> &bodies, QDate first, QDate last, QString path, double max_error) {
+    double first_day = dayNumber(first);
+    double last_day  = dayNumber(last);
+    if (bodies.isEmpty() || last_day <= first_day) return false;
+
+    const int n = CHEBYSHEV_DEGREE + 1;
+    const int body_count = bodies.size();
+
+    QList<double> lengths = chooseSegmentLengths(bodies, first_day, last_day, max_error);
+    for (double length : lengths) {
+        if (length == 0.0) return false;
+    }
+
+    QList<CacheBody> table(body_count);
+    u64 data_start = sizeof(CacheHeader) + body_count * sizeof(CacheBody);
+    u64 offset = data_start;
+    for (int b = 0; b < body_count; b++) {
+        table[b].segment_days  = lengths[b];
+        table[b].segment_count = (u32)ceil((last_day - first_day) / lengths[b]);
+        table[b].degree        = CHEBYSHEV_DEGREE;
+        table[b].offset        = offset;
+        offset += (u64)table[b].segment_count * 3 * n * sizeof(f64);
+    }
+    QList<double> coefficients((offset - data_start) / sizeof(f64));
+
+    // Every batch evaluates all bodies anyway, so bodies sharing a segment length are fitted together.
+    QList<double> done_lengths;
+    PositionSeries series;
+    for (int first_body = 0; first_body < body_count; first_body++) {
+        double length = lengths[first_body];
+        if (done_lengths.contains(length)) continue;
+        done_lengths.append(length);
+
+        u32 segment_count = table[first_body].segment_count;
+        for (u32 chunk_start = 0; chunk_start < segment_count; chunk_start += SEGMENTS_PER_BATCH) {
+            u32 chunk = qMin((u32)SEGMENTS_PER_BATCH, segment_count - chunk_start);
+
+            QList<double> node_days(chunk * n);
+            for (u32 s = 0; s < chunk; s++) {
+                segmentNodes(first_day + (chunk_start + s) * length, length, node_days.data() + s * n);
+            }
+            calc::calculatePositionSeries(bodies, node_days.constData(), node_days.size(), &series);
+
+            for (int b = first_body; b < body_count; b++) {
+                if (lengths[b] != length) continue;
+
+                double *body_coefficients = coefficients.data() + (table[b].offset - data_start) / sizeof(f64);
+                for (u32 s = 0; s < chunk; s++) {
+                    const double *values[3] = {
+                        series.x.constData() + b * series.count + s * n,
+                        series.y.constData() + b * series.count + s * n,
+                        series.z.constData() + b * series.count + s * n,
+                    };
+                    for (int axis = 0; axis < 3; axis++) {
+                        if (hasNaN(values[axis], n)) return false;
+                        fitCoefficients(values[axis], body_coefficients + ((chunk_start + s) * 3 + axis) * n);
+                    }
+                }
+            }
+        }
+    }
+
+    CacheHeader header = {};
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version     = CACHE_VERSION;
+    header.body_count  = body_count;
+    header.first_day   = first_day;
+    header.last_day    = last_day;
+    header.fingerprint = fingerprint(bodies);
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Could not write ephemeris cache" << path;
+        return false;
+    }
+    file.write((const char *)&header, sizeof(header));
+    file.write((const char *)table.constData(), table.size() * sizeof(CacheBody));
+    file.write((const char *)coefficients.constData(), coefficients.size() * sizeof(f64));
+    return file.commit();
+}
+
+
+bool EphemerisCache::open(QString path, const QList<CelestialBody> &bodies, QDate first, QDate last) {
+    close();
+
+    m_file.setFileName(path);
+    if (!m_file.exists() || !m_file.open(QIODevice::ReadOnly)) return false;
+
+    m_size = m_file.size();
+    if (m_size >= (qint64)sizeof(CacheHeader)) {
+        m_data = m_file.map(0, m_size);
+    }
+    if (!m_data) {
+        close();
+        return false;
+    }
+
+    CacheHeader header;
+    memcpy(&header, m_data, sizeof(header));
+    bool valid = memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.version == CACHE_VERSION &&
+                 header.body_count == (u32)bodies.size() &&
+                 header.fingerprint == fingerprint(bodies) &&
+                 header.first_day == dayNumber(first) &&
+                 header.last_day == dayNumber(last) &&
+                 m_size >= (qint64)(sizeof(CacheHeader) + header.body_count * sizeof(CacheBody));
+
+    const CacheBody *table = (const CacheBody *)(m_data + sizeof(CacheHeader));
+    for (u32 b = 0; valid && b < header.body_count; b++) {
+        u64 size = (u64)table[b].segment_count * 3 * (table[b].degree + 1) * sizeof(f64);
+        valid = table[b].segment_days > 0.0 &&
+                table[b].segment_count > 0 &&
+                table[b].segment_days * table[b].segment_count >= header.last_day - header.first_day &&
+                table[b].offset % sizeof(f64) == 0 &&
+                table[b].offset + size <= (u64)m_size;
+    }
+
+    if (!valid) {
+        close();
+        return false;
+    }
+
+    m_body_count = header.body_count;
+    m_first_day  = header.first_day;
+    m_last_day   = header.last_day;
+    return true;
+}
+
+void EphemerisCache::close() {
+    if (m_data) {
+        m_file.unmap((uchar *)m_data);
+    }
+    m_file.close();
+    m_data = nullptr;
+    m_size = 0;
+    m_body_count = 0;
+}
+
+bool EphemerisCache::isOpen() const {
+    return m_data != nullptr;
+}
+
+int EphemerisCache::bodyCount() const {
+    return m_body_count;
+}
+
+bool EphemerisCache::contains(double d) const {
+    return m_data && d >= m_first_day && d < m_last_day;
+}
+
+
+bool EphemerisCache::evaluate(double d, dVector3D *positions, const bool *mask) const {
+    if (!contains(d)) return false;
+
+    const CacheBody *table = (const CacheBody *)(m_data + sizeof(CacheHeader));
+    for (int b = 0; b < m_body_count; b++) {
+        if (mask && !mask[b]) continue;
+        const CacheBody &body = table[b];
+        int n = body.degree + 1;
+
+        double position = (d - m_first_day) / body.segment_days;
+        u32 segment = qMin((u32)position, body.segment_count - 1);
+        double t = 2.0 * (position - segment) - 1.0;
+
+        const f64 *c = (const f64 *)(m_data + body.offset) + (u64)segment * 3 * n;
+        double x = evaluateChebyshev(c,         body.degree, t);
+        double y = evaluateChebyshev(c + n,     body.degree, t);
+        double z = evaluateChebyshev(c + 2 * n, body.degree, t);
+
+        // Everything but the sun is a unit vector. The fit is close but not exactly on the sphere.
+        if (b > 0) {
+            double inv_len = 1.0 / sqrt(x*x + y*y + z*z);
+            x *= inv_len;
+            y *= inv_len;
+            z *= inv_len;
+        }
+        positions[b] = {x, y, z};
+    }
+    return true;
+}
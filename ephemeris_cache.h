@@ -0,0 +1,47 @@
+#ifndef EPHEMERISCACHE_H
+#define EPHEMERISCACHE_H
+
+#include <QList>
+#include <QFile>
+#include <QDateTime>
+#include "datastructures.h"
+
+/*
+ * Piecewise Chebyshev fits of calc::calculatePositions for every body over a range of dates, stored in a
+ * binary file that is memory-mapped when opened. Evaluating a cached position is a short Clenshaw
+ * recurrence per coordinate instead of a Kepler solve and the perturbation series.
+ *
+ * Each body gets its own segment length, chosen when building so that the fit stays within max_error
+ * (radians, roughly) of the analytic positions. The moon needs segments of about a week, the outer
+ * planets can use months. Outside the cached range callers fall back to the analytic path.
+ */
+class EphemerisCache {
+public:
+    EphemerisCache();
+    ~EphemerisCache();
+
+    static bool build(const QList<CelestialBody> &bodies, QDate first, QDate last, QString path, double max_error = 1E-8);
+
+    // Maps the file at path. Fails if the file is missing, malformed, or was built from other orbital
+    // elements or for another date range.
+    bool open(QString path, const QList<CelestialBody> &bodies, QDate first, QDate last);
+    void close();
+    bool isOpen() const;
+    int bodyCount() const;
+
+    bool contains(double d) const;
+    // Positions of all bodies at d days since J2000, in the same order and units as calc::calculatePositions.
+    // Returns false, leaving positions untouched, if d is outside the cached range. With a mask, only the
+    // bodies whose entry is true are written.
+    bool evaluate(double d, dVector3D *positions, const bool *mask = nullptr) const;
+
+private:
+    QFile m_file;
+    const uchar *m_data;
+    qint64 m_size;
+    int m_body_count;
+    double m_first_day;
+    double m_last_day;
+};
+
+#endif // EPHEMERISCACHE_H
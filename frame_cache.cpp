@@ -0,0 +1,178 @@
+#include "frame_cache.h"
+
+FrameCache::FrameCache(qsizetype body_count, qint64 budget) {
+    m_body_count = body_count;
+    // The index has two to four slots per entry.
+    qint64 entry_bytes = body_count * sizeof(dVector3D) + sizeof(Entry) + 4 * sizeof(qsizetype);
+    m_capacity = qMax((qsizetype)1, (qsizetype)(budget / entry_bytes));
+    m_entries.reserve(m_capacity);
+    m_positions.reserve(m_capacity * body_count);
+    qsizetype slots = 1;
+    m_slot_shift = 64;
+    while (slots < 2 * m_capacity) {
+        slots *= 2;
+        m_slot_shift--;
+    }
+    m_slots.fill(-1, slots);
+    m_use_counter = 0;
+    m_hits = 0;
+    m_misses = 0;
+}
+
+// Rounds to the nearest multiple of the quantum, also for dates before 1970.
+qint64 FrameCache::key(QDateTime datetime) {
+    qint64 msecs = datetime.toMSecsSinceEpoch();
+    qint64 half = FRAME_CACHE_QUANTUM_MS / 2;
+    return msecs >= 0 ? (msecs + half) / FRAME_CACHE_QUANTUM_MS : -((-msecs + half) / FRAME_CACHE_QUANTUM_MS);
+}
+
+QDateTime FrameCache::keyDate(qint64 key) {
+    return QDateTime::fromMSecsSinceEpoch(key * FRAME_CACHE_QUANTUM_MS, QTimeZone::UTC);
+}
+
+// Fibonacci hashing, which spreads the consecutive keys of nearby dates over the table.
+static qsizetype homeSlot(qint64 key, int shift) {
+    return (qsizetype)(((u64)key * 0x9E3779B97F4A7C15ull) >> shift);
+}
+
+qsizetype FrameCache::findSlot(qint64 key) const {
+    qsizetype mask = m_slots.size() - 1;
+    qsizetype slot = homeSlot(key, m_slot_shift);
+    while (m_slots[slot] >= 0 && m_entries[m_slots[slot]].key != key) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Moves the entries after slot that probed past it back, so that lookups don't need markers for removed keys.
+void FrameCache::removeSlot(qsizetype slot) {
+    qsizetype mask = m_slots.size() - 1;
+    qsizetype next = (slot + 1) & mask;
+    while (m_slots[next] >= 0) {
+        qsizetype home = homeSlot(m_entries[m_slots[next]].key, m_slot_shift);
+        // The entry at next may fill the gap if its home is not in (slot, next], cyclically.
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            m_slots[slot] = m_slots[next];
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+    m_slots[slot] = -1;
+}
+
+bool FrameCache::lookup(QDateTime datetime, dVector3D *positions) {
+    qsizetype entry = m_slots[findSlot(key(datetime))];
+    if (entry < 0) {
+        m_misses++;
+        return false;
+    }
+    m_entries[entry].last_used = ++m_use_counter;
+    memcpy(positions, m_positions.constData() + entry * m_body_count, m_body_count * sizeof(dVector3D));
+    m_hits++;
+    return true;
+}
+
+bool FrameCache::contains(QDateTime datetime) const {
+    return m_slots[findSlot(key(datetime))] >= 0;
+}
+
+void FrameCache::insert(QDateTime datetime, const dVector3D *positions) {
+    qint64 new_key = key(datetime);
+    qsizetype slot = findSlot(new_key);
+    qsizetype entry = m_slots[slot];
+    if (entry < 0 && m_entries.size() < m_capacity) {
+        entry = m_entries.size();
+        m_entries.append({new_key, 0});
+        m_positions.resize(m_entries.size() * m_body_count);
+        m_slots[slot] = entry;
+    }
+    else if (entry < 0) {
+        entry = 0;
+        for (qsizetype i = 1; i < m_entries.size(); i++) {
+            if (m_entries[i].last_used < m_entries[entry].last_used) entry = i;
+        }
+        removeSlot(findSlot(m_entries[entry].key));
+        m_entries[entry].key = new_key;
+        m_slots[findSlot(new_key)] = entry;
+    }
+    m_entries[entry].last_used = ++m_use_counter;
+    memcpy(m_positions.data() + entry * m_body_count, positions, m_body_count * sizeof(dVector3D));
+}
+
+// The entries keep their allocation, so the capacity stays the same.
+void FrameCache::clear() {
+    m_entries.clear();
+    m_positions.clear();
+    m_slots.fill(-1);
+}
+
+qsizetype FrameCache::capacity() const {
+    return m_capacity;
+}
+
+qsizetype FrameCache::size() const {
+    return m_entries.size();
+}
+
+qint64 FrameCache::hits() const {
+    return m_hits;
+}
+
+qint64 FrameCache::misses() const {
+    return m_misses;
+}
+
+
+FramePrefetcher::FramePrefetcher() {
+    m_next = 0;
+}
+
+void FramePrefetcher::dateChanged(QDateTime previous, QDateTime current) {
+    clear();
+    if (!previous.isValid() || !current.isValid()) return;
+
+    // Whole months (and so years) are followed on the calendar, anything else as a fixed time.
+    int months = (current.date().year() - previous.date().year()) * 12 + current.date().month() - previous.date().month();
+    bool monthly = months != 0 && previous.addMonths(months) == current;
+    qint64 step_ms = previous.msecsTo(current);
+    if (monthly || step_ms != 0) {
+        for (int i = 1; i <= FRAME_PREFETCH_STEPS; i++) {
+            m_pending.append(monthly ? current.addMonths(i * months) : current.addMSecs(i * step_ms));
+        }
+        m_pending.append(monthly ? current.addMonths(-months) : current.addMSecs(-step_ms));
+    }
+
+    m_pending.append(current.addDays(1));
+    m_pending.append(current.addDays(-1));
+    m_pending.append(current.addMonths(1));
+    m_pending.append(current.addMonths(-1));
+    m_pending.append(current.addYears(1));
+    m_pending.append(current.addYears(-1));
+}
+
+void FramePrefetcher::monthShown(int year, int month, QDateTime current) {
+    QList<QDateTime> after = m_pending.mid(m_next);
+    clear();
+    QDate first(year, month, 1);
+    if (first.isValid()) {
+        for (int day = 0; day < first.daysInMonth(); day++) {
+            m_pending.append(QDateTime(first.addDays(day), current.time(), current.timeZone()));
+        }
+    }
+    m_pending.append(after);
+}
+
+void FramePrefetcher::clear() {
+    m_pending.clear();
+    m_next = 0;
+}
+
+bool FramePrefetcher::hasNext() const {
+    return m_next < m_pending.size();
+}
+
+bool FramePrefetcher::next(QDateTime *datetime) {
+    if (m_next >= m_pending.size()) return false;
+    *datetime = m_pending[m_next++];
+    return true;
+}
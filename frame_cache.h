@@ -0,0 +1,88 @@
+#ifndef FRAMECACHE_H
+#define FRAMECACHE_H
+
+#include <QList>
+#include <QDateTime>
+#include <QTimeZone>
+#include "types.h"
+#include "datastructures.h"
+
+#define FRAME_CACHE_QUANTUM_MS 1000 // dates this close share an entry, the moon moves half an arcsecond in that time
+#define FRAME_CACHE_MEMORY_BUDGET (4 * 1024 * 1024) // bytes, a few thousand frames of the planets
+#define FRAME_PREFETCH_STEPS 4 // frames ahead in the direction the user is stepping
+
+/*
+ * Computed frames by date, so going back to a date or stepping through nearby ones doesn't compute the
+ * positions again. Dates are rounded to FRAME_CACHE_QUANTUM_MS and the positions are those of the rounded date.
+ *
+ * The entries are allocated once, as many as fit in the memory budget. When they are all used, the least
+ * recently used one is replaced, found by a use counter stamp like StarTileCatalog's tiles. The index from keys
+ * to entries is a hash table with linear probing in a fixed array, since QHash allocates as it fills up, and
+ * the worker's frames must not allocate.
+ */
+class FrameCache {
+public:
+    FrameCache(qsizetype body_count, qint64 budget = FRAME_CACHE_MEMORY_BUDGET);
+
+    static qint64 key(QDateTime datetime);
+    static QDateTime keyDate(qint64 key); // the rounded date the positions of a key are computed for
+
+    // Copies the positions of the date if they are cached. Counts a hit or a miss.
+    bool lookup(QDateTime datetime, dVector3D *positions);
+    bool contains(QDateTime datetime) const;
+    void insert(QDateTime datetime, const dVector3D *positions);
+    // Drops all entries, for when the positions of a date change, like with the precision.
+    void clear();
+
+    qsizetype capacity() const;
+    qsizetype size() const;
+    qint64 hits() const;
+    qint64 misses() const;
+
+private:
+    struct Entry {
+        qint64 key;
+        u64 last_used;
+    };
+
+    // The slot of key in m_slots, or the empty one where it would go.
+    qsizetype findSlot(qint64 key) const;
+    void removeSlot(qsizetype slot);
+
+    qsizetype m_body_count;
+    QList<Entry> m_entries;
+    QList<dVector3D> m_positions; // m_body_count per entry
+    QList<qsizetype> m_slots; // indices into m_entries or -1, a power of two and at least twice the capacity
+    int m_slot_shift; // of the hash, to get an index into m_slots
+    qsizetype m_capacity;
+    u64 m_use_counter;
+    qint64 m_hits;
+    qint64 m_misses;
+};
+
+/*
+ * Guesses which dates the user goes to next, for the worker to put in a FrameCache while it has nothing else to
+ * do. After a date change that's more steps of the same size in the same direction, the step back, and the
+ * neighbouring days, months and years. Steps of whole months or years are followed in calendar months and years.
+ * When the calendar shows another month, it's the days of that month.
+ */
+class FramePrefetcher {
+public:
+    FramePrefetcher();
+
+    // The date went from previous to current. Replaces the dates still pending.
+    void dateChanged(QDateTime previous, QDateTime current);
+    // The calendar shows month (1 to 12) of year. Its days come first, at the time of day of current.
+    void monthShown(int year, int month, QDateTime current);
+    void clear();
+    // Whether next has a date, without taking it.
+    bool hasNext() const;
+    // The next date to compute, false if there is none.
+    bool next(QDateTime *datetime);
+
+private:
+    QList<QDateTime> m_pending;
+    qsizetype m_next;
+};
+
+#endif // FRAMECACHE_H
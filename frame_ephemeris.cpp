@@ -0,0 +1,53 @@
+#include "frame_ephemeris.h"
+
+FrameEphemeris::FrameEphemeris(const QList<CelestialBody> &bodies, const EphemerisCache *ephemeris_cache, const SeriesEphemeris *series_ephemeris) :
+    m_bodies(bodies),
+    m_resolved(calc::resolveBodies(bodies)),
+    m_ephemeris_cache(ephemeris_cache),
+    m_series_ephemeris(series_ephemeris),
+    m_kepler_state(),
+    m_high_precision(false),
+    m_use_cache(true),
+    m_truncation(FullSeries)
+{
+}
+
+qsizetype FrameEphemeris::bodyCount() const {
+    return m_bodies.size();
+}
+
+void FrameEphemeris::setHighPrecision(bool enabled) {
+    m_high_precision = enabled;
+}
+
+bool FrameEphemeris::highPrecision() const {
+    return m_high_precision;
+}
+
+void FrameEphemeris::setAccuracy(AccuracyTier tier) {
+    m_resolved = calc::resolveBodies(m_bodies, tier);
+    AccuracyTier full = calc::accuracyTier(FullAccuracy);
+    m_use_cache = tier.kepler_tolerance == full.kepler_tolerance && tier.perturbations == full.perturbations &&
+                  tier.single_precision == full.single_precision;
+}
+
+void FrameEphemeris::setTruncation(SeriesTruncation truncation) {
+    m_truncation = truncation;
+}
+
+void FrameEphemeris::calculatePositions(QDateTime datetime, dVector3D *positions, const bool *mask) {
+    if (m_high_precision && m_series_ephemeris->bodyCount() == m_bodies.size()) {
+        m_series_ephemeris->evaluate(SeriesEphemeris::terrestrialDays(datetime), positions, mask, m_truncation);
+        return;
+    }
+
+    double d = calc::daysSinceJ2000(datetime);
+    if (m_use_cache && m_ephemeris_cache->bodyCount() == m_bodies.size() && m_ephemeris_cache->evaluate(d, positions, mask)) {
+        return;
+    }
+    calc::calculatePositions(m_bodies, m_resolved, d, &m_kepler_state, positions, mask);
+}
+
+const KeplerStats &FrameEphemeris::keplerStats() const {
+    return m_kepler_state.stats;
+}
@@ -0,0 +1,49 @@
+#ifndef FRAMEEPHEMERIS_H
+#define FRAMEEPHEMERIS_H
+
+#include <QList>
+#include <QDateTime>
+#include "datastructures.h"
+#include "calculate_positions.h"
+#include "ephemeris_cache.h"
+#include "series_ephemeris.h"
+
+/*
+ * The positions of a fixed list of bodies, computed frame after frame. Everything that depends on the list
+ * is done once in the constructor: the bodies are resolved to indices with their perturbation handlers bound,
+ * and the Kepler solver state is sized on the first frame. After that a frame doesn't allocate or touch strings,
+ * and writes into a buffer owned by the caller.
+ *
+ * Picks the source: the series in high precision mode if they are loaded, otherwise the Chebyshev cache inside
+ * its range, and the approximate formulae outside it. The cache is a fit of the formulae at full accuracy, so
+ * with any other tier the formulae are used inside its range too.
+ */
+class FrameEphemeris {
+public:
+    FrameEphemeris(const QList<CelestialBody> &bodies, const EphemerisCache *ephemeris_cache, const SeriesEphemeris *series_ephemeris);
+
+    qsizetype bodyCount() const;
+    void setHighPrecision(bool enabled);
+    bool highPrecision() const;
+    // The tier of the approximate formulae. Any other tier than FullAccuracy turns the cache off.
+    void setAccuracy(AccuracyTier tier);
+    // How many terms of the series to sum, never more than they were loaded with.
+    void setTruncation(SeriesTruncation truncation);
+
+    // Writes bodyCount() positions. Bodies too eccentric for the elliptic formulae get NaN. With a mask, only
+    // the bodies whose entry is true are computed. The others may or may not be written.
+    void calculatePositions(QDateTime datetime, dVector3D *positions, const bool *mask = nullptr);
+    const KeplerStats &keplerStats() const;
+
+private:
+    QList<CelestialBody> m_bodies;
+    ResolvedBodies m_resolved;
+    const EphemerisCache *m_ephemeris_cache;
+    const SeriesEphemeris *m_series_ephemeris;
+    KeplerState m_kepler_state; // Warm starts from the previous frame when outside the cached range.
+    bool m_high_precision;
+    bool m_use_cache; // only with the full tier, which it was fitted to
+    SeriesTruncation m_truncation;
+};
+
+#endif // FRAMEEPHEMERIS_H
@@ -0,0 +1,77 @@
+#include "kepler.h"
+
+#define TWO_PI_F64 6.283185307179586
+
+void calc::solveKepler(const double *M, const double *e, double *E, double *sin_E, double *cos_E, qsizetype count,
+                       KeplerState *state, double tolerance) {
+    bool warm = state && state->M.size() == count && state->E.size() == count && state->cos_E.size() == count;
+    KeplerStats *stats = state ? &state->stats : nullptr;
+    if (state) {
+        state->M.resize(count);
+        state->E.resize(count);
+        state->cos_E.resize(count);
+    }
+
+    for (qsizetype i = 0; i < count; i += SIMD_LANES) {
+        int lanes = (int)qMin<qsizetype>(SIMD_LANES, count - i);
+
+        // Pad a partial register by repeating the last element.
+        f64 lane_M[SIMD_LANES];
+        f64 lane_e[SIMD_LANES];
+        for (int lane = 0; lane < SIMD_LANES; lane++) {
+            qsizetype index = i + qMin(lane, lanes - 1);
+            lane_M[lane] = M[index];
+            lane_e[lane] = e[index];
+        }
+        f64xN mean = simd_load(lane_M);
+        f64xN ecc  = simd_load(lane_e);
+        f64xN E0   = keplerStart(mean, ecc);
+
+        if (warm) {
+            f64 lane_previous_M[SIMD_LANES];
+            f64 lane_previous_E[SIMD_LANES];
+            f64 lane_previous_cos_E[SIMD_LANES];
+            for (int lane = 0; lane < SIMD_LANES; lane++) {
+                qsizetype index = i + qMin(lane, lanes - 1);
+                lane_previous_M[lane]     = state->M[index];
+                lane_previous_E[lane]     = state->E[index];
+                lane_previous_cos_E[lane] = state->cos_E[index];
+            }
+            f64xN delta_M = mean - simd_load(lane_previous_M);
+            delta_M = delta_M - TWO_PI_F64 * simd_round(delta_M * (1.0 / TWO_PI_F64));
+
+            // The previous E solves the new equation up to -dM, so a Newton step from it is free given the
+            // stored cos(E). Its error grows like e * dM^2, while the series start is off by about e^3,
+            // so it is the better guess when |dM| < e.
+            f64xN guess = simd_load(lane_previous_E) + delta_M / (1.0 - ecc * simd_load(lane_previous_cos_E));
+            guess = guess - TWO_PI_F64 * simd_round((guess - mean) * (1.0 / TWO_PI_F64)); // M may have wrapped
+            E0 = simd_select(simd_lt(simd_abs(delta_M), ecc), guess, E0);
+        }
+
+        f64xN result = keplerNewton(mean, ecc, E0, simd_first_lanes(lanes), tolerance, stats);
+
+        // Keep E within a turn of M, so that warm starts don't accumulate whole revolutions.
+        result = result - TWO_PI_F64 * simd_round((result - mean) * (1.0 / TWO_PI_F64));
+
+        f64xN sin_result, cos_result;
+        simd_sincos(result, &sin_result, &cos_result);
+
+        f64 lane_E[SIMD_LANES];
+        f64 lane_sin_E[SIMD_LANES];
+        f64 lane_cos_E[SIMD_LANES];
+        simd_store(lane_E, result);
+        simd_store(lane_sin_E, sin_result);
+        simd_store(lane_cos_E, cos_result);
+        for (int lane = 0; lane < lanes; lane++) {
+            qsizetype index = i + lane;
+            if (E)     E[index]     = lane_E[lane];
+            if (sin_E) sin_E[index] = lane_sin_E[lane];
+            if (cos_E) cos_E[index] = lane_cos_E[lane];
+            if (state) {
+                state->M[index]     = lane_M[lane];
+                state->E[index]     = lane_E[lane];
+                state->cos_E[index] = lane_cos_E[lane];
+            }
+        }
+    }
+}
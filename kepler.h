@@ -0,0 +1,84 @@
+#ifndef KEPLER_H
+#define KEPLER_H
+
+#include <QList>
+#include "simd.h"
+
+#define KEPLER_TOLERANCE 1.7453292519943295E-9 // 1E-7 degrees, in radians
+#define KEPLER_MAX_ITERATIONS 100
+
+// Work done by the Kepler solver, accumulated over calls.
+struct KeplerStats {
+    qint64 solves;
+    qint64 iterations;
+    int max_iterations; // the most any single solve has needed
+};
+
+// The mean and eccentric anomalies from the previous solve, kept between frames so that the next
+// solve can start from where the bodies were instead of from the series approximation.
+struct KeplerState {
+    QList<double> M;
+    QList<double> E;
+    QList<double> cos_E;
+    KeplerStats stats = {};
+};
+
+namespace calc {
+    // Solves Kepler's equation E - e sin(E) = M for count bodies (or instants), SIMD_LANES at a time, and
+    // also returns sin(E) and cos(E) since the callers need them next. Any of the outputs may be null.
+    // With a state from a previous solve of the same count, lanes where M has moved less than e are
+    // warm-started from the previous E. The state is updated for the next call.
+    void solveKepler(const double *M, const double *e, double *E, double *sin_E, double *cos_E, qsizetype count,
+                     KeplerState *state = nullptr, double tolerance = KEPLER_TOLERANCE);
+}
+
+// Newton's method on SIMD_LANES independent problems, starting from E. A lane stops updating after the
+// first step that is within tolerance, so every lane gets exactly the result the scalar loop would.
+// Lanes not in active are left alone and not counted. With sin_E and cos_E, also returns the sine and cosine
+// of the result, carried over the last step from those of the iteration instead of computed again: that step
+// is within tolerance, so the second order terms kept are below 1E-18.
+inline f64xN keplerNewton(f64xN M, f64xN e, f64xN E, f64xN active, double tolerance, KeplerStats *stats,
+                          f64xN *sin_E = nullptr, f64xN *cos_E = nullptr) {
+    int iterations = 0;
+    qint64 lane_iterations = 0;
+    qint64 solves = simd_count(active);
+    f64xN sin_result = simd_set1(0.0), cos_result = simd_set1(1.0);
+
+    for (; iterations < KEPLER_MAX_ITERATIONS && simd_any(active); iterations++) {
+        f64xN sin_step, cos_step;
+        simd_sincos(E, &sin_step, &cos_step);
+        f64xN E_new = E - (E - e * sin_step - M) / (1.0 - e * cos_step);
+        f64xN step  = E_new - E;
+        f64xN done  = simd_le(simd_abs(step), simd_set1(tolerance));
+
+        if (sin_E) {
+            sin_result = simd_select(active, sin_step + step * (cos_step - 0.5 * step * sin_step), sin_result);
+            cos_result = simd_select(active, cos_step - step * (sin_step + 0.5 * step * cos_step), cos_result);
+        }
+        lane_iterations += simd_count(active);
+        E = simd_select(active, E_new, E);
+        active = simd_andnot(done, active);
+    }
+
+    if (stats) {
+        stats->solves += solves;
+        stats->iterations += lane_iterations;
+        if (iterations > stats->max_iterations) stats->max_iterations = iterations;
+    }
+    if (sin_E) {
+        // Lanes that ran out of iterations took a step too long for the series.
+        if (simd_any(active)) simd_sincos(E, &sin_result, &cos_result);
+        *sin_E = sin_result;
+        *cos_E = cos_result;
+    }
+    return E;
+}
+
+// The series approximation used as the cold starting point.
+inline f64xN keplerStart(f64xN M, f64xN e) {
+    f64xN sin_M, cos_M;
+    simd_sincos(M, &sin_M, &cos_M);
+    return M + e * sin_M * (1.0 + e * cos_M);
+}
+
+#endif // KEPLER_H
@@ -0,0 +1,203 @@
+#include "keyframe_ephemeris.h"
+#include <QtMath>
+
+#define NO_KEY_NEEDED -1E300
+
+static double angleBetween(dVector3D a, dVector3D b) {
+    double cx = a.y * b.z - a.z * b.y;
+    double cy = a.z * b.x - a.x * b.z;
+    double cz = a.x * b.y - a.y * b.x;
+    return atan2(sqrt(cx*cx + cy*cy + cz*cz), a.x * b.x + a.y * b.y + a.z * b.z);
+}
+
+static double vectorLength(dVector3D a) {
+    return sqrt(a.x * a.x + a.y * a.y + a.z * a.z);
+}
+
+// Derivative at b of the parabola through the three keys.
+static dVector3D threePointTangent(double a, double b, double c, dVector3D pa, dVector3D pb, dVector3D pc) {
+    double wa = (c - b) / ((b - a) * (c - a));
+    double wc = (b - a) / ((c - b) * (c - a));
+    return {
+        wc * (pc.x - pb.x) + wa * (pb.x - pa.x),
+        wc * (pc.y - pb.y) + wa * (pb.y - pa.y),
+        wc * (pc.z - pb.z) + wa * (pb.z - pa.z),
+    };
+}
+
+// The longest power of two spacing, up to KEYFRAME_MAX_DAYS, in which a body moving at rate moves at most
+// KEYFRAME_ANGLE_DEGREES, and for which the error of the interpolation stays below KEYFRAME_TOLERANCE_ARCSEC.
+// That error grows with the third power of the spacing and the third derivative of the path (jerk), which is
+// largest where the planets turn around in their retrograde loops.
+static double keySpacing(double rate, double jerk) {
+    double longest = KEYFRAME_MAX_DAYS;
+    if (rate > 0.0) longest = qMin(longest, qDegreesToRadians(KEYFRAME_ANGLE_DEGREES) / rate);
+    if (jerk > 0.0) longest = qMin(longest, cbrt(KEYFRAME_ERROR_SCALE * qDegreesToRadians(KEYFRAME_TOLERANCE_ARCSEC / 3600.0) / jerk));
+    double step = KEYFRAME_MAX_DAYS;
+    while (step > longest && step > KEYFRAME_MIN_DAYS) step *= 0.5;
+    return step;
+}
+
+
+KeyframeEphemeris::KeyframeEphemeris(FrameEphemeris *ephemeris) :
+    m_ephemeris(ephemeris),
+    m_tracks(ephemeris->bodyCount()),
+    m_scratch(ephemeris->bodyCount()),
+    m_mask(ephemeris->bodyCount())
+{
+    reset();
+}
+
+void KeyframeEphemeris::reset() {
+    for (Track &track : m_tracks) {
+        track = {};
+    }
+    m_has_origin = false;
+    m_evaluations = 0;
+}
+
+qint64 KeyframeEphemeris::evaluations() const {
+    return m_evaluations;
+}
+
+// The time the track needs a position for next, or NO_KEY_NEEDED. Doesn't change the track, so it can be asked
+// again after other bodies were served.
+double KeyframeEphemeris::nextTime(const Track &track, double t, double step_days) const {
+    if (!track.keyed) {
+        return track.has_last && track.last_t == t ? NO_KEY_NEEDED : t;
+    }
+    if (track.count < 4) {
+        return track.first + track.count * track.step;
+    }
+    if (t <= track.t[2]) {
+        return NO_KEY_NEEDED;
+    }
+
+    // Widen the spacing only where the coarser grid has a key, narrow it right away. Every finer grid has a key
+    // wherever a coarser one has.
+    double step = track.step;
+    double wanted = qMax(keySpacing(track.rate, track.jerk), step_days);
+    if (wanted >= 2.0 * step && fmod(track.t[3], 2.0 * step) == 0.0) step *= 2.0;
+    else if (wanted < step) step = wanted;
+    return track.t[3] + step;
+}
+
+void KeyframeEphemeris::receive(Track *track, double t, dVector3D p) {
+    if (track->has_last && t != track->last_t) {
+        track->rate = angleBetween(track->last_p, p) / fabs(t - track->last_t);
+    }
+    track->last_t = t;
+    track->last_p = p;
+    track->has_last = true;
+
+    if (!track->keyed) return;
+    if (track->count == 4) {
+        for (int k = 0; k < 3; k++) {
+            track->t[k] = track->t[k + 1];
+            track->p[k] = track->p[k + 1];
+        }
+        track->count = 3;
+        track->step = t - track->t[2];
+    }
+    track->t[track->count] = t;
+    track->p[track->count] = p;
+    track->count++;
+    if (track->count < 4) return;
+
+    // Third divided differences of the keys, six of them are the third derivative.
+    const double *k = track->t;
+    const dVector3D *q = track->p;
+    double d[3][3];
+    for (int i = 0; i < 3; i++) {
+        d[i][0] = (q[i + 1].x - q[i].x) / (k[i + 1] - k[i]);
+        d[i][1] = (q[i + 1].y - q[i].y) / (k[i + 1] - k[i]);
+        d[i][2] = (q[i + 1].z - q[i].z) / (k[i + 1] - k[i]);
+    }
+    double jerk[3];
+    for (int c = 0; c < 3; c++) {
+        double a = (d[1][c] - d[0][c]) / (k[2] - k[0]);
+        double b = (d[2][c] - d[1][c]) / (k[3] - k[1]);
+        jerk[c] = 6.0 * (b - a) / (k[3] - k[0]);
+    }
+    double length = qMax(vectorLength(q[2]), 1E-9);
+    track->jerk = sqrt(jerk[0]*jerk[0] + jerk[1]*jerk[1] + jerk[2]*jerk[2]) / length;
+}
+
+void KeyframeEphemeris::calculatePositions(QDateTime datetime, double step_days, dVector3D *positions) {
+    if (!m_has_origin) {
+        m_origin = datetime;
+        m_has_origin = true;
+    }
+    double t = m_origin.msecsTo(datetime) / 86400000.0;
+    qsizetype body_count = m_tracks.size();
+
+    // Interpolate a body only once its rate is known and a key lasts longer than a frame. Keys start over after
+    // a jump, or when the body switches between the two.
+    for (Track &track : m_tracks) {
+        double step = keySpacing(track.rate, track.jerk);
+        bool keyed = track.rate > 0.0 && step >= step_days;
+        if (keyed != track.keyed || (track.count == 4 && (t < track.t[1] || t > track.t[3] + track.step))) {
+            track.keyed = keyed;
+            track.count = 0;
+        }
+        if (track.keyed && track.count == 0) {
+            track.step = step;
+            track.first = floor(t / step) * step - step;
+        }
+    }
+
+    // Serve the earliest time any body needs, together with all other bodies that need the same one. The keys
+    // are on nested grids, so most of them coincide.
+    for (int round = 0; round < 64; round++) {
+        double earliest = NO_KEY_NEEDED;
+        for (const Track &track : m_tracks) {
+            double next = nextTime(track, t, step_days);
+            if (next != NO_KEY_NEEDED && (earliest == NO_KEY_NEEDED || next < earliest)) earliest = next;
+        }
+        if (earliest == NO_KEY_NEEDED) break;
+
+        int count = 0;
+        for (qsizetype b = 0; b < body_count; b++) {
+            m_mask[b] = nextTime(m_tracks[b], t, step_days) == earliest;
+            count += m_mask[b];
+        }
+        m_ephemeris->calculatePositions(m_origin.addMSecs(qRound64(earliest * 86400000.0)), m_scratch.data(), m_mask.data());
+        m_evaluations += count;
+        for (qsizetype b = 0; b < body_count; b++) {
+            if (m_mask[b]) receive(&m_tracks[b], earliest, m_scratch[b]);
+        }
+    }
+
+    for (qsizetype b = 0; b < body_count; b++) {
+        const Track &track = m_tracks[b];
+        if (!track.keyed || track.count < 4) {
+            positions[b] = track.last_p;
+            continue;
+        }
+
+        // Cubic Hermite between the middle keys, with the tangents of the parabolas through each middle key and
+        // its neighbours, which stay accurate where the spacing changes. The curve is scaled to the interpolated
+        // length, so unit vectors stay on the sphere.
+        const double *k = track.t;
+        const dVector3D *p = track.p;
+        double h = k[2] - k[1];
+        double s = (t - k[1]) / h;
+        double s2 = s * s;
+        double s3 = s2 * s;
+        double h00 = 2*s3 - 3*s2 + 1;
+        double h10 = (s3 - 2*s2 + s) * h;
+        double h01 = -2*s3 + 3*s2;
+        double h11 = (s3 - s2) * h;
+        dVector3D m1 = threePointTangent(k[0], k[1], k[2], p[0], p[1], p[2]);
+        dVector3D m2 = threePointTangent(k[1], k[2], k[3], p[1], p[2], p[3]);
+        dVector3D v = {
+            h00 * p[1].x + h10 * m1.x + h01 * p[2].x + h11 * m2.x,
+            h00 * p[1].y + h10 * m1.y + h01 * p[2].y + h11 * m2.y,
+            h00 * p[1].z + h10 * m1.z + h01 * p[2].z + h11 * m2.z,
+        };
+        double length = vectorLength(v);
+        double target = (1.0 - s) * vectorLength(p[1]) + s * vectorLength(p[2]);
+        double scale = length > 0.0 ? target / length : 0.0;
+        positions[b] = {v.x * scale, v.y * scale, v.z * scale};
+    }
+}
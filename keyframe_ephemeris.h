@@ -0,0 +1,65 @@
+#ifndef KEYFRAMEEPHEMERIS_H
+#define KEYFRAMEEPHEMERIS_H
+
+#include <QDateTime>
+#include <QVarLengthArray>
+#include "datastructures.h"
+#include "frame_ephemeris.h"
+
+#define KEYFRAME_ANGLE_DEGREES 5.0 // how far a body may move between two keys
+#define KEYFRAME_TOLERANCE_ARCSEC 5.0 // error of the interpolation, a small fraction of a pixel
+#define KEYFRAME_ERROR_SCALE 10.0 // the error is about jerk * spacing^3 / this, measured for the planets
+#define KEYFRAME_MIN_DAYS (1.0 / 256.0)
+#define KEYFRAME_MAX_DAYS 16.0 // keeps a few keys per retrograde loop even for the slowest planets
+
+/*
+ * Positions for an animation running forward in time, interpolated between keyframes instead of computed for
+ * every frame. Each body gets its own spacing of keys, from how fast it moves across the sky and how sharply its
+ * path bends: the moon gets a key every few hours, the outer planets one every KEYFRAME_MAX_DAYS. Between keys
+ * the position is a cubic Hermite curve through the two keys around the frame, with tangents from the parabolas
+ * through their neighbours. Against the positions computed for every frame that is within 10 arcseconds for all
+ * bodies, a twentieth of a pixel at the default field of view.
+ *
+ * Key spacings are powers of two days and keys sit on multiples of their spacing, so bodies that need a key at
+ * the same time share one call of the ephemeris. Bodies whose spacing would be shorter than a frame are computed
+ * for every frame instead, which is no more work than before.
+ */
+class KeyframeEphemeris {
+public:
+    KeyframeEphemeris(FrameEphemeris *ephemeris);
+
+    // Drops all keys. Needed whenever the date jumps or the positions change in another way.
+    void reset();
+    // step_days is how far the animation moves per frame. Writes a position for every body.
+    void calculatePositions(QDateTime datetime, double step_days, dVector3D *positions);
+    // Bodies computed by the ephemeris since the last reset, to compare against frames times bodies.
+    qint64 evaluations() const;
+
+private:
+    struct Track {
+        bool keyed;   // interpolated between keys, otherwise computed every frame
+        int count;    // of keys, 0 to 4. With 4 keys the frame is between the middle two.
+        double step;  // days between keys
+        double first; // time of the first key while count < 4
+        double t[4];  // days since m_origin
+        dVector3D p[4];
+        double rate;  // radians per day, from the last two positions computed. 0 until there are two.
+        double jerk;  // radians per day cubed, from the last four keys. 0 until there are four.
+        double last_t;
+        dVector3D last_p;
+        bool has_last;
+    };
+
+    double nextTime(const Track &track, double t, double step_days) const;
+    void receive(Track *track, double t, dVector3D p);
+
+    FrameEphemeris *m_ephemeris;
+    QVarLengthArray<Track, 16> m_tracks;
+    QVarLengthArray<dVector3D, 16> m_scratch;
+    QVarLengthArray<bool, 16> m_mask;
+    QDateTime m_origin; // the date of the first frame after a reset
+    bool m_has_origin;
+    qint64 m_evaluations;
+};
+
+#endif // KEYFRAMEEPHEMERIS_H
@@ -2,11 +2,16 @@
 #include <QQmlApplicationEngine>
 #include <QtQuick3D/qquick3d.h>
 #include <QImageReader>
+#include <QQuickWindow>
 
 #include "datamanager.h"
 #include "planetmodel.h"
 #include "starInstanceTable.h"
+#include "planetInstanceTable.h"
+#include "trailGeometry.h"
 #include "selectionhandler.h"
+#include "metricsmodel.h"
+#include "trace.h"
 
 #ifdef Q_OS_WIN32
 #ifndef NOMINMAX
@@ -23,25 +28,67 @@ int main(int argc, char *argv[])
 
     QGuiApplication app(argc, argv);
 
+    // OBSERVE_TRACE=file.json records where the time of each frame goes, written on Ctrl+Shift+T and on exit.
+    QString trace_path = qEnvironmentVariable("OBSERVE_TRACE");
+    if (!trace_path.isEmpty()) {
+        trace::start(trace_path);
+    }
+
     QSurfaceFormat::setDefaultFormat(QQuick3D::idealSurfaceFormat());
     //QImageReader::setAllocationLimit(512+64);
 
+    DataManager::getInstance()->loadAppFiles();
     PlanetModel planet_model;
     StarInstanceTable star_instance_table;
+    PlanetInstanceTable planet_instance_table;
+    QObject::connect(&planet_model, &PlanetModel::positionsChanged,
+                     &planet_instance_table, &PlanetInstanceTable::updatePositions);
+    TrailGeometry trail_geometry;
+    QObject::connect(&planet_model, &PlanetModel::positionsChanged,
+                     &trail_geometry, [&]() { trail_geometry.updateTrails(planet_model.trailEnd()); });
     SelectionHandler selection_handler;
+    MetricsModel metrics_model;
 
     QQmlApplicationEngine engine;
     engine.setInitialProperties({
         {"planetModel", QVariant::fromValue(&planet_model)},
         {"starInstanceTable", QVariant::fromValue(&star_instance_table)},
-        {"selectionHandler", QVariant::fromValue(&selection_handler)}
+        {"planetInstanceTable", QVariant::fromValue(&planet_instance_table)},
+        {"trailGeometry", QVariant::fromValue(&trail_geometry)},
+        {"selectionHandler", QVariant::fromValue(&selection_handler)},
+        {"metricsModel", QVariant::fromValue(&metrics_model)}
     });
     QObject::connect(&engine, &QQmlApplicationEngine::objectCreationFailed,
         &app, []() { QCoreApplication::exit(-1); },
         Qt::QueuedConnection);
     engine.loadFromModule("observe", "Main");
 
+    QQuickWindow *window = qobject_cast<QQuickWindow*>(engine.rootObjects().value(0));
+    if (window) {
+        // Ends the latency of the frame the UI thread fetched last, see MetricsRegistry.
+        QObject::connect(window, &QQuickWindow::frameSwapped, window,
+                         []() { MetricsRegistry::getInstance()->frameRendered(); }, Qt::DirectConnection);
+    }
+
+#ifdef OBSERVE_TRACING
+    // The render thread's part of each frame, next to the worker's and the UI thread's. Only touched on that thread.
+    static qint64 sync_start = -1, render_start = -1;
+    if (window) {
+        QObject::connect(window, &QQuickWindow::beforeSynchronizing, window,
+                         []() { sync_start = trace::enabled() ? trace::now() : -1; }, Qt::DirectConnection);
+        QObject::connect(window, &QQuickWindow::afterSynchronizing, window, []() {
+            if (sync_start >= 0) trace::complete("synchronize", sync_start, trace::now());
+        }, Qt::DirectConnection);
+        QObject::connect(window, &QQuickWindow::beforeRendering, window,
+                         []() { render_start = trace::enabled() ? trace::now() : -1; }, Qt::DirectConnection);
+        QObject::connect(window, &QQuickWindow::afterRendering, window, []() {
+            if (render_start >= 0) trace::complete("render", render_start, trace::now());
+        }, Qt::DirectConnection);
+    }
+#endif
+
     int exec_result = app.exec();
+    trace::save();
 
 #ifdef Q_OS_WIN32
     timeEndPeriod(1); // Reduce timer resolution Windows.
@@ -0,0 +1,112 @@
+#include "metrics.h"
+#include <QFile>
+#include <QtAlgorithms>
+#include <QtMath>
+#include "trace.h"
+
+#if defined(Q_OS_WIN32)
+#ifndef NOMINMAX
+    #define NOMINMAX
+#endif
+#include <Windows.h>
+#include <psapi.h> // GetProcessMemoryInfo, in kernel32 since Windows 7
+#elif defined(Q_OS_MACOS)
+#include <mach/mach.h>
+#elif defined(Q_OS_LINUX)
+#include <unistd.h>
+#endif
+
+void MetricsHistogram::record(qint64 value) {
+    m_counts[bucket(value)].fetchAndAddRelaxed(1);
+}
+
+void MetricsHistogram::counts(u64 *out) const {
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        out[i] = m_counts[i].loadRelaxed();
+    }
+}
+
+int MetricsHistogram::bucket(qint64 value) {
+    if (value < 2 * METRICS_SUB_BUCKETS) return (int)qMax(value, (qint64)0);
+    int exponent = 63 - qCountLeadingZeroBits((quint64)value);
+    int sub_bucket = (int)(value >> (exponent - METRICS_SUB_BUCKET_BITS)) & (METRICS_SUB_BUCKETS - 1);
+    return (exponent - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS + sub_bucket;
+}
+
+qint64 MetricsHistogram::bucketValue(int bucket) {
+    if (bucket < 2 * METRICS_SUB_BUCKETS) return bucket;
+    int exponent = bucket / METRICS_SUB_BUCKETS + METRICS_SUB_BUCKET_BITS - 1;
+    qint64 width = (qint64)1 << (exponent - METRICS_SUB_BUCKET_BITS);
+    return (METRICS_SUB_BUCKETS + bucket % METRICS_SUB_BUCKETS) * width + width / 2;
+}
+
+qint64 MetricsHistogram::percentile(const u64 *counts, double fraction) {
+    u64 total = 0;
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        total += counts[i];
+    }
+    if (total == 0) return -1;
+
+    // The bucket of the value that fraction of the values are at or below.
+    u64 rank = qMax((u64)1, (u64)ceil(fraction * total));
+    u64 seen = 0;
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) return bucketValue(i);
+    }
+    return bucketValue(METRICS_HISTOGRAM_BUCKETS - 1);
+}
+
+
+MetricsRegistry::MetricsRegistry() : m_fetched_tick(-1) {
+}
+
+// Unlike DataManager's, this one is created on first use from whichever thread gets there first.
+MetricsRegistry *MetricsRegistry::getInstance() {
+    static MetricsRegistry instance;
+    return &instance;
+}
+
+qint64 MetricsRegistry::value(Counter counter) const {
+    return m_counters[counter].loadRelaxed();
+}
+
+qint64 MetricsRegistry::value(Gauge gauge) const {
+    return m_gauges[gauge].loadRelaxed();
+}
+
+const MetricsHistogram &MetricsRegistry::histogram(Histogram histogram) const {
+    return m_histograms[histogram];
+}
+
+// A frame fetched but not rendered yet is replaced, the render thread only sees the latest one.
+void MetricsRegistry::frameFetched(qint64 tick_ns) {
+    m_fetched_tick.storeRelaxed(tick_ns);
+}
+
+void MetricsRegistry::frameRendered() {
+    qint64 tick_ns = m_fetched_tick.fetchAndStoreRelaxed(-1);
+    if (tick_ns >= 0) record(FrameLatencyNs, trace::now() - tick_ns);
+}
+
+qint64 MetricsRegistry::processMemory() {
+#if defined(Q_OS_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return -1;
+    return (qint64)counters.WorkingSetSize;
+#elif defined(Q_OS_MACOS)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) return -1;
+    return (qint64)info.resident_size;
+#elif defined(Q_OS_LINUX)
+    // Total and resident size in pages.
+    QFile file("/proc/self/statm");
+    if (!file.open(QFile::ReadOnly)) return -1;
+    QList<QByteArray> fields = file.readAll().split(' ');
+    if (fields.size() < 2) return -1;
+    return fields[1].toLongLong() * sysconf(_SC_PAGESIZE);
+#else
+    return -1;
+#endif
+}
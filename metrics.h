@@ -0,0 +1,91 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QAtomicInteger>
+#include "types.h"
+
+#define METRICS_SUB_BUCKET_BITS 3 // each power of two is split into 8 buckets, so a bucket is at most 12.5% wide
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_HISTOGRAM_BUCKETS ((64 - METRICS_SUB_BUCKET_BITS) * METRICS_SUB_BUCKETS) // covers all of qint64
+
+/*
+ * Counts of values in buckets, for percentiles of times in nanoseconds. The buckets are log-linear: the values
+ * below 2 * METRICS_SUB_BUCKETS have a bucket each, above that each power of two is split into
+ * METRICS_SUB_BUCKETS equal parts. Any thread can record, a bucket is a single atomic increment. Readers copy the
+ * counts and take the difference of two copies for the values recorded in between.
+ */
+class MetricsHistogram {
+public:
+    void record(qint64 value);
+    void counts(u64 *out) const; // METRICS_HISTOGRAM_BUCKETS of them
+
+    static int bucket(qint64 value);
+    static qint64 bucketValue(int bucket); // the middle of the bucket
+    // Of counts as copied by counts(), or the difference of two copies. -1 if they are all 0.
+    static qint64 percentile(const u64 *counts, double fraction);
+
+private:
+    QAtomicInteger<u64> m_counts[METRICS_HISTOGRAM_BUCKETS];
+};
+
+/*
+ * Live numbers about the app, for the performance overlay. The threads doing the work update them without locks
+ * (every update is a single relaxed atomic operation) and the UI thread samples them a few times a second.
+ * Counters only go up, the reader turns them into rates. Gauges hold the latest value.
+ *
+ * The latency of a frame is measured from the tick that made the worker compute it to the end of the render
+ * pass that drew it: the UI thread hands the tick time of the frame it fetched over to the render thread, which
+ * records it when the frame is swapped. Times are on trace::now()'s clock, which all threads share.
+ */
+class MetricsRegistry {
+public:
+    enum Counter {
+        WorkerFrames,          // computed by WorkerThread
+        InstanceBytesUploaded, // instance buffers handed to Qt Quick 3D
+        CounterCount,
+    };
+    enum Gauge {
+        StarsDrawn,     // instances of the star table drawn, after the magnitude limit
+        CatalogStars,   // in DataManager's BSC5 catalog
+        StarTileBytes,  // of the star tiles DataManager has loaded
+        GaugeCount,
+    };
+    enum Histogram {
+        EphemerisNs,    // positions of one frame, by WorkerThread
+        FrameLatencyNs, // from the tick to the rendered frame
+        HistogramCount,
+    };
+
+    static MetricsRegistry *getInstance();
+
+    void add(Counter counter, qint64 amount = 1) {
+        m_counters[counter].fetchAndAddRelaxed(amount);
+    }
+    void set(Gauge gauge, qint64 value) {
+        m_gauges[gauge].storeRelaxed(value);
+    }
+    void record(Histogram histogram, qint64 value) {
+        m_histograms[histogram].record(value);
+    }
+    qint64 value(Counter counter) const;
+    qint64 value(Gauge gauge) const;
+    const MetricsHistogram &histogram(Histogram histogram) const;
+
+    // UI thread, for a frame it fetched from the worker. tick_ns is when the worker was ticked for it.
+    void frameFetched(qint64 tick_ns);
+    // Render thread, after a frame was swapped. Records the latency of the last frame fetched, if any.
+    void frameRendered();
+
+    // Resident memory of the process in bytes, -1 where that isn't known.
+    static qint64 processMemory();
+
+private:
+    MetricsRegistry();
+
+    QAtomicInteger<qint64> m_counters[CounterCount];
+    QAtomicInteger<qint64> m_gauges[GaugeCount];
+    MetricsHistogram m_histograms[HistogramCount];
+    QAtomicInteger<qint64> m_fetched_tick; // -1 once the render thread took it
+};
+
+#endif // METRICS_H
@@ -0,0 +1,109 @@
+#include "metricsmodel.h"
+#include <QtMath>
+
+MetricsModel::MetricsModel(QObject *parent) : QObject(parent) {
+    m_registry = MetricsRegistry::getInstance();
+    m_previous_frames = 0;
+    m_previous_uploaded = 0;
+    m_previous_ephemeris.fill(0, METRICS_HISTOGRAM_BUCKETS);
+    m_previous_latency.fill(0, METRICS_HISTOGRAM_BUCKETS);
+    m_counts.resize(METRICS_HISTOGRAM_BUCKETS);
+    m_ticks_per_second = 0.0;
+    m_ephemeris_p50 = NAN;
+    m_ephemeris_p99 = NAN;
+    m_latency_p50 = NAN;
+    m_latency_p99 = NAN;
+    m_stars_drawn = 0;
+    m_catalog_stars = 0;
+    m_upload_rate = 0.0;
+    m_uploaded_bytes = 0;
+    m_process_memory = -1;
+    m_star_data_bytes = 0;
+}
+
+double MetricsModel::ticksPerSecond() const {
+    return m_ticks_per_second;
+}
+
+double MetricsModel::ephemerisP50() const {
+    return m_ephemeris_p50;
+}
+
+double MetricsModel::ephemerisP99() const {
+    return m_ephemeris_p99;
+}
+
+double MetricsModel::latencyP50() const {
+    return m_latency_p50;
+}
+
+double MetricsModel::latencyP99() const {
+    return m_latency_p99;
+}
+
+qint64 MetricsModel::starsDrawn() const {
+    return m_stars_drawn;
+}
+
+qint64 MetricsModel::catalogStars() const {
+    return m_catalog_stars;
+}
+
+double MetricsModel::uploadRate() const {
+    return m_upload_rate;
+}
+
+qint64 MetricsModel::uploadedBytes() const {
+    return m_uploaded_bytes;
+}
+
+qint64 MetricsModel::processMemory() const {
+    return m_process_memory;
+}
+
+qint64 MetricsModel::starDataBytes() const {
+    return m_star_data_bytes;
+}
+
+// Of the values recorded since the previous call, in milliseconds. Moves previous up to the current counts.
+void MetricsModel::percentiles(MetricsRegistry::Histogram histogram, QList<u64> *previous, double *p50, double *p99) {
+    m_registry->histogram(histogram).counts(m_counts.data());
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        u64 count = m_counts[i];
+        m_counts[i] = count - (*previous)[i];
+        (*previous)[i] = count;
+    }
+    qint64 median = MetricsHistogram::percentile(m_counts.constData(), 0.5);
+    qint64 high = MetricsHistogram::percentile(m_counts.constData(), 0.99);
+    *p50 = median < 0 ? NAN : median * 1E-6;
+    *p99 = high < 0 ? NAN : high * 1E-6;
+}
+
+void MetricsModel::sample() {
+    qint64 elapsed_ns = m_timer.isValid() ? m_timer.nsecsElapsed() : -1;
+    m_timer.start();
+    bool restart = elapsed_ns <= 0 || elapsed_ns > METRICS_MAX_WINDOW_MS * 1000000LL;
+
+    qint64 frames = m_registry->value(MetricsRegistry::WorkerFrames);
+    qint64 uploaded = m_registry->value(MetricsRegistry::InstanceBytesUploaded);
+    double ephemeris_p50, ephemeris_p99, latency_p50, latency_p99;
+    percentiles(MetricsRegistry::EphemerisNs, &m_previous_ephemeris, &ephemeris_p50, &ephemeris_p99);
+    percentiles(MetricsRegistry::FrameLatencyNs, &m_previous_latency, &latency_p50, &latency_p99);
+    if (!restart) {
+        m_ticks_per_second = (frames - m_previous_frames) * 1E9 / elapsed_ns;
+        m_upload_rate = (uploaded - m_previous_uploaded) * 1E9 / elapsed_ns;
+        m_ephemeris_p50 = ephemeris_p50;
+        m_ephemeris_p99 = ephemeris_p99;
+        m_latency_p50 = latency_p50;
+        m_latency_p99 = latency_p99;
+    }
+    m_previous_frames = frames;
+    m_previous_uploaded = uploaded;
+
+    m_uploaded_bytes = uploaded;
+    m_stars_drawn = m_registry->value(MetricsRegistry::StarsDrawn);
+    m_catalog_stars = m_registry->value(MetricsRegistry::CatalogStars);
+    m_star_data_bytes = m_registry->value(MetricsRegistry::StarTileBytes);
+    m_process_memory = MetricsRegistry::processMemory();
+    emit sampled();
+}
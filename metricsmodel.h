@@ -0,0 +1,77 @@
+#ifndef METRICSMODEL_H
+#define METRICSMODEL_H
+
+#include <QObject>
+#include <QQmlEngine>
+#include <QElapsedTimer>
+#include <QList>
+#include "metrics.h"
+
+#define METRICS_MAX_WINDOW_MS 2000 // a longer gap between samples (the overlay was hidden) starts over
+
+/*
+ * The numbers of the performance overlay, sampled from the MetricsRegistry. Rates and percentiles are over the
+ * time since the previous sample, the overlay samples a few times a second while it is shown. Times are in
+ * milliseconds, percentiles are NaN if nothing was recorded since the previous sample.
+ */
+class MetricsModel : public QObject {
+    Q_OBJECT
+    QML_ELEMENT
+    Q_PROPERTY(double ticksPerSecond READ ticksPerSecond NOTIFY sampled) // frames computed by the worker
+    Q_PROPERTY(double ephemerisP50 READ ephemerisP50 NOTIFY sampled)
+    Q_PROPERTY(double ephemerisP99 READ ephemerisP99 NOTIFY sampled)
+    Q_PROPERTY(double latencyP50 READ latencyP50 NOTIFY sampled) // from a tick of the worker to the rendered frame
+    Q_PROPERTY(double latencyP99 READ latencyP99 NOTIFY sampled)
+    Q_PROPERTY(qint64 starsDrawn READ starsDrawn NOTIFY sampled)
+    Q_PROPERTY(qint64 catalogStars READ catalogStars NOTIFY sampled)
+    Q_PROPERTY(double uploadRate READ uploadRate NOTIFY sampled) // instance buffer bytes per second
+    Q_PROPERTY(qint64 uploadedBytes READ uploadedBytes NOTIFY sampled) // in total
+    Q_PROPERTY(qint64 processMemory READ processMemory NOTIFY sampled) // resident bytes, -1 if unknown
+    Q_PROPERTY(qint64 starDataBytes READ starDataBytes NOTIFY sampled) // of the streamed star tiles
+
+public:
+    MetricsModel(QObject *parent = 0);
+
+    double ticksPerSecond() const;
+    double ephemerisP50() const;
+    double ephemerisP99() const;
+    double latencyP50() const;
+    double latencyP99() const;
+    qint64 starsDrawn() const;
+    qint64 catalogStars() const;
+    double uploadRate() const;
+    qint64 uploadedBytes() const;
+    qint64 processMemory() const;
+    qint64 starDataBytes() const;
+
+public slots:
+    void sample();
+
+signals:
+    void sampled();
+
+private:
+    void percentiles(MetricsRegistry::Histogram histogram, QList<u64> *previous, double *p50, double *p99);
+
+    MetricsRegistry *m_registry;
+    QElapsedTimer m_timer; // since the previous sample
+    qint64 m_previous_frames;
+    qint64 m_previous_uploaded;
+    QList<u64> m_previous_ephemeris; // bucket counts at the previous sample
+    QList<u64> m_previous_latency;
+    QList<u64> m_counts; // scratch
+
+    double m_ticks_per_second;
+    double m_ephemeris_p50;
+    double m_ephemeris_p99;
+    double m_latency_p50;
+    double m_latency_p99;
+    qint64 m_stars_drawn;
+    qint64 m_catalog_stars;
+    double m_upload_rate;
+    qint64 m_uploaded_bytes;
+    qint64 m_process_memory;
+    qint64 m_star_data_bytes;
+};
+
+#endif // METRICSMODEL_H
@@ -0,0 +1,259 @@
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QTextStream>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QDebug>
+#include <QtMath>
+#include <stdio.h>
+#include "calculate_positions.h"
+#include "orbital_elements.h"
+#include "series_ephemeris.h"
+
+/*
+ * Measures what each AccuracyTier costs in accuracy and what it gains in speed, against a table of reference
+ * positions.
+ *
+ *   observe-accuracy [--elements FILE] [--table FILE] [--budget ARCMIN] [--json FILE]
+ *   observe-accuracy --generate FILE --series DIRECTORY [--elements FILE]
+ *
+ * For every tier it reports the largest angular error of each body over the table, the RMS error over all of
+ * them, and the time per instant for all bodies. With --budget it names the fastest tier whose largest error
+ * is within that many arcminutes, and fails if there is none.
+ *
+ * The table is a CSV of days since J2000 (as calc::daysSinceJ2000 counts them, taken as Terrestrial Time), body
+ * name, right ascension and declination in degrees, geocentric and geometric, for the mean equator and equinox of
+ * date. reference_positions.csv has every body of orbital_elements.txt every 547.3 days from 1700 to 2297, from
+ * ERFA's Simon et al. planets and Meeus moon, independent of the formulae; its header says how. --generate writes
+ * a table for the same instants from the full VSOP87 and ELP2000 series instead, also geometric.
+ */
+
+#define ACCURACY_FIRST_DAY -109572.5 // 1699-12-30 12:00
+#define ACCURACY_STEP_DAYS 547.3 // a year and a half, not a multiple of any period of interest
+#define ACCURACY_INSTANTS 400 // to 2297
+#define ACCURACY_MIN_NS 200000000 // of timing per tier
+
+struct ReferenceRow {
+    double d;
+    qsizetype body; // into the body list
+    double ra; // degrees
+    double declination;
+};
+
+struct TierResult {
+    AccuracyTier tier;
+    QList<double> max_error; // arcseconds, per body
+    double max_error_all;
+    double rms_error;
+    double ns_per_instant;
+};
+
+static const double ARCSEC_PER_RADIAN = 206264.80624709636;
+
+static void toRADeclination(dVector3D p, double *ra, double *declination) {
+    *ra = qRadiansToDegrees(atan2(p.y, p.x));
+    if (*ra < 0.0) *ra += 360.0;
+    *declination = qRadiansToDegrees(atan2(p.z, sqrt(p.x * p.x + p.y * p.y)));
+}
+
+// Angle between the directions, in arcseconds. Stable for small angles, unlike acos of the dot product.
+static double angularError(double ra, double declination, dVector3D p) {
+    double ra_radians = qDegreesToRadians(ra), declination_radians = qDegreesToRadians(declination);
+    double ax = cos(declination_radians) * cos(ra_radians);
+    double ay = cos(declination_radians) * sin(ra_radians);
+    double az = sin(declination_radians);
+    double cx = ay * p.z - az * p.y, cy = az * p.x - ax * p.z, cz = ax * p.y - ay * p.x;
+    return atan2(sqrt(cx * cx + cy * cy + cz * cz), ax * p.x + ay * p.y + az * p.z) * ARCSEC_PER_RADIAN;
+}
+
+static bool readTable(QString path, const QList<CelestialBody> &bodies, QList<ReferenceRow> *rows) {
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly)) {
+        qWarning() << "Could not open file " << path;
+        return false;
+    }
+    QTextStream in(&file);
+    while (!in.atEnd()) {
+        QString line = in.readLine().trimmed();
+        if (line.isEmpty() || line.startsWith("#") || line.startsWith("days")) continue;
+        QStringList parts = line.split(",");
+        qsizetype body = -1;
+        for (qsizetype b = 0; b < bodies.size() && parts.size() == 4; b++) {
+            if (bodies[b].name == parts[1]) body = b;
+        }
+        if (body < 0) {
+            qWarning() << "Skipping a line of" << path << "for a body that isn't in the elements:" << line;
+            continue;
+        }
+        rows->append({parts[0].toDouble(), body, parts[2].toDouble(), parts[3].toDouble()});
+    }
+    return !rows->isEmpty();
+}
+
+static bool writeTable(QString path, const QList<CelestialBody> &bodies, QString series_directory) {
+    SeriesEphemeris series;
+    if (!series.load(series_directory, bodies, FullSeries)) {
+        qWarning() << "Could not load the VSOP87 and ELP2000 series from" << series_directory;
+        return false;
+    }
+    // The formulae and the ERFA table leave out light time, so a generated table must too.
+    series.setLightTime(false);
+
+    QFile file(path);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate | QFile::Text)) {
+        qWarning() << "Could not open file " << path;
+        return false;
+    }
+    QTextStream out(&file);
+    double last_day = ACCURACY_FIRST_DAY + (ACCURACY_INSTANTS - 1) * ACCURACY_STEP_DAYS;
+    out << "# Reference positions for observe-accuracy, from the full VSOP87 and ELP2000 series in " << series_directory << "\n";
+    out << QString::asprintf("# Geocentric and geometric. %d instants every %g days, days %.1f to %.1f as Terrestrial Time\n",
+                             ACCURACY_INSTANTS, ACCURACY_STEP_DAYS, ACCURACY_FIRST_DAY, last_day);
+    out << "days,body,ra,dec\n";
+
+    QList<dVector3D> positions(bodies.size());
+    for (int i = 0; i < ACCURACY_INSTANTS; i++) {
+        double d = ACCURACY_FIRST_DAY + i * ACCURACY_STEP_DAYS;
+        // daysSinceJ2000 counts from 1999-12-31 0:00, the series from J2000.0, a day and a half later.
+        series.evaluate(d - 1.5, positions.data());
+        for (qsizetype b = 0; b < bodies.size(); b++) {
+            if (std::isnan(positions[b].x)) continue;
+            double ra, declination;
+            toRADeclination(positions[b], &ra, &declination);
+            out << QString::asprintf("%.1f,%s,%.10f,%.10f\n", d, qPrintable(bodies[b].name), ra, declination);
+        }
+    }
+    return true;
+}
+
+static TierResult measure(AccuracyTier tier, const QList<CelestialBody> &bodies, const QList<ReferenceRow> &rows) {
+    TierResult result;
+    result.tier = tier;
+    result.max_error.fill(0.0, bodies.size());
+    result.max_error_all = 0.0;
+
+    ResolvedBodies resolved = calc::resolveBodies(bodies, tier);
+    KeplerState kepler_state;
+    QList<dVector3D> positions(bodies.size());
+    double sum_squares = 0.0;
+    double last_d = NAN;
+    for (const ReferenceRow &row : rows) {
+        if (row.d != last_d) {
+            calc::calculatePositions(bodies, resolved, row.d, &kepler_state, positions.data());
+            last_d = row.d;
+        }
+        double error = angularError(row.ra, row.declination, positions[row.body]);
+        if (std::isnan(error)) error = INFINITY;
+        result.max_error[row.body] = qMax(result.max_error[row.body], error);
+        result.max_error_all = qMax(result.max_error_all, error);
+        sum_squares += error * error;
+    }
+    result.rms_error = sqrt(sum_squares / rows.size());
+
+    // Timed over the instants of the table, each call computing all bodies like a frame of the app.
+    QList<double> days;
+    for (const ReferenceRow &row : rows) {
+        if (days.isEmpty() || days.last() != row.d) days.append(row.d);
+    }
+    qint64 instants = 0;
+    volatile double sink = 0.0; // keeps the loop from being optimized away
+    QElapsedTimer timer;
+    timer.start();
+    while (timer.nsecsElapsed() < ACCURACY_MIN_NS) {
+        for (double d : days) {
+            calc::calculatePositions(bodies, resolved, d, &kepler_state, positions.data());
+            sink = sink + positions[0].x;
+        }
+        instants += days.size();
+    }
+    result.ns_per_instant = (double)timer.nsecsElapsed() / instants;
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QStringList arguments = app.arguments().mid(1);
+
+    QString elements_path = "../observe/orbital_elements.txt";
+    QString table_path = "../observe/reference_positions.csv";
+    QString generate_path, series_directory, json_path;
+    double budget_arcmin = -1.0;
+    for (qsizetype i = 0; i < arguments.size(); i++) {
+        bool has_value = i + 1 < arguments.size();
+        if (arguments[i] == "--elements" && has_value) elements_path = arguments[++i];
+        else if (arguments[i] == "--table" && has_value) table_path = arguments[++i];
+        else if (arguments[i] == "--budget" && has_value) budget_arcmin = arguments[++i].toDouble();
+        else if (arguments[i] == "--json" && has_value) json_path = arguments[++i];
+        else if (arguments[i] == "--generate" && has_value) generate_path = arguments[++i];
+        else if (arguments[i] == "--series" && has_value) series_directory = arguments[++i];
+        else {
+            qWarning() << "usage: observe-accuracy [--elements FILE] [--table FILE] [--budget ARCMIN] [--json FILE]";
+            qWarning() << "       observe-accuracy --generate FILE --series DIRECTORY [--elements FILE]";
+            return 2;
+        }
+    }
+    if (!generate_path.isEmpty() && series_directory.isEmpty()) {
+        // A table from the formulae would only check them against themselves.
+        qWarning() << "--generate needs the VSOP87 and ELP2000 series, given with --series";
+        return 2;
+    }
+
+    QList<CelestialBody> bodies;
+    if (!readOrbitalElements(elements_path, &bodies)) {
+        return 1;
+    }
+    if (!generate_path.isEmpty()) {
+        return writeTable(generate_path, bodies, series_directory) ? 0 : 1;
+    }
+
+    QList<ReferenceRow> rows;
+    if (!readTable(table_path, bodies, &rows)) {
+        qWarning() << "No reference positions in" << table_path;
+        return 1;
+    }
+
+    QList<TierResult> results;
+    printf("%-8s %12s %12s %12s", "tier", "ns/instant", "max error\"", "rms error\"");
+    for (const CelestialBody &body : bodies) printf(" %10s", qPrintable(body.name));
+    printf("\n");
+    for (int level = 0; level < AccuracyLevelCount; level++) {
+        TierResult result = measure(calc::accuracyTier((AccuracyLevel)level), bodies, rows);
+        printf("%-8s %12.1f %12.2f %12.2f", result.tier.name, result.ns_per_instant, result.max_error_all, result.rms_error);
+        for (double error : result.max_error) printf(" %10.2f", error);
+        printf("\n");
+        results.append(result);
+    }
+
+    const TierResult *fastest = nullptr;
+    if (budget_arcmin >= 0.0) {
+        for (const TierResult &result : results) {
+            if (result.max_error_all > budget_arcmin * 60.0) continue;
+            if (!fastest || result.ns_per_instant < fastest->ns_per_instant) fastest = &result;
+        }
+        if (fastest) printf("fastest tier within %g arcmin: %s\n", budget_arcmin, fastest->tier.name);
+        else printf("no tier is within %g arcmin\n", budget_arcmin);
+    }
+
+    if (!json_path.isEmpty()) {
+        QJsonArray tiers;
+        for (const TierResult &result : results) {
+            QJsonObject bodies_error;
+            for (qsizetype b = 0; b < bodies.size(); b++) bodies_error[bodies[b].name] = result.max_error[b];
+            tiers.append(QJsonObject{
+                {"tier", result.tier.name},
+                {"ns_per_instant", result.ns_per_instant},
+                {"max_error_arcsec", result.max_error_all},
+                {"rms_error_arcsec", result.rms_error},
+                {"max_error_arcsec_by_body", bodies_error},
+            });
+        }
+        QFile file(json_path);
+        if (!file.open(QFile::WriteOnly | QFile::Truncate) || file.write(QJsonDocument(QJsonObject{{"tiers", tiers}}).toJson()) <= 0) {
+            qWarning() << "Could not write" << json_path;
+            return 1;
+        }
+    }
+    return budget_arcmin >= 0.0 && !fastest ? 1 : 0;
+}
@@ -0,0 +1,602 @@
+#include <QGuiApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QTemporaryDir>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSysInfo>
+#include <QtEndian>
+#include <QDebug>
+#include <QtMath>
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include "calculate_positions.h"
+#include "datamanager.h"
+#include "starInstanceTable.h"
+#include "selectionhandler.h"
+#include "planetmodel.h"
+#include "el_math.h"
+
+/*
+ * Measures the hot paths of the app and the core library.
+ *
+ *   observe-bench [--filter TEXT] [--min-time MS] [--bsc5 FILE] [--json FILE]
+ *   observe-bench --check [--elements FILE]
+ *
+ * Every benchmark runs its body in a loop, doubling the iterations until a run takes at least --min-time
+ * (300 ms by default), and reports the time per call of the body, the items per second (stars, bodies or
+ * instants, as the name says), and the heap allocations per call. --filter only runs the benchmarks whose name
+ * contains the text. --json also writes the results to a file, to compare releases.
+ *
+ * Allocations are counted by wrapping malloc with glibc, which also sees Qt's containers, and by replacing
+ * operator new elsewhere, which doesn't.
+ *
+ * --check runs the checks below instead of the benchmarks and exits with 1 if any of them fails, ctest runs it
+ * as observe-bench-check. --elements reads the bodies from another file than the app's.
+ *
+ * The bodies, the star catalog and tiles and the series are read from the same relative paths as in the app,
+ * so run it from the same directory. The ephemeris cache is built in a temporary directory, the app's is never
+ * touched. Without a display it uses the offscreen platform.
+ */
+
+#define BENCH_BATCH 1024 // values per call for the functions that are too cheap to time one at a time
+#define CHECK_INSTANTS 4001 // spread over 1800 to 2200, odd so that the series also has a partial SIMD block
+#define CHECK_TOLERANCE 1E-12 // between the batch and the per-instant positions, unit vectors and AU
+#define CHECK_WARMUP_FRAMES 500 // of the worker, enough for every buffer and cache to reach its size
+#define CHECK_FRAMES 5000 // of the worker, measured after the warm-up
+#define BENCH_SERIES_DIRECTORY "../observe/ephemerides" // like the app's
+
+static std::atomic<u64> g_allocations(0);
+
+#if defined(__GLIBC__)
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *pointer, size_t size);
+
+extern "C" void *malloc(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *pointer, size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(pointer, size);
+}
+#else
+void *operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *pointer = malloc(size ? size : 1)) return pointer;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *pointer) noexcept {
+    free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept {
+    free(pointer);
+}
+#endif
+
+// Results are added up here, so the compiler can't drop the work that produced them.
+static volatile double g_sink = 0.0;
+
+struct BenchResult {
+    QString name;
+    qint64 iterations;
+    double ns_per_op;
+    qint64 items_per_op;
+    double items_per_second;
+    double allocations_per_op;
+};
+
+class Bench {
+public:
+    Bench(QString filter, qint64 min_ns) : m_filter(filter), m_min_ns(min_ns) {}
+
+    // Times body, which handles items things per call.
+    template <typename F>
+    void run(QString name, qint64 items, F body) {
+        if (!name.contains(m_filter, Qt::CaseInsensitive)) return;
+
+        body(); // warms up caches and lazily built state
+        qint64 iterations = 1;
+        qint64 elapsed = 0;
+        u64 allocations = 0;
+        while (true) {
+            u64 allocations_before = g_allocations.load(std::memory_order_relaxed);
+            QElapsedTimer timer;
+            timer.start();
+            for (qint64 i = 0; i < iterations; i++) {
+                body();
+            }
+            elapsed = timer.nsecsElapsed();
+            allocations = g_allocations.load(std::memory_order_relaxed) - allocations_before;
+            if (elapsed >= m_min_ns) break;
+            iterations *= 2;
+        }
+
+        BenchResult result;
+        result.name = name;
+        result.iterations = iterations;
+        result.ns_per_op = (double)elapsed / iterations;
+        result.items_per_op = items;
+        result.items_per_second = items * 1E9 / result.ns_per_op;
+        result.allocations_per_op = (double)allocations / iterations;
+        m_results.append(result);
+        printf("%-44s %14.1f ns/op %14.0f items/s %10.2f allocs/op\n", qPrintable(name), result.ns_per_op,
+               result.items_per_second, result.allocations_per_op);
+        fflush(stdout);
+    }
+
+    QString filter() const {
+        return m_filter;
+    }
+
+    const QList<BenchResult> &results() const {
+        return m_results;
+    }
+
+private:
+    QString m_filter;
+    qint64 m_min_ns;
+    QList<BenchResult> m_results;
+};
+
+// The BSC5 file with its stars repeated copies times, so StarStore loads a larger catalog of the same layout.
+static bool writeEnlargedCatalog(QString source, QString path, int copies) {
+    QFile in(source);
+    if (!in.open(QFile::ReadOnly)) return false;
+    QByteArray data = in.readAll();
+    if (data.size() < 28) return false;
+
+    // The star count is the third header value, in either byte order like in StarStore::load.
+    qint32 values[7];
+    memcpy(values, data.constData(), sizeof(values));
+    bool swapped = values[6] <= 0 || values[6] > 4096;
+    qint32 count = swapped ? qbswap(values[2]) : values[2];
+    qint32 bytes_per_star = swapped ? qbswap(values[6]) : values[6];
+    qint32 stars = qAbs(count);
+    if (bytes_per_star <= 0 || 28 + (qint64)stars * bytes_per_star > data.size()) return false;
+
+    qint32 new_count = count < 0 ? -stars * copies : stars * copies;
+    if (swapped) new_count = qbswap(new_count);
+    QByteArray records = data.mid(28, (qint64)stars * bytes_per_star);
+    QByteArray header = data.left(28);
+    memcpy(header.data() + 8, &new_count, sizeof(new_count));
+
+    QFile out(path);
+    if (!out.open(QFile::WriteOnly | QFile::Truncate)) return false;
+    out.write(header);
+    for (int i = 0; i < copies; i++) {
+        out.write(records);
+    }
+    return true;
+}
+
+// Spreads directions evenly over the sphere, turning by the golden angle each call.
+static QVector3D fibonacciDirection(int i, int count) {
+    double y = 1.0 - 2.0 * (i % count + 0.5) / count;
+    double r = sqrt(1.0 - y * y);
+    double angle = i * M_PI * (3.0 - sqrt(5.0));
+    return QVector3D(r * cos(angle), y, r * sin(angle));
+}
+
+static void benchCalculations(Bench *bench, DataManager *data_manager) {
+    const QList<CelestialBody> &bodies = data_manager->m_planets;
+    ResolvedBodies resolved = calc::resolveBodies(bodies);
+    KeplerState kepler_state = {};
+    QVarLengthArray<dVector3D, 16> positions(bodies.size());
+    double d = 9000.0;
+    bench->run("calc::calculatePositions/frame", bodies.size(), [&]() {
+        calc::calculatePositions(bodies, resolved, d, &kepler_state, positions.data());
+        d += 0.01;
+        g_sink = g_sink + positions[1].x;
+    });
+
+    // The Kepler solver warm-started from the previous frame against starting from the series every frame, at
+    // the steps of a real-time and a fast animation. The app only solves outside the range of the ephemeris
+    // cache, or when it is missing.
+    for (double step : {1.0 / 1440.0, 1.0}) {
+        for (bool warm : {true, false}) {
+            QString name = QString("calc::calculatePositions/%1 start, %2").arg(warm ? "warm" : "cold", step < 1.0 ? "1 min" : "1 day");
+            KeplerState state = {};
+            double day = 9000.0;
+            bench->run(name, bodies.size(), [&]() {
+                if (!warm) state.M.resize(0); // keeps the capacity, but the solver no longer takes it as a previous solve
+                calc::calculatePositions(bodies, resolved, day, &state, positions.data());
+                day += step;
+                g_sink = g_sink + positions[1].x;
+            });
+            if (state.stats.solves > 0 && name.contains(bench->filter(), Qt::CaseInsensitive)) {
+                printf("%-44s %14.2f iterations/solve, at most %d\n", qPrintable(name),
+                       (double)state.stats.iterations / state.stats.solves, state.stats.max_iterations);
+            }
+        }
+    }
+
+    QDateTime date = QDateTime::currentDateTimeUtc();
+    bench->run("calc::calculatePositions/datetime", bodies.size(), [&]() {
+        QList<dVector3D> result = calc::calculatePositions(bodies, date, &kepler_state);
+        date = date.addSecs(600);
+        g_sink = g_sink + result[1].x;
+    });
+
+    for (qsizetype count : {64, 4096}) {
+        QList<double> days(count);
+        for (qsizetype i = 0; i < count; i++) days[i] = 9000.0 + i / 24.0;
+        PositionSeries series = {};
+        bench->run(QString("calc::calculatePositionSeries/%1").arg(count), count, [&]() {
+            calc::calculatePositionSeries(bodies, days.constData(), count, &series);
+            g_sink = g_sink + series.x[count];
+        });
+    }
+
+    QList<int16_t> magnitudes(BENCH_BATCH);
+    for (int i = 0; i < BENCH_BATCH; i++) magnitudes[i] = (int16_t)(i - 150);
+    bench->run("calc::magnitudeToScale", BENCH_BATCH, [&]() {
+        float total = 0.0f;
+        for (int16_t magnitude : magnitudes) total += calc::magnitudeToScale(magnitude);
+        g_sink = g_sink + total;
+    });
+
+    bench->run("calc::RADeclinationToCartesian", BENCH_BATCH, [&]() {
+        double total = 0.0;
+        for (int i = 0; i < BENCH_BATCH; i++) {
+            dVector3D p = calc::RADeclinationToCartesian(i * 0.00613, i * 0.00153 - 0.78, 1.0);
+            total += p.x + p.y + p.z;
+        }
+        g_sink = g_sink + total;
+    });
+}
+
+// Each truncation of the VSOP87 and ELP2000 series, as the worker evaluates them every frame in high precision
+// mode. DataManager loads them in full, so the others sum a prefix of the same terms.
+static void benchSeries(Bench *bench, DataManager *data_manager) {
+    const SeriesEphemeris &series = data_manager->m_series_ephemeris;
+    QVarLengthArray<dVector3D, 16> positions(series.bodyCount());
+    for (int truncation = 0; truncation < SeriesTruncationCount; truncation++) {
+        QString name = QString("SeriesEphemeris::evaluate/%1").arg(SeriesEphemeris::truncationName((SeriesTruncation)truncation));
+        double t = 9000.0;
+        bench->run(name, series.bodyCount(), [&]() {
+            series.evaluate(t, positions.data(), nullptr, (SeriesTruncation)truncation);
+            t += 0.01;
+            g_sink = g_sink + positions[0].x;
+        });
+        if (name.contains(bench->filter(), Qt::CaseInsensitive)) {
+            printf("%-44s %14lld terms\n", qPrintable(name), (long long)series.termCount((SeriesTruncation)truncation));
+        }
+    }
+}
+
+static void benchElMath(Bench *bench) {
+    QList<Vec3> vectors(BENCH_BATCH);
+    QList<Vec4> points(BENCH_BATCH);
+    for (int i = 0; i < BENCH_BATCH; i++) {
+        QVector3D direction = fibonacciDirection(i, BENCH_BATCH);
+        vectors[i] = vec3(direction.x() * 3.0f, direction.y() * 2.0f, direction.z() + 0.5f);
+        points[i].x = vectors[i].x;
+        points[i].y = vectors[i].y;
+        points[i].z = vectors[i].z;
+        points[i].w = 1.0f;
+    }
+
+    bench->run("el_math/Vec3 normalize cross dot", BENCH_BATCH, [&]() {
+        f32 total = 0.0f;
+        Vec3 previous = vectors[BENCH_BATCH - 1];
+        for (const Vec3 &v : vectors) {
+            Vec3 n = normalize(v);
+            total += dot(cross(n, previous), v) + length(n - previous * 0.5f);
+            previous = n;
+        }
+        g_sink = g_sink + total;
+    });
+
+    Mat4 matrix = IDENTITY4;
+    matrix.el[12] = 1.0f;
+    matrix.el[1] = 0.25f;
+    bench->run("el_math/Mat4 * Vec4", BENCH_BATCH, [&]() {
+        f32 total = 0.0f;
+        for (const Vec4 &p : points) {
+            Vec4 q = matrix * p;
+            total += q.x + q.w;
+        }
+        g_sink = g_sink + total;
+    });
+
+    Mat4 product = IDENTITY4;
+    bench->run("el_math/Mat4 * Mat4", 1, [&]() {
+        product = 0.5f * (product * matrix);
+        product.el[15] = 1.0f;
+        g_sink = g_sink + product.el[12];
+    });
+
+    Mat3 rotation = {{0.0f, 1.0f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f}};
+    Mat3 product3 = rotation;
+    bench->run("el_math/Mat3 * Mat3", 1, [&]() {
+        product3 = product3 * rotation;
+        g_sink = g_sink + product3.el[0];
+    });
+}
+
+static void benchStarCatalog(Bench *bench, DataManager *data_manager, QString bsc5) {
+    bench->run("DataManager::loadStarCatalog/BSC5", data_manager->m_stars.size(), [&]() {
+        data_manager->loadStarCatalog(bsc5);
+    });
+
+    QTemporaryDir directory;
+    for (int copies : {10, 100}) {
+        QString path = directory.filePath(QString("BSC5x%1").arg(copies));
+        if (!writeEnlargedCatalog(bsc5, path, copies)) {
+            qWarning() << "Could not write an enlarged catalog from" << bsc5;
+            break;
+        }
+        data_manager->loadStarCatalog(path);
+        bench->run(QString("DataManager::loadStarCatalog/BSC5x%1").arg(copies), data_manager->m_stars.size(), [&]() {
+            data_manager->loadStarCatalog(path);
+        });
+    }
+    data_manager->loadStarCatalog(bsc5); // the views below see the real catalog
+}
+
+static void benchViews(Bench *bench, DataManager *data_manager) {
+    StarInstanceTable star_table;
+    star_table.setView(QVector3D(0, 0, -1), QVector3D(0, 1, 0), 60.0f, 16.0f / 9.0f);
+    int instances = 0;
+    bench->run("StarInstanceTable::getInstanceBuffer", 1, [&]() {
+        QByteArray buffer = star_table.getInstanceBuffer(&instances);
+        g_sink = g_sink + buffer.size();
+    });
+
+    // Turning the camera is what rebuilds the buffer.
+    int turn = 0;
+    bench->run("StarInstanceTable::setView+getInstanceBuffer", 1, [&]() {
+        QVector3D forward = fibonacciDirection(turn++, 997);
+        QVector3D up = qAbs(forward.y()) > 0.99f ? QVector3D(1, 0, 0) : QVector3D(0, 1, 0);
+        star_table.setView(forward, up, 60.0f, 16.0f / 9.0f);
+        QByteArray buffer = star_table.getInstanceBuffer(&instances);
+        g_sink = g_sink + buffer.size() + instances;
+    });
+
+    // rayPick also looks at the bodies, which the app puts at the scale PlanetModel draws them at.
+    QList<dVector3D> positions = calc::calculatePositions(data_manager->m_planets, QDateTime::currentDateTimeUtc());
+    data_manager->m_planet_positions.resize(positions.size());
+    for (qsizetype i = 0; i < positions.size(); i++) {
+        data_manager->m_planet_positions[i] = {positions[i].x * 25.0, positions[i].y * 25.0, positions[i].z * 25.0};
+    }
+    // What a pick at a new date costs on top, the selection handler reports the star where it is drawn.
+    double years = 26.0;
+    bench->run("DataManager::starPlaces", data_manager->m_stars.size(), [&]() {
+        StarPlaces places = data_manager->starPlaces(years);
+        years += 0.01;
+        g_sink = g_sink + places.x.size();
+    });
+
+    SelectionHandler selection_handler;
+    int ray = 0;
+    bench->run("SelectionHandler::rayPick", 1, [&]() {
+        QVariantMap picked = selection_handler.rayPick(QVector3D(0, 0, 0), fibonacciDirection(ray++, 997), 0.5f);
+        g_sink = g_sink + picked.size();
+    });
+}
+
+// The batch path evaluates instants in SIMD lanes, calculatePositions evaluates the bodies of one instant in
+// them. Both must give the same positions, up to the rounding of a different order of operations.
+static bool checkSeriesMatchesPositions(const QList<CelestialBody> &bodies) {
+    QList<double> days(CHECK_INSTANTS);
+    for (qsizetype i = 0; i < CHECK_INSTANTS; i++) days[i] = -73048.5 + i * (146097.0 / (CHECK_INSTANTS - 1));
+
+    bool passed = true;
+    for (int level = 0; level < AccuracyLevelCount; level++) {
+        AccuracyTier tier = calc::accuracyTier((AccuracyLevel)level);
+        if (tier.single_precision) continue; // the series is always f64
+
+        PositionSeries series = {};
+        calc::calculatePositionSeries(bodies, days.constData(), CHECK_INSTANTS, &series, tier);
+        ResolvedBodies resolved = calc::resolveBodies(bodies, tier);
+        QVarLengthArray<dVector3D, 16> positions(bodies.size());
+
+        double worst = 0.0;
+        qsizetype worst_body = 0, worst_instant = 0;
+        for (qsizetype t = 0; t < CHECK_INSTANTS; t++) {
+            calc::calculatePositions(bodies, resolved, days[t], nullptr, positions.data());
+            for (qsizetype b = 0; b < bodies.size(); b++) {
+                qsizetype index = b * CHECK_INSTANTS + t;
+                double difference = qMax(qMax(qAbs(series.x[index] - positions[b].x), qAbs(series.y[index] - positions[b].y)),
+                                         qAbs(series.z[index] - positions[b].z));
+                if (std::isnan(series.x[index]) && std::isnan(positions[b].x)) difference = 0.0;
+                if (!(difference <= worst)) {
+                    worst = std::isnan(difference) ? INFINITY : difference;
+                    worst_body = b;
+                    worst_instant = t;
+                }
+            }
+        }
+        bool ok = worst <= CHECK_TOLERANCE;
+        printf("%-4s series = positions, %-6s tier, %d lanes: largest difference %.3g (%s at d = %.1f)\n", ok ? "ok" : "FAIL",
+               tier.name, calc::positionSeriesLanes(), worst, qPrintable(bodies[worst_body].name), days[worst_instant]);
+        passed = passed && ok;
+    }
+    return passed;
+}
+
+enum WorkerMode {
+    AnimatedDirect,    // ticked, from the ephemeris every frame
+    AnimatedKeyframes, // ticked, interpolated between keyframes
+    Paused,            // a new date every frame, through the FrameCache and the prefetcher
+};
+
+// The loops of the app's WorkerThread, with the app's data: the ephemeris, the keyframes, the frame cache,
+// the trails and the handoff to the UI. After a warm-up none of its frames may allocate.
+static bool checkWorkerRun(DataManager *data_manager, QDateTime start_date, WorkerMode mode, bool high_precision) {
+    TripleBuffer<PlanetFrame> frames;
+    WorkerThread worker(data_manager->m_planets, &data_manager->m_ephemeris_cache, &data_manager->m_series_ephemeris,
+                        &data_manager->m_trails, &frames, start_date);
+    worker.start();
+    WorkerCommand command = {WorkerCommand::SetSpeed};
+    command.value = 1.0;
+    worker.post(command);
+    command = {WorkerCommand::SetHighPrecision};
+    command.flag = high_precision;
+    worker.post(command);
+    command = {WorkerCommand::SetKeyframes};
+    command.flag = mode == AnimatedKeyframes;
+    worker.post(command);
+    command = {WorkerCommand::SetAnimating};
+    command.flag = mode != Paused;
+    worker.post(command);
+
+    // Like PlanetModel::fetchFrame, except that it waits for every frame. Paused, the dates go a day at a
+    // time like the calendar's arrows, so some frames come from what the worker prefetched and some don't.
+    u64 allocations_before = 0;
+    QDateTime date = start_date;
+    for (int i = 0; i < CHECK_WARMUP_FRAMES + CHECK_FRAMES; i++) {
+        if (i == CHECK_WARMUP_FRAMES) allocations_before = g_allocations.load(std::memory_order_relaxed);
+        if (mode == Paused) {
+            date = date.addDays(1);
+            command = {WorkerCommand::SetDate};
+            command.date = date;
+            while (!worker.post(command)) QThread::yieldCurrentThread();
+        }
+        else {
+            worker.tick();
+        }
+        while (!frames.fetch()) QThread::yieldCurrentThread();
+        g_sink = g_sink + frames.readBuffer().positions[1].x;
+    }
+    u64 allocations = g_allocations.load(std::memory_order_relaxed) - allocations_before;
+    QDateTime end_date = frames.readBuffer().date;
+
+    worker.stop();
+    worker.wait();
+
+    static const char *mode_names[] = {"direct", "keyframes", "paused"};
+    bool ok = allocations == 0;
+    printf("%-4s worker frames, %s%s: %llu allocations in %d frames (%s to %s)\n", ok ? "ok" : "FAIL",
+           mode_names[mode], high_precision ? ", high precision" : "", (unsigned long long)allocations, CHECK_FRAMES,
+           qPrintable(start_date.date().toString(Qt::ISODate)), qPrintable(end_date.date().toString(Qt::ISODate)));
+    return ok;
+}
+
+// Every way the worker computes frames: animated with and without keyframes, and paused. Starts at a date
+// the ephemeris cache covers and at one it doesn't, where the formulae and the Kepler solver run, and again
+// with the series if they are there.
+static bool checkWorkerAllocations(DataManager *data_manager) {
+    bool passed = true;
+    for (bool high_precision : {false, true}) {
+        if (high_precision && !data_manager->m_series_ephemeris.isLoaded()) {
+            printf("SKIP worker frames, high precision: no VSOP87 and ELP2000 series in %s\n", BENCH_SERIES_DIRECTORY);
+            continue;
+        }
+        for (QDateTime start_date : {QDateTime::currentDateTime(), QDate(1850, 1, 1).startOfDay()}) {
+            for (WorkerMode mode : {AnimatedDirect, AnimatedKeyframes, Paused}) {
+                passed = checkWorkerRun(data_manager, start_date, mode, high_precision) && passed;
+            }
+        }
+    }
+    return passed;
+}
+
+static bool writeJson(QString path, const QList<BenchResult> &results) {
+    QJsonArray array;
+    for (const BenchResult &result : results) {
+        array.append(QJsonObject{
+            {"name", result.name},
+            {"iterations", result.iterations},
+            {"ns_per_op", result.ns_per_op},
+            {"items_per_op", result.items_per_op},
+            {"items_per_second", result.items_per_second},
+            {"allocations_per_op", result.allocations_per_op},
+        });
+    }
+    QJsonObject root{
+        {"version", QCoreApplication::applicationVersion()},
+        {"date", QDateTime::currentDateTimeUtc().toString(Qt::ISODate)},
+        {"cpu", QSysInfo::currentCpuArchitecture()},
+        {"results", array},
+    };
+
+    QFile file(path);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate)) return false;
+    return file.write(QJsonDocument(root).toJson()) > 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+    app.setApplicationVersion(OBSERVE_VERSION);
+    QStringList arguments = app.arguments().mid(1);
+
+    QString filter, json_path, elements_path;
+    QString bsc5 = "../observe/BSC5";
+    qint64 min_ms = 300;
+    bool check = false;
+    for (qsizetype i = 0; i < arguments.size(); i++) {
+        bool has_value = i + 1 < arguments.size();
+        if (arguments[i] == "--filter" && has_value) filter = arguments[++i];
+        else if (arguments[i] == "--min-time" && has_value) min_ms = arguments[++i].toLongLong();
+        else if (arguments[i] == "--bsc5" && has_value) bsc5 = arguments[++i];
+        else if (arguments[i] == "--json" && has_value) json_path = arguments[++i];
+        else if (arguments[i] == "--check") check = true;
+        else if (arguments[i] == "--elements" && has_value) elements_path = arguments[++i];
+        else {
+            qWarning() << "usage: observe-bench [--filter TEXT] [--min-time MS] [--bsc5 FILE] [--json FILE]";
+            qWarning() << "       observe-bench --check [--elements FILE]";
+            return 2;
+        }
+    }
+
+    // Like DataManager::loadAppFiles, except for the cache, which doesn't overwrite the app's.
+    DataManager *data_manager = DataManager::getInstance();
+    QTemporaryDir cache_directory;
+    data_manager->loadBodies(elements_path.isEmpty() ? "../observe/orbital_elements.txt" : elements_path);
+    data_manager->loadEphemerisCache(cache_directory.filePath("ephemeris.bin"), QDate(1900, 1, 1), QDate(2100, 1, 1));
+    data_manager->loadSeriesEphemeris(BENCH_SERIES_DIRECTORY, FullSeries);
+    if (check) {
+        if (data_manager->m_planets.isEmpty()) {
+            qWarning() << "No bodies to check, see --elements";
+            return 1;
+        }
+        bool passed = checkSeriesMatchesPositions(data_manager->m_planets);
+        passed = checkWorkerAllocations(data_manager) && passed;
+        return passed ? 0 : 1;
+    }
+
+    data_manager->loadStarCatalog(bsc5);
+    data_manager->loadStarTiles("../observe/stars.tiles");
+    Bench bench(filter, min_ms * 1000000);
+    benchCalculations(&bench, data_manager);
+    if (data_manager->m_series_ephemeris.isLoaded()) {
+        benchSeries(&bench, data_manager);
+    }
+    else {
+        qWarning() << "No VSOP87 and ELP2000 series in" << BENCH_SERIES_DIRECTORY << "- skipping the series benchmarks";
+    }
+    benchElMath(&bench);
+    if (data_manager->m_stars.size() > 0) {
+        benchStarCatalog(&bench, data_manager, bsc5);
+    }
+    else {
+        qWarning() << "No star catalog at" << bsc5 << "- skipping the catalog benchmarks";
+    }
+    benchViews(&bench, data_manager);
+
+    if (!json_path.isEmpty() && !writeJson(json_path, bench.results())) {
+        qWarning() << "Could not write" << json_path;
+        return 1;
+    }
+    return 0;
+}
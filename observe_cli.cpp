@@ -0,0 +1,388 @@
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QElapsedTimer>
+#include <QTimeZone>
+#include <QDebug>
+#include <QtMath>
+#include <stdio.h>
+#include "orbital_elements.h"
+#include "frame_ephemeris.h"
+#include "star_store.h"
+#include "star_places.h"
+#include "trace.h"
+
+/*
+ * Writes the positions of bodies over a range of dates, without a display.
+ *
+ *   observe-cli --from DATE --to DATE [--step 1h] [--bodies Moon,Mars] [--elements orbital_elements.txt]
+ *               [--cache FILE] [--series DIRECTORY] [--truncation full|fine|arcsecond|coarse] [--accuracy TIER]
+ *               [--threads N] [--format csv|binary] [--trace FILE] <output>
+ *   observe-cli --from DATE --to DATE [--step 1d] --stars CATALOG [--format csv|binary] [--trace FILE] <output>
+ *
+ * Dates are ISO 8601, in UTC unless they carry an offset, and the range includes both ends. The step is a number
+ * followed by s, m, h or d. The positions come from the same sources as in the app: the VSOP87 and ELP2000
+ * series if --series is given, summed down to the terms --truncation keeps (arcsecond by default, like the
+ * app, see SeriesTruncation), otherwise the Chebyshev cache if --cache is given (built for the range if the
+ * file is missing), otherwise the approximate formulae at the accuracy tier named by --accuracy (full, fast,
+ * coarse, float or rough, see observe-accuracy for what they cost). The cache is a fit of the full tier, so the
+ * other tiers don't use it.
+ *
+ * The positions are geocentric and equatorial, Z towards the north pole: unit vectors for everything but the
+ * sun, whose distance is in AU. The CSV has a line per date and body of date, body, x, y, z, right ascension
+ * and declination in degrees. The binary file is
+ *   "OBSVPOS1", u32 body count, u32 0, i64 first date (ms since 1970 UTC), i64 step (ms), i64 date count,
+ *   for each body a u32 length and the UTF-8 name, then for each date and body x, y, z as f64,
+ * all in the byte order of the machine that wrote it.
+ *
+ * With --stars the output has the stars of a catalog in the BSC5 format instead of the bodies, at their true
+ * places of each date: proper motion, precession and nutation from J2000, see StarPlaceKernel. They are unit
+ * vectors in the same frame and the same layouts, with the catalog number as the name. The kernel spreads the
+ * stars of a date over the threads itself.
+ *
+ * The dates are cut into blocks that are computed and formatted on a thread pool, each task with its own
+ * FrameEphemeris. The blocks are written in order as they finish, and only a few per thread are in flight, so
+ * the memory use doesn't depend on the length of the range. --trace writes when each block ran on which thread
+ * as Chrome trace JSON, see trace.h.
+ */
+
+#define CLI_BLOCK_DATES 4096 // per task, enough that handing out tasks costs nothing next to the math
+#define CLI_BLOCKS_PER_THREAD 2 // in flight, so a thread always has the next block while one is written
+
+struct CliOptions {
+    qint64 first_ms;
+    qint64 step_ms;
+    qint64 count;
+    QList<qsizetype> bodies; // indices into the body list, in output order
+    QList<bool> mask; // true for the bodies in the output
+    AccuracyTier accuracy;
+    bool binary;
+};
+
+// A range of dates, computed and formatted into bytes ready to write. Reused for one block after another.
+class Block : public QRunnable {
+public:
+    Block(const QList<CelestialBody> &bodies, const EphemerisCache *cache, const SeriesEphemeris *series,
+          bool high_precision, const CliOptions *options)
+    : ephemeris(bodies, cache, series), options(options), names(bodies.size()) {
+        setAutoDelete(false);
+        ephemeris.setHighPrecision(high_precision);
+        ephemeris.setAccuracy(options->accuracy);
+        positions.resize(bodies.size());
+        for (qsizetype i = 0; i < bodies.size(); i++) {
+            names[i] = bodies[i].name.toUtf8();
+        }
+    }
+
+    void run() override {
+        TRACE_SCOPE("block");
+        output.clear();
+        for (qint64 i = first; i < end; i++) {
+            QDateTime date = QDateTime::fromMSecsSinceEpoch(options->first_ms + i * options->step_ms, QTimeZone::UTC);
+            ephemeris.calculatePositions(date, positions.data(), options->mask.constData());
+            if (options->binary) {
+                for (qsizetype b : options->bodies) {
+                    output.append((const char*)&positions[b], sizeof(dVector3D));
+                }
+                continue;
+            }
+
+            QByteArray date_text = date.toString(Qt::ISODateWithMs).toLatin1();
+            for (qsizetype b : options->bodies) {
+                const dVector3D &p = positions[b];
+                double ra = qRadiansToDegrees(atan2(p.y, p.x));
+                if (ra < 0.0) ra += 360.0;
+                double declination = qRadiansToDegrees(atan2(p.z, sqrt(p.x * p.x + p.y * p.y)));
+                char line[192];
+                int length = snprintf(line, sizeof(line), ",%.12g,%.12g,%.12g,%.8f,%.8f\n", p.x, p.y, p.z, ra, declination);
+                output.append(date_text);
+                output.append(',');
+                output.append(names[b]);
+                output.append(line, length);
+            }
+        }
+        done.release();
+    }
+
+    FrameEphemeris ephemeris;
+    const CliOptions *options;
+    QList<QByteArray> names;
+    QVarLengthArray<dVector3D, 16> positions;
+    qint64 first; // dates, as steps from options->first_ms
+    qint64 end;
+    QByteArray output;
+    QSemaphore done;
+};
+
+static bool parseDate(QString text, qint64 *ms) {
+    QDateTime date = QDateTime::fromString(text, Qt::ISODate);
+    if (!date.isValid()) {
+        date = QDate::fromString(text, Qt::ISODate).startOfDay(QTimeZone::UTC);
+    }
+    else if (date.timeSpec() == Qt::LocalTime) {
+        date.setTimeZone(QTimeZone::UTC);
+    }
+    if (!date.isValid()) return false;
+    *ms = date.toMSecsSinceEpoch();
+    return true;
+}
+
+static bool parseStep(QString text, qint64 *ms) {
+    static const QList<QPair<QString, qint64>> units = {{"s", 1000}, {"m", 60000}, {"h", 3600000}, {"d", 86400000}};
+    for (const QPair<QString, qint64> &unit : units) {
+        if (!text.endsWith(unit.first)) continue;
+        bool ok = false;
+        double value = text.chopped(unit.first.size()).toDouble(&ok);
+        *ms = (qint64)round(value * unit.second);
+        return ok && *ms > 0;
+    }
+    return false;
+}
+
+// names are those of the bodies or stars in the output, in order.
+static void writeBinaryHeader(QFile *file, const CliOptions &options, const QList<QByteArray> &names) {
+    file->write("OBSVPOS1", 8);
+    u32 counts[2] = {(u32)names.size(), 0};
+    file->write((const char*)counts, sizeof(counts));
+    qint64 range[3] = {options.first_ms, options.step_ms, options.count};
+    file->write((const char*)range, sizeof(range));
+    for (const QByteArray &name : names) {
+        u32 length = name.size();
+        file->write((const char*)&length, sizeof(length));
+        file->write(name);
+    }
+}
+
+// The places of one date at a time. The scene frame of the catalog has Y towards the pole, see
+// calc::RADeclinationToCartesian, the output has Z towards it like the bodies.
+static bool writeStarPlaces(QFile *file, const CliOptions &options, StarStore &stars) {
+    StarPlaceKernel kernel;
+    kernel.load(stars);
+    StarPlaces places = {};
+    QList<QByteArray> names(stars.size());
+    for (qsizetype s = 0; s < stars.size(); s++) {
+        names[s] = QByteArray::number((qlonglong)stars.ids().value(s));
+    }
+    if (options.binary) {
+        writeBinaryHeader(file, options, names);
+    }
+    else {
+        file->write("date,star,x,y,z,ra,dec\n");
+    }
+
+    QByteArray output;
+    for (qint64 i = 0; i < options.count; i++) {
+        QDateTime date = QDateTime::fromMSecsSinceEpoch(options.first_ms + i * options.step_ms, QTimeZone::UTC);
+        {
+            TRACE_SCOPE("star places");
+            kernel.compute(calc::daysSinceJ2000(date) / 365.25, true, &places);
+        }
+
+        TRACE_SCOPE("write");
+        output.clear();
+        QByteArray date_text = date.toString(Qt::ISODateWithMs).toLatin1();
+        for (qsizetype s = 0; s < stars.size(); s++) {
+            dVector3D p = {places.x[s], -places.z[s], places.y[s]};
+            if (options.binary) {
+                output.append((const char*)&p, sizeof(dVector3D));
+                continue;
+            }
+            double ra = qRadiansToDegrees(atan2(p.y, p.x));
+            if (ra < 0.0) ra += 360.0;
+            double declination = qRadiansToDegrees(asin(qBound(-1.0, p.z, 1.0)));
+            char line[192];
+            int length = snprintf(line, sizeof(line), ",%.9g,%.9g,%.9g,%.7f,%.7f\n", p.x, p.y, p.z, ra, declination);
+            output.append(date_text);
+            output.append(',');
+            output.append(names[s]);
+            output.append(line, length);
+        }
+        if (file->write(output) != output.size()) return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QStringList arguments = app.arguments().mid(1);
+
+    QString from, to, output_path;
+    QString step = "1h";
+    QString body_names;
+    QString elements_path = "orbital_elements.txt";
+    QString cache_path, series_directory, trace_path, stars_path;
+    QString format = "csv";
+    QString accuracy = "full";
+    QString truncation_name = "arcsecond";
+    int threads = QThread::idealThreadCount();
+    for (qsizetype i = 0; i < arguments.size(); i++) {
+        QString argument = arguments[i];
+        bool has_value = i + 1 < arguments.size();
+        if (argument == "--from" && has_value) from = arguments[++i];
+        else if (argument == "--to" && has_value) to = arguments[++i];
+        else if (argument == "--step" && has_value) step = arguments[++i];
+        else if (argument == "--bodies" && has_value) body_names = arguments[++i];
+        else if (argument == "--elements" && has_value) elements_path = arguments[++i];
+        else if (argument == "--cache" && has_value) cache_path = arguments[++i];
+        else if (argument == "--series" && has_value) series_directory = arguments[++i];
+        else if (argument == "--threads" && has_value) threads = arguments[++i].toInt();
+        else if (argument == "--format" && has_value) format = arguments[++i];
+        else if (argument == "--accuracy" && has_value) accuracy = arguments[++i];
+        else if (argument == "--truncation" && has_value) truncation_name = arguments[++i];
+        else if (argument == "--trace" && has_value) trace_path = arguments[++i];
+        else if (argument == "--stars" && has_value) stars_path = arguments[++i];
+        else if (!argument.startsWith("--") && output_path.isEmpty()) output_path = argument;
+        else {
+            output_path.clear();
+            break;
+        }
+    }
+
+    CliOptions options = {};
+    options.binary = format == "binary";
+    options.accuracy.name = nullptr;
+    for (int level = 0; level < AccuracyLevelCount; level++) {
+        AccuracyTier tier = calc::accuracyTier((AccuracyLevel)level);
+        if (accuracy == tier.name) options.accuracy = tier;
+    }
+    int truncation = -1;
+    for (int t = 0; t < SeriesTruncationCount; t++) {
+        if (truncation_name == SeriesEphemeris::truncationName((SeriesTruncation)t)) truncation = t;
+    }
+    qint64 last_ms = 0;
+    if (output_path.isEmpty() || !parseDate(from, &options.first_ms) || !parseDate(to, &last_ms) ||
+        !parseStep(step, &options.step_ms) || last_ms < options.first_ms || threads < 1 ||
+        (format != "csv" && format != "binary") || !options.accuracy.name || truncation < 0) {
+        qWarning() << "usage: observe-cli --from DATE --to DATE [--step 1h] [--bodies Moon,Mars] [--elements FILE]"
+                   << "[--cache FILE] [--series DIRECTORY] [--truncation full|fine|arcsecond|coarse] [--accuracy TIER]"
+                   << "[--threads N] [--format csv|binary] [--trace FILE] <output>";
+        qWarning() << "       observe-cli --from DATE --to DATE [--step 1d] --stars CATALOG [--format csv|binary]"
+                   << "[--trace FILE] <output>";
+        return 2;
+    }
+    options.count = (last_ms - options.first_ms) / options.step_ms + 1;
+
+    if (!stars_path.isEmpty()) {
+        StarStore stars;
+        if (!stars.load(stars_path)) {
+            return 1;
+        }
+        QFile file(output_path);
+        if (!file.open(QFile::WriteOnly | QFile::Truncate)) {
+            qWarning() << "Could not open file " << output_path;
+            return 1;
+        }
+        if (!trace_path.isEmpty()) {
+            trace::start(trace_path);
+        }
+        bool written = writeStarPlaces(&file, options, stars);
+        trace::save();
+        if (!written) {
+            qWarning() << "Could not write to" << output_path;
+            return 1;
+        }
+        return 0;
+    }
+
+    QList<CelestialBody> bodies;
+    if (!readOrbitalElements(elements_path, &bodies)) {
+        return 1;
+    }
+    options.mask.fill(body_names.isEmpty(), bodies.size());
+    if (body_names.isEmpty()) {
+        for (qsizetype b = 0; b < bodies.size(); b++) options.bodies.append(b);
+    }
+    for (const QString &name : body_names.split(",", Qt::SkipEmptyParts)) {
+        qsizetype found = -1;
+        for (qsizetype b = 0; b < bodies.size(); b++) {
+            if (bodies[b].name.compare(name.trimmed(), Qt::CaseInsensitive) == 0) found = b;
+        }
+        if (found < 0) {
+            qWarning() << "No body named" << name << "in" << elements_path;
+            return 1;
+        }
+        options.bodies.append(found);
+        options.mask[found] = true;
+    }
+
+    SeriesEphemeris series;
+    if (!series_directory.isEmpty() && !series.load(series_directory, bodies, (SeriesTruncation)truncation)) {
+        qWarning() << "Could not load the VSOP87 and ELP2000 series from" << series_directory;
+        return 1;
+    }
+    EphemerisCache cache;
+    if (!cache_path.isEmpty()) {
+        QDate first = QDateTime::fromMSecsSinceEpoch(options.first_ms, QTimeZone::UTC).date();
+        QDate last = QDateTime::fromMSecsSinceEpoch(last_ms, QTimeZone::UTC).date().addDays(1);
+        if (!cache.open(cache_path, bodies, first, last)) {
+            QDir().mkpath(QFileInfo(cache_path).absolutePath());
+            if (!EphemerisCache::build(bodies, first, last, cache_path) || !cache.open(cache_path, bodies, first, last)) {
+                qWarning() << "Could not build the ephemeris cache" << cache_path;
+                return 1;
+            }
+        }
+    }
+
+    QFile file(output_path);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate)) {
+        qWarning() << "Could not open file " << output_path;
+        return 1;
+    }
+    if (options.binary) {
+        QList<QByteArray> names;
+        for (qsizetype b : options.bodies) {
+            names.append(bodies[b].name.toUtf8());
+        }
+        writeBinaryHeader(&file, options, names);
+    }
+    else {
+        file.write("date,body,x,y,z,ra,dec\n");
+    }
+
+    if (!trace_path.isEmpty()) {
+        trace::start(trace_path);
+    }
+    QElapsedTimer timer;
+    timer.start();
+    QThreadPool pool;
+    pool.setMaxThreadCount(threads);
+    QList<Block*> blocks;
+    for (int i = 0; i < threads * CLI_BLOCKS_PER_THREAD; i++) {
+        blocks.append(new Block(bodies, &cache, &series, !series_directory.isEmpty(), &options));
+    }
+
+    qint64 block_count = (options.count + CLI_BLOCK_DATES - 1) / CLI_BLOCK_DATES;
+    auto start = [&](qint64 index) {
+        Block *block = blocks[index % blocks.size()];
+        block->first = index * CLI_BLOCK_DATES;
+        block->end = qMin(block->first + CLI_BLOCK_DATES, options.count);
+        pool.start(block);
+    };
+    for (qint64 i = 0; i < qMin(block_count, (qint64)blocks.size()); i++) {
+        start(i);
+    }
+    bool written = true;
+    for (qint64 i = 0; i < block_count; i++) {
+        Block *block = blocks[i % blocks.size()];
+        block->done.acquire();
+        TRACE_SCOPE("write");
+        written = written && file.write(block->output) == block->output.size();
+        if (i + blocks.size() < block_count) start(i + blocks.size());
+    }
+    pool.waitForDone();
+    qDeleteAll(blocks);
+    trace::save();
+
+    if (!written) {
+        qWarning() << "Could not write to" << output_path;
+        return 1;
+    }
+    qDebug() << "Wrote" << options.count << "dates of" << options.bodies.size() << "bodies to" << output_path
+             << "in" << timer.elapsed() << "ms";
+    return 0;
+}
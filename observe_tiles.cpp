@@ -0,0 +1,114 @@
+#include <QCoreApplication>
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+#include <QRegularExpression>
+#include <QDebug>
+#include <QtMath>
+#include "star_store.h"
+#include "star_tiles.h"
+#include "calculate_positions.h"
+
+/*
+ * Converts a star catalog into the tiled format that DataManager streams from (see star_tiles.h).
+ *
+ *   observe-tiles [--order N] <input> <output>
+ *
+ * The input is either a catalog in the BSC5 binary format, or a text file with one star per line:
+ *   RA (degrees), declination (degrees), V magnitude, and optionally the proper motion in RA times cos(dec)
+ *   and in declination (milliarcseconds per year) and a catalog number.
+ * Columns may be separated by commas, semicolons, bars or spaces, so CSV exports of Hipparcos or Tycho-2 from
+ * VizieR work after picking those columns. Lines starting with # and lines that don't parse are skipped.
+ */
+
+static bool loadText(QString path, QList<TileStar> *stars) {
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly)) {
+        qWarning() << "Could not open file " << path;
+        return false;
+    }
+
+    static const QRegularExpression separators("[,;|\\s]+");
+    QTextStream in(&file);
+    qint64 skipped = 0;
+    while (!in.atEnd()) {
+        QString line = in.readLine().trimmed();
+        if (line.isEmpty() || line.startsWith("#")) continue;
+
+        QStringList parts = line.split(separators, Qt::SkipEmptyParts);
+        bool ok[6] = {false, false, false, true, true, true};
+        double values[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+        for (int i = 0; i < qMin(6, (int)parts.size()); i++) {
+            values[i] = parts[i].toDouble(&ok[i]);
+        }
+        if (!ok[0] || !ok[1] || !ok[2] || !ok[3] || !ok[4] || !ok[5]) {
+            skipped++;
+            continue;
+        }
+
+        dVector3D position = calc::RADeclinationToCartesian(qDegreesToRadians(values[0]), qDegreesToRadians(values[1]), 1.0);
+        TileStar star = {};
+        star.x = (f32)position.x;
+        star.y = (f32)position.y;
+        star.z = (f32)position.z;
+        star.magnitude          = (int16)qBound(-32767.0, round(values[2] * 100.0), 32767.0);
+        star.proper_motion_ra   = (int16)qBound(-32767.0, round(values[3]), 32767.0);
+        star.proper_motion_decl = (int16)qBound(-32767.0, round(values[4]), 32767.0);
+        star.id                 = parts.size() > 5 ? (f32)values[5] : (f32)(stars->size() + 1);
+        stars->append(star);
+    }
+    if (skipped > 0) qWarning() << "Skipped" << skipped << "lines that aren't stars";
+    return true;
+}
+
+static bool loadBSC5(QString path, QList<TileStar> *stars) {
+    StarStore store;
+    if (!store.load(path)) return false;
+
+    const QList<f32> &ids = store.ids();
+    const QList<u16> &spectral_types = store.spectralTypes();
+    const QList<int16> &proper_motion_ra = store.properMotionRA();
+    const QList<int16> &proper_motion_decl = store.properMotionDeclination();
+    stars->resize(store.size());
+    for (qsizetype i = 0; i < store.size(); i++) {
+        TileStar &star = (*stars)[i];
+        star.x = store.x()[i];
+        star.y = store.y()[i];
+        star.z = store.z()[i];
+        star.magnitude          = store.magnitude(i);
+        star.spectral_type      = spectral_types[i];
+        star.proper_motion_ra   = proper_motion_ra.isEmpty() ? 0 : proper_motion_ra[i];
+        star.proper_motion_decl = proper_motion_decl.isEmpty() ? 0 : proper_motion_decl[i];
+        star.id                 = ids[i];
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QStringList arguments = app.arguments().mid(1);
+
+    int order = STAR_TILE_ORDER;
+    if (arguments.size() >= 2 && arguments[0] == "--order") {
+        order = arguments[1].toInt();
+        arguments = arguments.mid(2);
+    }
+    if (arguments.size() != 2) {
+        qWarning() << "usage: observe-tiles [--order N] <BSC5 or text catalog> <output>";
+        return 2;
+    }
+
+    QString input = arguments[0];
+    QString suffix = QFileInfo(input).suffix().toLower();
+    bool text = suffix == "csv" || suffix == "txt" || suffix == "dat" || suffix == "tsv";
+
+    QList<TileStar> stars;
+    if (!(text ? loadText(input, &stars) : loadBSC5(input, &stars))) {
+        return 1;
+    }
+    if (!StarTileCatalog::build(stars, arguments[1], order)) {
+        return 1;
+    }
+    qDebug() << "Wrote" << stars.size() << "stars in" << (12 << (2 * order)) << "tiles to" << arguments[1];
+    return 0;
+}
@@ -0,0 +1,67 @@
+#include "orbital_elements.h"
+#include <QDebug>
+#include <QFile>
+#include <QTextStream>
+
+bool readOrbitalElements(QString path, QList<CelestialBody> *bodies) {
+    QFile file(path);
+    if (!file.exists()) {
+        qWarning() << "Could not find file " << path;
+        return false;
+    }
+    if (file.open(QFile::ReadOnly))  {
+        QTextStream in(&file);
+        CelestialBody current_body;
+        while (!in.atEnd()) {
+            QString line = in.readLine();
+            if (line.trimmed().length() == 0 || line.startsWith("//")) {
+                continue; // skip empty lines and comments
+            }
+            if (line.startsWith("[")) {
+                if (current_body.name.length() > 0) {
+                    bodies->push_back(current_body);
+                }
+                current_body = {0};
+                current_body.name = line.sliced(1, line.length() - 2);
+                current_body.radius = 0.01f;
+            }
+            else {
+                QStringList parts = line.split(",");
+                QString element = parts[0];
+                double base_value = parts[1].toDouble();
+                double delta = parts[2].toDouble();
+                if (element.startsWith("N")) {
+                    current_body.base_elements.N = base_value;
+                    current_body.delta.N = delta;
+                }
+                else if (element.startsWith("i")) {
+                    current_body.base_elements.i = base_value;
+                    current_body.delta.i = delta;
+                }
+                else if (element.startsWith("w")) {
+                    current_body.base_elements.w = base_value;
+                    current_body.delta.w = delta;
+                }
+                else if (element.startsWith("a")) {
+                    current_body.base_elements.a = base_value;
+                    current_body.delta.a = delta;
+                }
+                else if (element.startsWith("e")) {
+                    current_body.base_elements.e = base_value;
+                    current_body.delta.e = delta;
+                }
+                else if (element.startsWith("M")) {
+                    current_body.base_elements.M = base_value;
+                    current_body.delta.M = delta;
+                }
+                else if (element.startsWith("color")) {
+                    current_body.color = QColor(parts[1].toInt(), parts[2].toInt(), parts[3].toInt());
+                }
+            }
+        }
+        bodies->push_back(current_body); // last item
+        return true;
+    }
+    qWarning() << "Could not open file " << path;
+    return false;
+}
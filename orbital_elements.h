@@ -0,0 +1,15 @@
+#ifndef ORBITALELEMENTS_H
+#define ORBITALELEMENTS_H
+
+#include <QList>
+#include <QString>
+#include "datastructures.h"
+
+/*
+ * Reads the bodies of an orbital elements file like orbital_elements.txt. Each body starts with its name in
+ * brackets, followed by lines of an element, its value at J2000 and its change per day, and optionally a line
+ * of "color" and three 0-255 components. Lines starting with // are comments. The sun has to come first.
+ */
+bool readOrbitalElements(QString path, QList<CelestialBody> *bodies);
+
+#endif // ORBITALELEMENTS_H
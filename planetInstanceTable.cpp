@@ -0,0 +1,51 @@
+#include "planetInstanceTable.h"
+#include "metrics.h"
+
+PlanetInstanceTable::PlanetInstanceTable() {
+    this->data_manager = DataManager::getInstance();
+    m_instanceCount = 0;
+}
+
+// One entry per body, at the origin until the first positions come in. The radius is the scale of the
+// sphere and the color multiplies the material's.
+void PlanetInstanceTable::buildEntries() {
+    const QList<CelestialBody> &planets = data_manager->m_planets;
+    m_instanceCount = qMin(planets.size(), data_manager->m_planet_positions.size());
+    m_instanceData = QByteArray(m_instanceCount * sizeof(InstanceTableEntry), Qt::Uninitialized);
+    InstanceTableEntry *entries = (InstanceTableEntry*)m_instanceData.data();
+    for (int i = 0; i < m_instanceCount; i++) {
+        float radius = planets[i].radius;
+        entries[i] = calculateTableEntry(
+            {0, 0, 0},
+            {radius, radius, radius},
+            {0, 0, 0},
+            planets[i].color
+        );
+    }
+}
+
+// The translation is the last column of the rows, nothing else in an entry depends on the position.
+void PlanetInstanceTable::updatePositions() {
+    if (m_instanceCount != qMin(data_manager->m_planets.size(), data_manager->m_planet_positions.size())) {
+        buildEntries();
+    }
+
+    // Detaches from the copy the renderer may still hold, so the frame it's drawing stays intact.
+    InstanceTableEntry *entries = (InstanceTableEntry*)m_instanceData.data();
+    const dVector3D *positions = data_manager->m_planet_positions.constData();
+    for (int i = 0; i < m_instanceCount; i++) {
+        entries[i].row0.setW(positions[i].x);
+        entries[i].row1.setW(positions[i].z);
+        entries[i].row2.setW(-positions[i].y);
+    }
+    markDirty();
+}
+
+QByteArray PlanetInstanceTable::getInstanceBuffer(int *instanceCount) {
+    if (instanceCount) {
+        *instanceCount = m_instanceCount;
+    }
+
+    MetricsRegistry::getInstance()->add(MetricsRegistry::InstanceBytesUploaded, m_instanceData.size());
+    return m_instanceData;
+}
@@ -0,0 +1,37 @@
+#ifndef PLANETINSTANCETABLE_H
+#define PLANETINSTANCETABLE_H
+
+#include <QQuick3DInstancing>
+#include <QQmlEngine>
+#include "datamanager.h"
+
+/*
+ * The bodies as instances of one sphere, replacing a delegate per body. Color and size don't change, so the
+ * entries are built once and a frame only writes the new translations into the buffer, one entry per body,
+ * instead of going through the model roles of every delegate.
+ *
+ * The positions are those in DataManager::m_planet_positions, already scaled and in the Z up frame of the
+ * math. They are turned to Y up here: (x, z, -y), the scene frame of QtQuick3D.
+ */
+class PlanetInstanceTable : public QQuick3DInstancing {
+    Q_OBJECT
+    QML_ELEMENT
+
+public:
+    PlanetInstanceTable();
+
+    QByteArray getInstanceBuffer(int *instanceCount);
+
+public slots:
+    // Reads DataManager::m_planet_positions. Connected to PlanetModel::positionsChanged.
+    void updatePositions();
+
+private:
+    void buildEntries();
+
+    DataManager *data_manager;
+    QByteArray m_instanceData;
+    int m_instanceCount;
+};
+
+#endif // PLANETINSTANCETABLE_H
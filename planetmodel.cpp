@@ -4,87 +4,206 @@
 #include <QThread>
 
 PlanetModel::PlanetModel(QObject *parent):
-    QAbstractListModel(parent)
+    QObject(parent)
 {
     this->data_manager = DataManager::getInstance();
 
     distance_from_center = 25.0;
-    m_workerThread = new WorkerThread(data_manager->m_planets, QDateTime::currentDateTime());
-    QObject::connect(m_workerThread, &WorkerThread::new_positions,
-                     this, &PlanetModel::updatePositions);
-    QObject::connect(this, &PlanetModel::new_date_input,
-                     m_workerThread, &WorkerThread::set_date);
-}
-
-QHash<int, QByteArray> PlanetModel::roleNames() const {
-    QHash<int, QByteArray> roles;
-    roles[XRole] = "x";
-    roles[YRole] = "y";
-    roles[ZRole] = "z";
-    roles[ColorRole] = "p_color";
-    roles[RadiusRole] = "p_radius";
-    return roles;
-}
-
-int PlanetModel::rowCount(const QModelIndex& parent) const {
-    return data_manager->m_planet_positions.size();
-}
-
-QVariant PlanetModel::data(const QModelIndex& index, int role) const {
-    if (!index.isValid() || index.row() >= data_manager->m_planet_positions.size())
-        return QVariant();
-
-    switch (role) {
-        // NOTE: QML seems to only support +Y as up. The math uses +Z. So we convert systems here (swap Y and Z, and negate Z).
-        case XRole:
-            return data_manager->m_planet_positions[index.row()].x;
-        case YRole:
-            return data_manager->m_planet_positions[index.row()].z;
-        case ZRole:
-            return -data_manager->m_planet_positions[index.row()].y;
-        case ColorRole:
-            return data_manager->m_planets[index.row()].color;
-        case RadiusRole:
-            return data_manager->m_planets[index.row()].radius;
-        default:
-            return QVariant();
+    m_trail_end = 0;
+    m_animating = false;
+    m_frame_interval = 0.0;
+    m_frame_jitter = 0.0;
+    m_worker_load = 0.0;
+    m_cache_hits = 0;
+    m_cache_misses = 0;
+    m_workerThread = new WorkerThread(data_manager->m_planets, &data_manager->m_ephemeris_cache, &data_manager->m_series_ephemeris,
+                                      &data_manager->m_trails, &m_frames, QDateTime::currentDateTime());
+    QObject::connect(m_workerThread, &WorkerThread::frameReady,
+                     this, &PlanetModel::fetchFrame);
+    m_resend_timer.setSingleShot(true);
+    m_resend_timer.setInterval(WORKER_RESEND_MS);
+    QObject::connect(&m_resend_timer, &QTimer::timeout, this, &PlanetModel::sendUnsent);
+    m_workerThread->start();
+    setTruncation(ArcsecondSeries); // the series are loaded in full, but within an arcsecond is plenty to look at
+}
+
+PlanetModel::~PlanetModel() {
+    m_workerThread->stop();
+    m_workerThread->wait();
+    delete m_workerThread;
+}
+
+QDateTime PlanetModel::date() const {
+    return m_date;
+}
+
+bool PlanetModel::animating() const {
+    return m_animating;
+}
+
+double PlanetModel::distanceScale() const {
+    return distance_from_center;
+}
+
+u64 PlanetModel::trailEnd() const {
+    return m_trail_end;
+}
+
+double PlanetModel::frameInterval() const {
+    return m_frame_interval;
+}
+
+double PlanetModel::frameJitter() const {
+    return m_frame_jitter;
+}
+
+double PlanetModel::workerLoad() const {
+    return m_worker_load;
+}
+
+// The worker computes the next frame while this one is drawn. If it isn't done by the next fetch, that one
+// shows the same positions again rather than waiting.
+void PlanetModel::fetchFrame() {
+    TRACE_SCOPE("fetch frame");
+    if (!m_unsent.isEmpty()) {
+        sendUnsent();
+    }
+    if (m_frames.fetch()) {
+        const PlanetFrame &frame = m_frames.readBuffer();
+        TRACE_FLOW_END("frame", frame.number);
+        MetricsRegistry::getInstance()->frameFetched(frame.tick_ns);
+        updatePositions(frame.positions.constData(), frame.positions.size(), frame.date, frame.trail_end);
+        updateMetrics(frame);
+    }
+    if (m_animating) {
+        m_workerThread->tick();
+    }
+}
+
+qint64 PlanetModel::cacheHits() const {
+    return m_cache_hits;
+}
+
+qint64 PlanetModel::cacheMisses() const {
+    return m_cache_misses;
+}
+
+// Exponential moving averages, weighing about the last 60 frames.
+void PlanetModel::updateMetrics(const PlanetFrame &frame) {
+    if (frame.cache_hits != m_cache_hits || frame.cache_misses != m_cache_misses) {
+        m_cache_hits = frame.cache_hits;
+        m_cache_misses = frame.cache_misses;
+        emit metricsChanged();
     }
+    if (frame.interval_ns <= 0) return;
+
+    const double weight = 1.0 / 60.0;
+    double interval = frame.interval_ns * 1E-6;
+    if (m_frame_interval == 0.0) m_frame_interval = interval;
+    m_frame_jitter += weight * (fabs(interval - m_frame_interval) - m_frame_jitter);
+    m_frame_interval += weight * (interval - m_frame_interval);
+    m_worker_load += weight * ((double)frame.compute_ns / frame.interval_ns - m_worker_load);
+    emit metricsChanged();
 }
 
-void PlanetModel::updatePositions(QList<dVector3D> positions) {
+// Copies into m_planet_positions, which keeps its capacity from frame to frame. The instance tables and the
+// trails read it on positionsChanged, nothing goes through item model signals.
+void PlanetModel::updatePositions(const dVector3D *positions, qsizetype count, QDateTime date, u64 trail_end) {
+    TRACE_SCOPE("PlanetModel::updatePositions");
+    QList<dVector3D> &planet_positions = data_manager->m_planet_positions;
+    planet_positions.resize(count);
+
     // scale positions for visualization purposes. units in are AU
-    for (dVector3D &pos : positions) {
-            pos.x *= distance_from_center;
-            pos.y *= distance_from_center;
-            pos.z *= distance_from_center;
+    for (qsizetype i = 0; i < count; i++) {
+            planet_positions[i].x = positions[i].x * distance_from_center;
+            planet_positions[i].y = positions[i].y * distance_from_center;
+            planet_positions[i].z = positions[i].z * distance_from_center;
     }
 
-    if (data_manager->m_planet_positions.size() < positions.size()) {
-            beginInsertRows(QModelIndex(), data_manager->m_planet_positions.size(), data_manager->m_planet_positions.size() + positions.size() - 1);
-            data_manager->m_planet_positions = positions;
-            endInsertRows();
+    m_trail_end = trail_end;
+    emit positionsChanged();
+    m_date = date;
+    emit dateChanged();
+}
+
+// Commands that don't fit in the queue wait in m_unsent, so none are lost and they stay in order.
+void PlanetModel::post(WorkerCommand command) {
+    m_unsent.append(command);
+    sendUnsent();
+}
+
+// Called for every command, every fetched frame and by the timer, which keeps trying until the worker has
+// made room even if the UI does nothing else.
+void PlanetModel::sendUnsent() {
+    while (!m_unsent.isEmpty() && m_workerThread->post(m_unsent.first())) {
+        m_unsent.removeFirst();
     }
-    else {
-            data_manager->m_planet_positions = positions;
-            emit dataChanged(createIndex(0, 0), createIndex(data_manager->m_planet_positions.size()-1, 0));
+    if (!m_unsent.isEmpty() && !m_resend_timer.isActive()) {
+        m_resend_timer.start();
     }
 }
 
 void PlanetModel::calculatePositions(QDateTime datetime) {
-    emit new_date_input(datetime);
-    if (!m_workerThread->active) {
-            QList<dVector3D> positions = calc::calculatePositions(data_manager->m_planets, datetime);
-        updatePositions(positions);
-    }
+    WorkerCommand command = {WorkerCommand::SetDate};
+    command.date = datetime;
+    post(command);
 }
 
 void PlanetModel::calculatePositionsRepeatedly() {
-    if (!m_workerThread->active)
-        m_workerThread->start();
-    else
-        m_workerThread->disable();
+    m_animating = !m_animating;
+    WorkerCommand command = {WorkerCommand::SetAnimating};
+    command.flag = m_animating;
+    post(command);
+    if (m_animating) {
+        m_workerThread->tick();
+    }
+    else {
+        m_frame_interval = 0.0;
+    }
+    emit animatingChanged();
 }
 
 void PlanetModel::setAnimationSpeed(double value) {
-    m_workerThread->set_speed(value);
+    WorkerCommand command = {WorkerCommand::SetSpeed};
+    command.value = value;
+    post(command);
+}
+
+// Computes the animation at a few keyframes per body and interpolates in between, see KeyframeEphemeris.
+void PlanetModel::setKeyframes(bool enabled) {
+    WorkerCommand command = {WorkerCommand::SetKeyframes};
+    command.flag = enabled;
+    post(command);
+}
+
+void PlanetModel::showMonth(int year, int month) {
+    WorkerCommand command = {WorkerCommand::ShowMonth};
+    command.date = QDate(year, month, 1).startOfDay();
+    post(command);
+}
+
+// Without the series files this keeps using the approximate formulae.
+void PlanetModel::setHighPrecision(bool enabled) {
+    WorkerCommand command = {WorkerCommand::SetHighPrecision};
+    command.flag = enabled;
+    post(command);
+}
+
+// Only where the approximate formulae are used, which is everywhere without the series for any tier but the
+// full one. The ephemeris cache is a fit of the full tier, see FrameEphemeris.
+void PlanetModel::setAccuracy(int level) {
+    WorkerCommand command = {WorkerCommand::SetAccuracy};
+    command.value = qBound(0, level, AccuracyLevelCount - 1);
+    post(command);
+}
+
+// Only in high precision mode, with the series files present.
+void PlanetModel::setTruncation(int truncation) {
+    WorkerCommand command = {WorkerCommand::SetTruncation};
+    command.value = qBound(0, truncation, SeriesTruncationCount - 1);
+    post(command);
+}
+
+bool PlanetModel::saveTrace() {
+    return trace::save();
 }
@@ -3,67 +3,265 @@
 
 #include <QObject>
 #include <QQmlEngine>
-#include <QAbstractListModel>
 #include <QThread>
-#include <QDeadlineTimer>
+#include <QSemaphore>
 #include <QElapsedTimer>
+#include <QTimer>
 #include <time.h>
 #include "datastructures.h"
 #include "calculate_positions.h"
 #include "datamanager.h"
+#include "frame_ephemeris.h"
+#include "keyframe_ephemeris.h"
+#include "frame_cache.h"
+#include "triple_buffer.h"
+#include "spsc_queue.h"
+#include "trace.h"
+#include "metrics.h"
 
 
+#define WORKER_REFERENCE_RATE 60.0 // frames per second the animation speed is given for
+#define WORKER_MAX_STEP_NS 100000000 // longer gaps between frames (a stalled window) don't make the animation jump
+#define WORKER_RESEND_MS 2 // how soon commands that didn't fit in the worker's queue are sent again
+
+// One frame of the animation, as the worker hands it to the UI.
+struct PlanetFrame {
+    QVarLengthArray<dVector3D, 16> positions; // one per body, in AU
+    QDateTime date;
+    qint64 interval_ns; // since the tick of the previous frame, 0 for the first one
+    qint64 compute_ns;  // time the worker spent on the frame
+    u64 trail_end;      // samples in the trails up to and including this frame
+    qint64 cache_hits;  // of the worker's FrameCache so far
+    qint64 cache_misses;
+    u64 number;         // counts the frames the worker published, ties its part of a frame to the UI's in a trace
+    qint64 tick_ns;     // on trace::now()'s clock, when the worker was ticked for the frame, or started it when paused
+};
+
+// A change to the simulation, from the UI to the worker.
+struct WorkerCommand {
+    enum Type {
+        SetDate,          // date
+        SetSpeed,         // value, in days per frame at WORKER_REFERENCE_RATE
+        SetHighPrecision, // flag
+        SetAccuracy,      // value, an AccuracyLevel for the approximate formulae
+        SetTruncation,    // value, a SeriesTruncation for the high precision series
+        SetAnimating,     // flag
+        SetKeyframes,     // flag, interpolate the animation between keyframes
+        ShowMonth,        // date, the first day of the month the calendar shows
+    };
+    Type type;
+    QDateTime date;
+    double value;
+    bool flag;
+};
+
+/*
+ * Runs all the ephemeris math, the UI thread only sends it commands and fetches the frames it computes.
+ *
+ * While animating, the worker computes the animation one frame ahead of the display. The UI ticks the worker
+ * each time it fetches a frame, so the worker runs at the refresh rate of the window, whatever it is, and
+ * sleeps in between. Simulated time advances by the measured time between ticks, which keeps the speed of the
+ * animation independent of the refresh rate. While paused, it computes a frame whenever the date changes and
+ * signals frameReady for it.
+ *
+ * Commands are only ever applied between frames. All the ones that came in since the last frame are applied
+ * at once and only the last of each kind counts, so a burst of date changes costs one frame.
+ *
+ * Frames for a new date come from a FrameCache when they can. While paused and with nothing else to do, the
+ * worker fills the cache with the dates FramePrefetcher expects next, one at a time so a command never waits
+ * for more than one frame.
+ *
+ * With tracing on, every frame is a "worker frame" slice in the trace with a flow to the UI's fetch of it.
+ * The frame count and the time of the ephemeris go to the MetricsRegistry.
+ */
 class WorkerThread : public QThread {
     Q_OBJECT
 
     void run() override {
-        active = true;
+        QElapsedTimer clock;
+        clock.start();
+        qint64 last_tick = -1;
+        bool animating = false;
+        bool use_keyframes = false;
+        double step_days = secs_per_second / (86400.0 * WORKER_REFERENCE_RATE); // of the last frame
 
-        while (active) {
-            QDeadlineTimer deadline(16); // 60 fps is about 16.67 ms
-            QList<dVector3D> positions = calc::calculatePositions(bodies, date);
-            date = date.addSecs(secs_per_update);
-            emit new_positions(positions);
-
-            qint64 time_left = deadline.remainingTime();
-            if (time_left > 0) {
-                this->msleep(time_left - 1);
+        while (!stopping.loadAcquire()) {
+            // A date is only taken from the prefetcher once it is certain to be computed, a pending command
+            // leaves it for the next time around.
+            if (!animating && prefetcher.hasNext()) {
+                if (!wake.tryAcquire()) {
+                    QDateTime prefetch_date;
+                    prefetcher.next(&prefetch_date);
+                    prefetch(prefetch_date);
+                    continue;
+                }
+            }
+            else {
+                wake.acquire();
+            }
+            if (stopping.loadAcquire()) return;
 
-                while (!deadline.hasExpired()) {
-                    // spin last millisecond to avoid overshooting.
+            QDateTime previous_date = date;
+            bool date_changed = false;
+            WorkerCommand command;
+            while (commands.pop(&command)) {
+                switch (command.type) {
+                    case WorkerCommand::SetDate:
+                        date = command.date;
+                        date_changed = true;
+                        keyframes.reset();
+                        trails->clear();
+                        break;
+                    case WorkerCommand::SetSpeed:
+                        secs_per_second = 3600.0 * 24.0 * command.value * WORKER_REFERENCE_RATE;
+                        break;
+                    case WorkerCommand::SetHighPrecision:
+                        ephemeris.setHighPrecision(command.flag);
+                        date_changed = true;
+                        keyframes.reset();
+                        cache.clear();
+                        break;
+                    case WorkerCommand::SetAccuracy:
+                        ephemeris.setAccuracy(calc::accuracyTier((AccuracyLevel)(int)command.value));
+                        date_changed = true;
+                        keyframes.reset();
+                        cache.clear();
+                        break;
+                    case WorkerCommand::SetTruncation:
+                        ephemeris.setTruncation((SeriesTruncation)(int)command.value);
+                        date_changed = true;
+                        keyframes.reset();
+                        cache.clear();
+                        break;
+                    case WorkerCommand::SetAnimating:
+                        animating = command.flag;
+                        last_tick = -1;
+                        keyframes.reset();
+                        break;
+                    case WorkerCommand::SetKeyframes:
+                        use_keyframes = command.flag;
+                        keyframes.reset();
+                        break;
+                    case WorkerCommand::ShowMonth:
+                        prefetcher.monthShown(command.date.date().year(), command.date.date().month(), date);
+                        break;
                 }
             }
+            bool ticked = tick_pending.fetchAndStoreAcquire(0) != 0;
+            if (!(animating && ticked) && !date_changed) continue;
+
+            qint64 now = clock.nsecsElapsed();
+            qint64 interval = 0;
+            if (animating) {
+                interval = last_tick < 0 ? 0 : now - last_tick;
+                last_tick = now;
+            }
+
+            TRACE_SCOPE("worker frame");
+            PlanetFrame &frame = frames->writeBuffer();
+            frame.tick_ns = animating && ticked ? tick_time.loadRelaxed() : trace::now();
+            frame.positions.resize(body_count);
+            if (animating && use_keyframes) {
+                keyframes.calculatePositions(date, step_days, frame.positions.data());
+            }
+            else if (animating) {
+                ephemeris.calculatePositions(date, frame.positions.data());
+            }
+            else if (!cache.lookup(date, frame.positions.data())) {
+                ephemeris.calculatePositions(FrameCache::keyDate(FrameCache::key(date)), frame.positions.data());
+                cache.insert(date, frame.positions.constData());
+            }
+            metrics->record(MetricsRegistry::EphemerisNs, clock.nsecsElapsed() - now);
+            metrics->add(MetricsRegistry::WorkerFrames);
+            frame.date = date;
+            frame.interval_ns = interval;
+            trails->append(frame.positions.constData());
+            frame.trail_end = trails->written();
+            frame.cache_hits = cache.hits();
+            frame.cache_misses = cache.misses();
+            frame.compute_ns = clock.nsecsElapsed() - now;
+            frame.number = ++frame_number;
+            TRACE_FLOW_START("frame", frame.number);
+            frames->publish();
+
+            if (animating) {
+                qint64 step = qMin(interval, (qint64)WORKER_MAX_STEP_NS);
+                if (interval == 0) step = (qint64)(1E9 / WORKER_REFERENCE_RATE);
+                date = date.addMSecs((qint64)(step * 1E-6 * secs_per_second));
+                step_days = step * 1E-9 * secs_per_second / 86400.0;
+            }
+            else {
+                if (date != previous_date) prefetcher.dateChanged(previous_date, date);
+                emit frameReady();
+            }
         }
     }
 
+    void prefetch(QDateTime datetime) {
+        if (cache.contains(datetime)) return;
+        TRACE_SCOPE("prefetch");
+        prefetch_positions.resize(body_count);
+        ephemeris.calculatePositions(FrameCache::keyDate(FrameCache::key(datetime)), prefetch_positions.data());
+        cache.insert(datetime, prefetch_positions.constData());
+    }
+
 public:
-    WorkerThread(QList<CelestialBody> bodies, QDateTime start_date, QObject *parent = 0)
-    : QThread(parent) {
-        this->bodies = bodies;
+    WorkerThread(QList<CelestialBody> bodies, const EphemerisCache *ephemeris_cache, const SeriesEphemeris *series_ephemeris,
+                 TrailBuffer *trails, TripleBuffer<PlanetFrame> *frames, QDateTime start_date, QObject *parent = 0)
+    : QThread(parent), ephemeris(bodies, ephemeris_cache, series_ephemeris), keyframes(&ephemeris), cache(bodies.size()),
+      metrics(MetricsRegistry::getInstance()), frame_number(0), stopping(0), tick_pending(0), tick_time(0) {
+        setObjectName("worker"); // also names the thread in traces and debuggers
+        this->body_count = bodies.size();
+        this->frames = frames;
+        this->trails = trails;
         this->date = start_date;
-        this->secs_per_update = 3600 * 24;
+        this->secs_per_second = 3600.0 * 24.0 * WORKER_REFERENCE_RATE;
     }
 
-    void disable() {
-        active = false;
+    // Only called from one thread. Returns false if the worker is that far behind. The command isn't queued then,
+    // the caller keeps it and posts it again later.
+    bool post(const WorkerCommand &command) {
+        if (!commands.push(command)) return false;
+        wake.release();
+        return true;
     }
 
-    void set_speed(double speed) {
-        this->secs_per_update = (int64_t)(3600.0 * 24.0 * speed);
+    // Makes run() return before the next frame, without going through the queue, which may be full. Commands
+    // still queued are dropped.
+    void stop() {
+        stopping.storeRelease(1);
+        wake.release();
     }
 
-    QList<CelestialBody> bodies;
-    QDateTime date;
-    bool active;
-    int64_t secs_per_update;
+    // Lets the worker compute the next frame of the animation. Ticks don't pile up while it is still busy.
+    void tick() {
+        tick_time.storeRelaxed(trace::now()); // ordered before the worker sees the tick by the release below
+        if (tick_pending.fetchAndStoreRelease(1) == 0) wake.release();
+    }
 
 signals:
-    void new_positions(QList<dVector3D> positions);
+    void frameReady(); // a frame outside of the animation, like for a new date
 
-public slots:
-    void set_date(QDateTime datetime) {
-        this->date = datetime;
-    }
+private:
+    // Only touched by the worker thread once it runs.
+    FrameEphemeris ephemeris;
+    KeyframeEphemeris keyframes; // in front of ephemeris while animating with keyframes
+    FrameCache cache; // in front of ephemeris while paused
+    FramePrefetcher prefetcher;
+    QVarLengthArray<dVector3D, 16> prefetch_positions;
+    qsizetype body_count;
+    TripleBuffer<PlanetFrame> *frames; // the UI fetches the latest one, frames it misses are dropped
+    TrailBuffer *trails; // gets every frame, also those the UI drops
+    QDateTime date;
+    double secs_per_second; // simulated per real second
+    MetricsRegistry *metrics;
+    u64 frame_number;
+
+    SpscQueue<WorkerCommand, 64> commands;
+    QAtomicInteger<int> stopping;
+    QAtomicInteger<int> tick_pending;
+    QAtomicInteger<qint64> tick_time; // of the latest tick
+    QSemaphore wake; // released for every command and tick
 };
 
 
@@ -73,41 +271,78 @@ enum Visualization {
     StarChart,
 };
 
-class PlanetModel : public QAbstractListModel {
+class PlanetModel : public QObject {
     Q_OBJECT
     QML_ELEMENT
+    Q_PROPERTY(QDateTime date READ date NOTIFY dateChanged)
+    Q_PROPERTY(bool animating READ animating NOTIFY animatingChanged)
+    Q_PROPERTY(double distanceScale READ distanceScale CONSTANT) // scene units per AU of the ephemeris positions
+    // Averages over the last second or so of the animation, in milliseconds.
+    Q_PROPERTY(double frameInterval READ frameInterval NOTIFY metricsChanged)
+    Q_PROPERTY(double frameJitter READ frameJitter NOTIFY metricsChanged) // mean deviation from the interval
+    Q_PROPERTY(double workerLoad READ workerLoad NOTIFY metricsChanged) // fraction of the interval the worker was busy
+    // Dates served from the worker's FrameCache and those it had to compute.
+    Q_PROPERTY(qint64 cacheHits READ cacheHits NOTIFY metricsChanged)
+    Q_PROPERTY(qint64 cacheMisses READ cacheMisses NOTIFY metricsChanged)
 
 public:
-    // Model related things
     PlanetModel(QObject *parent = 0);
-    //  ~Vector3DListModel();
-    QHash<int, QByteArray> roleNames() const;
-    int rowCount(const QModelIndex& parent = QModelIndex()) const;
-    QVariant data(const QModelIndex& index, int role) const;
-
-    enum CustomRoles {
-        XRole=Qt::UserRole+1,
-        YRole,
-        ZRole,
-        ColorRole,
-        RadiusRole,
-    };
+    ~PlanetModel();
+    QDateTime date() const; // of the positions shown
+    bool animating() const;
+    double distanceScale() const;
+    u64 trailEnd() const; // samples in DataManager::m_trails up to the frame shown
+    double frameInterval() const;
+    double frameJitter() const;
+    double workerLoad() const;
+    qint64 cacheHits() const;
+    qint64 cacheMisses() const;
 
 public slots:
     void calculatePositions(QDateTime date);
     void calculatePositionsRepeatedly();
-    void updatePositions(QList<dVector3D> positions);
+    // Takes the latest frame of the animation, if there is a new one. Called once per rendered frame.
+    void fetchFrame();
     void setAnimationSpeed(double value);
+    void setHighPrecision(bool enabled);
+    // level is an AccuracyLevel, from 0 for the most accurate.
+    void setAccuracy(int level);
+    // truncation is a SeriesTruncation, from 0 for every term.
+    void setTruncation(int truncation);
+    void setKeyframes(bool enabled);
+    // The calendar shows month (1 to 12) of year, so its days are worth computing ahead.
+    void showMonth(int year, int month);
+    // Writes the trace to the file given in OBSERVE_TRACE, see trace.h. False if tracing is off.
+    bool saveTrace();
     //void calculatePositions(int year, int month, int day, int hours, int minutes, int seconds);
 
 signals:
-    void new_date_input(QDateTime datetime);
+    void dateChanged();
+    void positionsChanged(); // m_planet_positions has a new frame
+    void animatingChanged();
+    void metricsChanged();
 
 private:
+    void updatePositions(const dVector3D *positions, qsizetype count, QDateTime date, u64 trail_end);
+    void updateMetrics(const PlanetFrame &frame);
+    void post(WorkerCommand command);
+    void sendUnsent();
+
     DataManager *data_manager;
+    TripleBuffer<PlanetFrame> m_frames;
     WorkerThread *m_workerThread;
+    QList<WorkerCommand> m_unsent; // didn't fit in the worker's queue, sent again before the next command
+    QTimer m_resend_timer; // sends m_unsent again while there is no next command or frame
     double distance_from_center;
     Visualization visualization;
+    QDateTime m_date;
+    u64 m_trail_end;
+    bool m_animating;
+    double m_frame_interval;
+    double m_frame_jitter;
+    double m_worker_load;
+    qint64 m_cache_hits;
+    qint64 m_cache_misses;
 };
 
 #endif // PLANETMODEL_H
@@ -0,0 +1,394 @@
+#ifndef POSITION_KERNEL_H
+#define POSITION_KERNEL_H
+
+#include <QtMath>
+#include "datastructures.h"
+#include "calculate_positions.h"
+#include "simd.h"
+#include "kepler.h"
+
+/*
+ * The math of calc::calculatePositions and calc::calculatePositionSeries, templated on the number type: f64 or
+ * f32 for a single instant, f64xN for SIMD_LANES instants at once. Only calculate_positions.cpp and
+ * position_kernel_avx2.cpp include this. The second one is compiled with AVX2 and FMA and only called on CPUs
+ * that have them, so the functions are in a namespace named after the instruction set, like simd.h's, and the
+ * two translation units never share a copy. Only the types, which have no code, are outside of it.
+ */
+
+#if SIMD_LANES == 4
+    #define POSITION_KERNEL positions_avx
+#elif SIMD_LANES == 2
+    #define POSITION_KERNEL positions_sse2
+#else
+    #define POSITION_KERNEL positions_scalar
+#endif
+
+#define DEGREES_TO_RADIANS 0.017453292519943295
+
+// Orbital elements for a given day. Real is either f64 for a single instant, or f64xN to hold
+// SIMD_LANES instants at once.
+template <typename Real>
+struct Elements {
+    Real N, i, w, a, e, M;
+};
+
+// Corrections for significant perturbations for certain bodies. calc::resolveBodies binds these to the
+// bodies they apply to, so that the per-instant code calls a handler instead of comparing names.
+template <typename Real>
+struct PerturbationArguments {
+    Elements<Real> el;
+    Real lon_sun;
+    Real M_sun;
+    Real M_jupiter;
+    Real M_saturn;
+};
+
+namespace POSITION_KERNEL {
+
+inline double normalizeDegrees(double degrees) {
+    if (degrees >= 0) return fmod(degrees, 360.0);
+    else              return fmod(degrees, 360.0) + 360;
+}
+
+inline f64xN normalizeDegrees(f64xN degrees) {
+    return degrees - 360.0 * floor(degrees * (1.0 / 360.0));
+}
+
+// d is the days since 2000 expressed as a decimal number, calculated separately.
+template <typename Real>
+Elements<Real> elements_for_day(const CelestialBody &body, Real d) {
+    Elements<Real> el;
+    el.N = body.base_elements.N + d * body.delta.N;
+    el.i = body.base_elements.i + d * body.delta.i;
+    el.w = body.base_elements.w + d * body.delta.w;
+    el.a = body.base_elements.a + d * body.delta.a;
+    el.e = body.base_elements.e + d * body.delta.e;
+    el.M = body.base_elements.M + d * body.delta.M;
+
+    // all angles need to be radians and in [0,2pi]
+    el.N = normalizeDegrees(el.N) * DEGREES_TO_RADIANS;
+    el.i = normalizeDegrees(el.i) * DEGREES_TO_RADIANS;
+    el.w = normalizeDegrees(el.w) * DEGREES_TO_RADIANS;
+    el.M = normalizeDegrees(el.M) * DEGREES_TO_RADIANS;
+
+    return el;
+}
+
+// Only the mean anomaly of elements_for_day, for the bodies whose other elements aren't needed.
+template <typename Real>
+Real meanAnomaly(const CelestialBody &body, Real d) {
+    return normalizeDegrees(body.base_elements.M + d * body.delta.M) * DEGREES_TO_RADIANS;
+}
+
+template <typename Real>
+void moonPerturbation(const PerturbationArguments<Real> &args, Real *lon_ecl, Real *lat_ecl, Real *r) {
+    const Elements<Real> &el = args.el;
+    Real lon_moon = el.M + el.w + el.N; // Mean longitude
+    Real D = lon_moon - args.lon_sun; // Mean elongation
+    Real F = lon_moon - el.N; // Argument of latitude
+
+    *lon_ecl -= qDegreesToRadians(1.274) * sin(el.M - 2*D);
+    *lon_ecl += qDegreesToRadians(0.658) * sin(2*D);
+    *lon_ecl -= qDegreesToRadians(0.186) * sin(args.M_sun);
+    *lon_ecl -= qDegreesToRadians(0.059) * sin(2*el.M - 2*D);
+    *lon_ecl -= qDegreesToRadians(0.057) * sin(el.M - 2*D + args.M_sun);
+    *lon_ecl += qDegreesToRadians(0.053) * sin(el.M + 2*D);
+    *lon_ecl += qDegreesToRadians(0.046) * sin(2*D - args.M_sun);
+    *lon_ecl += qDegreesToRadians(0.041) * sin(el.M - args.M_sun);
+    *lon_ecl -= qDegreesToRadians(0.035) * sin(D);
+    *lon_ecl -= qDegreesToRadians(0.031) * sin(el.M + args.M_sun);
+    *lon_ecl -= qDegreesToRadians(0.015) * sin(2*F - 2*D);
+    *lon_ecl += qDegreesToRadians(0.011) * sin(el.M - 4*D);
+    *lat_ecl -= qDegreesToRadians(0.173) * sin(F - 2*D);
+    *lat_ecl -= qDegreesToRadians(0.055) * sin(el.M - F - 2*D);
+    *lat_ecl -= qDegreesToRadians(0.046) * sin(el.M + F - 2*D);
+    *lat_ecl += qDegreesToRadians(0.033) * sin(F + 2*D);
+    *lat_ecl += qDegreesToRadians(0.017) * sin(2*el.M + F);
+    *r -= qDegreesToRadians(0.58) * cos(el.M - 2*D);
+    *r -= qDegreesToRadians(0.46) * cos(2*D);
+}
+
+// Jupiter and Saturn perturb each other, and both perturb Uranus.
+template <typename Real>
+void jupiterPerturbation(const PerturbationArguments<Real> &args, Real *lon_ecl, Real *, Real *) {
+    const Elements<Real> &el = args.el;
+    *lon_ecl -= qDegreesToRadians(0.332) * sin(2*el.M - 5*args.M_saturn - qDegreesToRadians(67.6));
+    *lon_ecl -= qDegreesToRadians(0.056) * sin(2*el.M - 2*args.M_saturn + qDegreesToRadians(21));
+    *lon_ecl += qDegreesToRadians(0.042) * sin(3*el.M - 5*args.M_saturn + qDegreesToRadians(21));
+    *lon_ecl -= qDegreesToRadians(0.036) * sin(el.M - 2*args.M_saturn);
+    *lon_ecl += qDegreesToRadians(0.022) * cos(el.M - args.M_saturn);
+    *lon_ecl += qDegreesToRadians(0.023) * sin(2*el.M - 3*args.M_saturn + qDegreesToRadians(52));
+    *lon_ecl -= qDegreesToRadians(0.016) * sin(el.M - 5*args.M_saturn - qDegreesToRadians(69));
+}
+
+template <typename Real>
+void saturnPerturbation(const PerturbationArguments<Real> &args, Real *lon_ecl, Real *lat_ecl, Real *) {
+    const Elements<Real> &el = args.el;
+    *lon_ecl += qDegreesToRadians(0.812) * sin(2*args.M_jupiter - 5*el.M - qDegreesToRadians(67.6));
+    *lon_ecl -= qDegreesToRadians(0.229) * cos(2*args.M_jupiter - 4*el.M - qDegreesToRadians(2));
+    *lon_ecl += qDegreesToRadians(0.119) * sin(args.M_jupiter - 2*el.M - qDegreesToRadians(3));
+    *lon_ecl += qDegreesToRadians(0.046) * sin(2*args.M_jupiter - 6*el.M - qDegreesToRadians(69));
+    *lon_ecl += qDegreesToRadians(0.014) * sin(args.M_jupiter - 3*el.M + qDegreesToRadians(32));
+    *lat_ecl -= qDegreesToRadians(0.020) * cos(2*args.M_jupiter - 4*el.M - qDegreesToRadians(2));
+    *lat_ecl += qDegreesToRadians(0.018) * sin(2*args.M_jupiter - 6*el.M - qDegreesToRadians(49));
+}
+
+template <typename Real>
+void uranusPerturbation(const PerturbationArguments<Real> &args, Real *lon_ecl, Real *, Real *) {
+    const Elements<Real> &el = args.el;
+    *lon_ecl += qDegreesToRadians(0.040) * sin(args.M_saturn - 2*el.M + qDegreesToRadians(6));
+    *lon_ecl += qDegreesToRadians(0.035) * sin(args.M_saturn - 3*el.M + qDegreesToRadians(33));
+    *lon_ecl -= qDegreesToRadians(0.015) * sin(args.M_jupiter - el.M + qDegreesToRadians(20));
+}
+
+// The handler of body b for the resolved bodies' tier, or null.
+template <typename Real>
+PerturbationHandler<Real> boundPerturbation(const ResolvedBodies &resolved, int b) {
+    if (resolved.perturbations == NoPerturbations) return nullptr;
+    if (b == resolved.moon) return moonPerturbation<Real>;
+    if (resolved.perturbations == MoonPerturbations) return nullptr;
+    if (b == resolved.jupiter) return jupiterPerturbation<Real>;
+    if (b == resolved.saturn) return saturnPerturbation<Real>;
+    if (b == resolved.uranus) return uranusPerturbation<Real>;
+    return nullptr;
+}
+
+inline PerturbationHandler<f64> perturbationHandler(const ResolvedBodies &resolved, int b, f64) {
+    return resolved.perturbation[b];
+}
+
+// Once per block of instants and body, which is cheap next to the block.
+inline PerturbationHandler<f64xN> perturbationHandler(const ResolvedBodies &resolved, int b, f64xN) {
+    return boundPerturbation<f64xN>(resolved, b);
+}
+
+inline PerturbationHandler<f32> perturbationHandler(const ResolvedBodies &resolved, int b, f32) {
+    return resolved.float_perturbation[b];
+}
+
+inline bool tooEccentric(f64 e) {
+    return e > 0.98;
+}
+
+inline bool tooEccentric(f32 e) {
+    return e > 0.98f;
+}
+
+inline bool tooEccentric(f64xN e) {
+    return simd_any(simd_lt(simd_set1(0.98), e));
+}
+
+// Sine and cosine of the eccentric anomaly. The single instant path solves Kepler's equation for all bodies
+// up front, with the bodies in SIMD lanes (see calc::solveKepler). The batch path solves each body here, with
+// the instants in the lanes, to the tolerance given here.
+struct SolvedAnomalies {
+    const f64 *sin_E;
+    const f64 *cos_E;
+    double tolerance;
+};
+
+inline void eccentricAnomaly(const Elements<f64> &, const SolvedAnomalies *solved, int b, f64 *sin_E, f64 *cos_E) {
+    *sin_E = solved->sin_E[b];
+    *cos_E = solved->cos_E[b];
+}
+
+inline void eccentricAnomaly(const Elements<f32> &, const SolvedAnomalies *solved, int b, f32 *sin_E, f32 *cos_E) {
+    *sin_E = (f32)solved->sin_E[b];
+    *cos_E = (f32)solved->cos_E[b];
+}
+
+inline void eccentricAnomaly(const Elements<f64xN> &el, const SolvedAnomalies *solved, int, f64xN *sin_E, f64xN *cos_E) {
+    keplerNewton(el.M, el.e, keplerStart(el.M, el.e), simd_first_lanes(SIMD_LANES), solved->tolerance, nullptr, sin_E, cos_E);
+}
+
+// Most angles need both their sine and cosine, which the SIMD version gets from one range reduction.
+inline void sinCos(f64 x, f64 *sin_out, f64 *cos_out) {
+    *sin_out = sin(x);
+    *cos_out = cos(x);
+}
+
+inline void sinCos(f32 x, f32 *sin_out, f32 *cos_out) {
+    *sin_out = sinf(x);
+    *cos_out = cosf(x);
+}
+
+inline void sinCos(f64xN x, f64xN *sin_out, f64xN *cos_out) {
+    simd_sincos(x, sin_out, cos_out);
+}
+
+inline void storeLanes(f64 *destination, f64 value) {
+    *destination = value;
+}
+
+inline void storeLanes(f64 *destination, f32 value) {
+    *destination = value;
+}
+
+inline void storeLanes(f64 *destination, f64xN value) {
+    simd_store(destination, value);
+}
+
+// What every body of an instant needs: the obliquity, where the sun is, and the mean anomalies the
+// perturbations take. Computed once for all bodies, with Real = f64xN once per block of instants.
+template <typename Real>
+struct DayTerms {
+    Real sin_obliquity;
+    Real cos_obliquity;
+    Real xs; // the sun, geocentric ecliptic
+    Real ys;
+    Real lon_sun;
+    Real M_sun;
+    Real M_jupiter;
+    Real M_saturn;
+};
+
+template <typename Real>
+DayTerms<Real> dayTerms(const CelestialBody *bodies, const ResolvedBodies &resolved, Real d) {
+    DayTerms<Real> terms;
+    Real ecliptic_obliquity = (23.4393 - 3.563E-7 * d) * DEGREES_TO_RADIANS;
+    sinCos(ecliptic_obliquity, &terms.sin_obliquity, &terms.cos_obliquity);
+
+    // The sun only needs the series approximation of Kepler's equation.
+    Elements<Real> sun_el = elements_for_day(bodies[0], d);
+    Real sin_M_sun, cos_M_sun;
+    sinCos(sun_el.M, &sin_M_sun, &cos_M_sun);
+    Real E_sun = sun_el.M + sun_el.e * sin_M_sun * (1.0 + sun_el.e * cos_M_sun);
+
+    Real sin_E_sun, cos_E_sun;
+    sinCos(E_sun, &sin_E_sun, &cos_E_sun);
+    Real xv_sun = cos_E_sun - sun_el.e;
+    Real yv_sun = sqrt(1.0 - sun_el.e*sun_el.e) * sin_E_sun;
+
+    Real v_sun = atan2(yv_sun, xv_sun);
+    Real r_sun = sqrt(xv_sun*xv_sun + yv_sun*yv_sun);
+    terms.lon_sun = v_sun + sun_el.w;
+    terms.M_sun = sun_el.M;
+
+    Real sin_lon_sun, cos_lon_sun;
+    sinCos(terms.lon_sun, &sin_lon_sun, &cos_lon_sun);
+    terms.xs = r_sun * cos_lon_sun;
+    terms.ys = r_sun * sin_lon_sun;
+
+    // Jupiter, Saturn and Uranus perturb each other through their mean anomalies.
+    terms.M_jupiter = resolved.jupiter >= 0 ? meanAnomaly(bodies[resolved.jupiter], d) : Real(0.0 * d);
+    terms.M_saturn  = resolved.saturn  >= 0 ? meanAnomaly(bodies[resolved.saturn],  d) : Real(0.0 * d);
+    return terms;
+}
+
+// Method from Paul Schlyter: http://stjarnhimlen.se/comp/ppcomp.html#0
+// bodies has body_count entries, the first is assumed to be the sun.
+//
+// Computes the position of every body at day d, and stores body i at x[i * stride], y[i * stride] and
+// z[i * stride]. With Real = f64xN the lanes of d are consecutive instants, and each store writes
+// SIMD_LANES consecutive values. Bodies too eccentric for the elliptic formulae get NaN.
+// solved holds the eccentric anomalies for the single instant path, and the Kepler tolerance for the batch path.
+// With a mask only the sun and the bodies whose entry is true are stored, the others are left as they were.
+template <typename Real>
+void positionsForDay(const CelestialBody *bodies, qsizetype body_count, const ResolvedBodies &resolved, Real d,
+                     const SolvedAnomalies *solved, f64 *x, f64 *y, f64 *z, qsizetype stride, const bool *mask = nullptr) {
+    const DayTerms<Real> day = dayTerms(bodies, resolved, d);
+    storeLanes(x, day.xs);
+    storeLanes(y, day.ys * day.cos_obliquity);
+    storeLanes(z, day.ys * day.sin_obliquity);
+
+    for (int b = 1; b < body_count; b++) {
+        if (mask && !mask[b]) continue;
+        const Elements<Real> el = elements_for_day(bodies[b], d);
+        const PerturbationHandler<Real> perturbation = perturbationHandler(resolved, b, d);
+
+        if (tooEccentric(el.e)) {
+            // We need to use formula for parabolic orbits
+            storeLanes(x + b * stride, NAN * d);
+            storeLanes(y + b * stride, NAN * d);
+            storeLanes(z + b * stride, NAN * d);
+            continue;
+        }
+        // Solve Kepler's equation numerically for the eccentric anomaly E
+        Real sin_E, cos_E;
+        eccentricAnomaly(el, solved, b, &sin_E, &cos_E);
+
+        Real xv = el.a * (cos_E - el.e);
+        Real yv = el.a * (sqrt(1.0 - el.e*el.e) * sin_E);
+        Real r = sqrt(xv*xv + yv*yv);
+
+        // The true anomaly v only appears as v + w, whose sine and cosine are those of w turned by the
+        // direction of (xv, yv). That saves an atan2 and a sine and cosine.
+        Real sin_w, cos_w;
+        sinCos(el.w, &sin_w, &cos_w);
+        Real inv_r = 1.0 / r;
+        Real cos_vw = (xv * cos_w - yv * sin_w) * inv_r;
+        Real sin_vw = (yv * cos_w + xv * sin_w) * inv_r;
+
+        Real sin_N, cos_N, sin_i, cos_i;
+        sinCos(el.N, &sin_N, &cos_N);
+        sinCos(el.i, &sin_i, &cos_i);
+
+        // heliocentric, ecliptic. For the moon this is geocentric.
+        Real xh = r * (cos_N * cos_vw - sin_N * sin_vw * cos_i);
+        Real yh = r * (sin_N * cos_vw + cos_N * sin_vw * cos_i);
+        Real zh = r * (sin_vw * sin_i);
+
+        // Corrections for significant perturbations for certain bodies, which apply to the longitude, latitude
+        // and distance. The other bodies skip the round trip through them.
+        if (perturbation) {
+            Real lon_ecl = atan2(yh, xh);
+            Real lat_ecl = atan2(zh, sqrt(xh*xh+yh*yh));
+            PerturbationArguments<Real> args = {el, day.lon_sun, day.M_sun, day.M_jupiter, day.M_saturn};
+            perturbation(args, &lon_ecl, &lat_ecl, &r);
+
+            Real sin_lon, cos_lon, sin_lat, cos_lat;
+            sinCos(lon_ecl, &sin_lon, &cos_lon);
+            sinCos(lat_ecl, &sin_lat, &cos_lat);
+            xh = r * cos_lon * cos_lat;
+            yh = r * sin_lon * cos_lat;
+            zh = r           * sin_lat;
+        }
+
+        Real xg;
+        Real yg;
+        Real zg;
+
+        if (b == resolved.moon) {
+            // The moon is already in geocentric. We just convert from Earth radii to AU.
+            xg = xh * 4.258750455597227e-5;
+            yg = yh * 4.258750455597227e-5;
+            zg = zh * 4.258750455597227e-5;
+        }
+        else {
+            // geocentric, ecliptic
+            xg = xh + day.xs;
+            yg = yh + day.ys;
+            zg = zh;
+        }
+
+        // geocentric, equatorial
+        Real xe = xg;
+        Real ye = yg * day.cos_obliquity - zg * day.sin_obliquity;
+        Real ze = yg * day.sin_obliquity + zg * day.cos_obliquity;
+
+        Real inv_len = 1.0 / sqrt(xe*xe + ye*ye + ze*ze);
+        storeLanes(x + b * stride, xe * inv_len);
+        storeLanes(y + b * stride, ye * inv_len);
+        storeLanes(z + b * stride, ze * inv_len);
+    }
+}
+
+// The batch path: count instants, a multiple of SIMD_LANES, in blocks of SIMD_LANES consecutive ones. Body b at
+// instant t goes to x[b * stride + t].
+inline void positionBlocks(const CelestialBody *bodies, qsizetype body_count, const ResolvedBodies &resolved,
+                           const f64 *days, qsizetype count, f64 *x, f64 *y, f64 *z, qsizetype stride) {
+    SolvedAnomalies solved = {nullptr, nullptr, resolved.kepler_tolerance};
+    for (qsizetype t = 0; t + SIMD_LANES <= count; t += SIMD_LANES) {
+        positionsForDay<f64xN>(bodies, body_count, resolved, simd_load(days + t), &solved, x + t, y + t, z + t, stride);
+    }
+}
+
+} // namespace POSITION_KERNEL
+
+namespace calc {
+    // position_kernel_avx2.cpp's positionBlocks, with 4 lanes. Only for CPUs with AVX2 and FMA.
+    void positionBlocksAvx2(const CelestialBody *bodies, qsizetype body_count, const ResolvedBodies &resolved,
+                            const f64 *days, qsizetype count, f64 *x, f64 *y, f64 *z, qsizetype stride);
+}
+
+#endif // POSITION_KERNEL_H
@@ -0,0 +1,13 @@
+#include "position_kernel.h"
+
+#include <immintrin.h>
+
+// Compiled with AVX2 and FMA (see CMakeLists.txt), so this copy of the kernel has 4 lanes.
+static_assert(SIMD_LANES == 4, "position_kernel_avx2.cpp needs to be compiled with AVX2");
+
+void calc::positionBlocksAvx2(const CelestialBody *bodies, qsizetype body_count, const ResolvedBodies &resolved,
+                              const f64 *days, qsizetype count, f64 *x, f64 *y, f64 *z, qsizetype stride) {
+    POSITION_KERNEL::positionBlocks(bodies, body_count, resolved, days, count, x, y, z, stride);
+    // The SSE code of the caller would pay for every instruction while the upper halves are dirty.
+    _mm256_zeroupper();
+}
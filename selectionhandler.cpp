@@ -1,36 +1,143 @@
 #include "selectionhandler.h"
 #include <QDebug>
+#include <QtMath>
+#include "calculate_positions.h"
+#include "trace.h"
+
+#define SPHERE_MESH_RADIUS 50.0f // of QtQuick3D's built-in #Sphere, which the planets are scaled from
 
 SelectionHandler::SelectionHandler() {
     this->data_manager = DataManager::getInstance();
 }
 
 
-bool raySphereIntersection(QVector3D ray_origin, QVector3D ray_direction, QVector3D sphere_pos, float sphere_radius) {
+// The angle between the ray and the nearest point of the sphere, 0 if it hits.
+static float rayToSphereAngle(QVector3D ray_origin, QVector3D ray_direction, QVector3D sphere_pos, float sphere_radius) {
     QVector3D origin_to_sphere = sphere_pos - ray_origin;
+    float distance = origin_to_sphere.length();
+    if (distance <= sphere_radius) return 0.0f;
+
+    float cos_angle = QVector3D::dotProduct(origin_to_sphere / distance, ray_direction);
+    float angle = acosf(qBound(-1.0f, cos_angle, 1.0f)) - asinf(sphere_radius / distance);
+    return qMax(0.0f, angle);
+}
+
+// The stars are drawn on a sphere around the scene origin. Where the ray meets that sphere is the direction
+// to look them up by, which only differs from the ray itself if the camera has moved away from the origin.
+static QVector3D starSphereDirection(QVector3D ray_origin, QVector3D ray_direction) {
+    float b = QVector3D::dotProduct(ray_origin, ray_direction);
+    float c = QVector3D::dotProduct(ray_origin, ray_origin) - STAR_DISTANCE * STAR_DISTANCE;
+    float discriminant = b * b - c;
+    if (discriminant < 0.0f) return ray_direction;
+
+    float t = -b + sqrtf(discriminant);
+    if (t <= 0.0f) return ray_direction;
+    return (ray_origin + ray_direction * t).normalized();
+}
+
+static void addDirection(QVariantMap *result, QVector3D direction) {
+    direction.normalize();
+    double RA = atan2(-(double)direction.z(), (double)direction.x());
+    if (RA < 0.0) RA += 2.0 * M_PI;
+    double declination = asin(qBound(-1.0, (double)direction.y(), 1.0));
+    (*result)["rightAscension"] = RA * 12.0 / M_PI;
+    (*result)["declination"] = qRadiansToDegrees(declination);
+}
 
-    float origin_to_middle = QVector3D::dotProduct(origin_to_sphere, ray_direction);
-    float d_squared = QVector3D::dotProduct(origin_to_sphere, origin_to_sphere) - origin_to_middle * origin_to_middle;
-    float sphere_radius_squared = sphere_radius * sphere_radius;
+static QString spectralTypeName(u16 spectral_type) {
+    char name[3] = {(char)(spectral_type & 0xFF), (char)(spectral_type >> 8), 0};
+    return QString::fromLatin1(name).trimmed();
+}
 
-    return d_squared <= sphere_radius_squared;
+// The place of a tile star at years since J2000, which star.vert computes on the GPU: the direction moved by the
+// proper motion, with east and north like StarInstanceTable::appendStar, then precessed.
+static QVector3D tileStarPlace(const StarTile &tile, qsizetype star, double years, const double precession[3][3]) {
+    QVector3D direction(tile.x[star], tile.y[star], tile.z[star]);
+    QVector3D east = QVector3D::crossProduct(QVector3D(0, 1, 0), direction);
+    east = east.lengthSquared() > 1E-12f ? east.normalized() : QVector3D(1, 0, 0);
+    QVector3D north = QVector3D::crossProduct(direction, east);
+    QVector3D motion = (east * tile.proper_motion_ra[star] + north * tile.proper_motion_decl[star]) / MILLIARCSECONDS_PER_RADIAN;
+    QVector3D p = (direction + motion * years).normalized();
+    return QVector3D(precession[0][0] * p.x() + precession[0][1] * p.y() + precession[0][2] * p.z(),
+                     precession[1][0] * p.x() + precession[1][1] * p.y() + precession[1][2] * p.z(),
+                     precession[2][0] * p.x() + precession[2][1] * p.y() + precession[2][2] * p.z());
+}
 
-    /*
-    float middle_to_entry = sqrt(sphere_radius_squared - d_squared);
-    float entry_point = origin_to_middle - middle_to_entry;
-    float exit_point  = origin_to_middle + middle_to_entry;
-    */
+// catalog is the prefix for the star's number, like HR for the Bright Star Catalog.
+static QVariantMap starResult(QString catalog, qsizetype index, QVector3D direction, float catalog_number, int16 magnitude, u16 spectral_type) {
+    QVariantMap result;
+    result["type"] = "star";
+    result["index"] = (qlonglong)index;
+    result["catalogNumber"] = (qlonglong)catalog_number;
+    result["name"] = (catalog.isEmpty() ? "" : catalog + " ") + QString::number((qlonglong)catalog_number);
+    result["magnitude"] = magnitude / 100.0;
+    result["spectralType"] = spectralTypeName(spectral_type);
+    result["position"] = QVariant::fromValue(direction * STAR_DISTANCE);
+    addDirection(&result, direction);
+    return result;
 }
 
-void SelectionHandler::rayPick(QVector3D origin, QVector3D direction) {
+
+QVariantMap SelectionHandler::rayPick(QVector3D origin, QVector3D direction, float max_angle) {
+    TRACE_SCOPE("SelectionHandler::rayPick");
     direction.normalize();
+    float best_angle = qDegreesToRadians(max_angle);
+    QVariantMap result;
 
-    for (int i = 0; i < data_manager->m_planet_count; i++) {
+    // There are only a handful of bodies and they move every frame, so they aren't worth indexing.
+    for (int i = 0; i < data_manager->m_planet_positions.size() && i < data_manager->m_planets.size(); i++) {
         dVector3D pos = data_manager->m_planet_positions[i];
-        float radius  = data_manager->m_planets[i].radius;
-        if (raySphereIntersection(origin, direction, QVector3D(pos.x, pos.y, pos.z), radius))
-            qDebug() << "hit" << data_manager->m_planets[i].name;
+        QVector3D center(pos.x, pos.z, -pos.y); // Z up to Y up, like PlanetInstanceTable
+        float radius = data_manager->m_planets[i].radius * SPHERE_MESH_RADIUS;
+
+        float angle = rayToSphereAngle(origin, direction, center, radius);
+        if (angle <= best_angle) {
+            best_angle = angle;
+            result.clear();
+            result["type"] = "planet";
+            result["index"] = i;
+            result["name"] = data_manager->m_planets[i].name;
+            result["position"] = QVariant::fromValue(center);
+            addDirection(&result, center);
+        }
     }
-}
 
+    // The stars are indexed at their J2000 places, the screen shows them precessed to the date.
+    QVector3D sky_direction = starSphereDirection(origin, direction);
+    double precession[3][3];
+    calc::precessionMatrix(data_manager->m_star_epoch, precession);
+    sky_direction = QVector3D(
+        precession[0][0] * sky_direction.x() + precession[1][0] * sky_direction.y() + precession[2][0] * sky_direction.z(),
+        precession[0][1] * sky_direction.x() + precession[1][1] * sky_direction.y() + precession[2][1] * sky_direction.z(),
+        precession[0][2] * sky_direction.x() + precession[1][2] * sky_direction.y() + precession[2][2] * sky_direction.z());
+    float star_angle = 0.0f;
+    StarTileCatalog &tiles = data_manager->m_star_tiles;
+    if (tiles.isOpen()) {
+        for (const QSharedPointer<const StarTile> &tile : tiles.visibleTiles()) {
+            qsizetype star = tile->sky_index.nearest(sky_direction, best_angle, &star_angle);
+            if (star >= 0 && star_angle < best_angle) {
+                best_angle = star_angle;
+                QVector3D star_direction = tileStarPlace(*tile, star, data_manager->m_star_epoch, precession);
+                result = starResult("", star, star_direction, tile->ids[star], tile->magnitudes[star], tile->spectral_types[star]);
+            }
+        }
+    }
+    else {
+        StarStore &stars = data_manager->m_stars;
+        qsizetype star = data_manager->m_star_index.nearest(sky_direction, best_angle, &star_angle);
+        if (star >= 0 && star_angle < best_angle) {
+            best_angle = star_angle;
+            // Where it is drawn, with its proper motion and precessed to the date.
+            StarPlaces places = data_manager->starPlaces(data_manager->m_star_epoch);
+            QVector3D star_direction(places.x[star], places.y[star], places.z[star]);
+            const QList<f32> &ids = stars.ids();
+            const QList<u16> &spectral_types = stars.spectralTypes();
+            result = starResult("HR", star, star_direction, ids.value(star), stars.magnitude(star), spectral_types.value(star));
+        }
+    }
 
+    if (!result.isEmpty()) {
+        result["angle"] = qRadiansToDegrees(best_angle);
+    }
+    return result;
+}
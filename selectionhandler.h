@@ -4,6 +4,7 @@
 #include <QObject>
 #include <QtQmlIntegration>
 #include <QVector3D>
+#include <QVariantMap>
 #include "datamanager.h"
 
 class SelectionHandler : public QObject {
@@ -11,7 +12,13 @@ class SelectionHandler : public QObject {
     QML_ELEMENT
 public:
     SelectionHandler();
-    Q_INVOKABLE void rayPick(QVector3D origin, QVector3D direction);
+    // The star or body nearest to the ray, within max_angle degrees of it. Cheap enough to call on every mouse move.
+    // Returns an empty map if there is none, otherwise:
+    //   type ("star" or "planet"), name, index, position (scene), rightAscension (hours) and declination (degrees)
+    //   of the direction from the scene origin, angle (degrees from the ray), and for stars catalogNumber,
+    //   magnitude and spectralType. Stars give the place they are drawn at: moved by their proper motion and
+    //   precessed from J2000 to the date.
+    Q_INVOKABLE QVariantMap rayPick(QVector3D origin, QVector3D direction, float max_angle);
 
     DataManager *data_manager;
 };
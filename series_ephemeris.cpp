@@ -0,0 +1,451 @@
+#include "series_ephemeris.h"
+#include "calculate_positions.h"
+#include <QDebug>
+#include <QFile>
+#include <QTextStream>
+#include <QtMath>
+#include <cmath>
+#include <algorithm>
+#include "simd.h"
+
+#define ARCSECONDS_PER_RADIAN 206264.80624709636
+#define DEGREES_TO_RADIANS 0.017453292519943295
+
+// Truncation works on the largest value a term reaches, and the T^n terms grow with time. The supported
+// range is the one of the ephemeris cache, 1900 to 2100, which is within a tenth of a millennium of J2000.
+#define SERIES_SPAN_MILLENNIA 0.1
+
+#define LIGHT_DAYS_PER_AU 0.0057755183
+#define MOON_LIGHT_TIME_DAYS 1.4838E-5 // 1.282 s at the mean distance, which is within 5% of the actual one
+
+static double truncationThreshold(SeriesTruncation truncation) {
+    switch (truncation) {
+        case FullSeries:      return 0.0;
+        case FineSeries:      return 1E-9;
+        case ArcsecondSeries: return 1E-7;
+        case CoarseSeries:    return 1E-6;
+    }
+    return 0.0;
+}
+
+// TT - UT in seconds, from the polynomials of Espenak and Meeus. Good to a few seconds over the 20th and 21st
+// centuries, which moves the moon by about a second of arc.
+static double deltaT(double year) {
+    double t;
+    if (year < 1900.0 || year >= 2150.0) {
+        double u = (year - 1820.0) / 100.0;
+        return -20.0 + 32.0 * u*u;
+    }
+    if (year < 1920.0) {
+        t = year - 1900.0;
+        return -2.79 + 1.494119*t - 0.0598939*t*t + 0.0061966*t*t*t - 0.000197*t*t*t*t;
+    }
+    if (year < 1941.0) {
+        t = year - 1920.0;
+        return 21.20 + 0.84493*t - 0.076100*t*t + 0.0020936*t*t*t;
+    }
+    if (year < 1961.0) {
+        t = year - 1950.0;
+        return 29.07 + 0.407*t - t*t/233.0 + t*t*t/2547.0;
+    }
+    if (year < 1986.0) {
+        t = year - 1975.0;
+        return 45.45 + 1.067*t - t*t/260.0 - t*t*t/718.0;
+    }
+    if (year < 2005.0) {
+        t = year - 2000.0;
+        return 63.86 + 0.3345*t - 0.060374*t*t + 0.0017275*t*t*t + 0.000651814*t*t*t*t + 0.00002373599*t*t*t*t*t;
+    }
+    if (year < 2050.0) {
+        t = year - 2000.0;
+        return 62.92 + 0.32217*t + 0.005589*t*t;
+    }
+    double u = (year - 1820.0) / 100.0;
+    return -20.0 + 32.0 * u*u - 0.5628 * (2150.0 - year);
+}
+
+static double normalizedRadians(double degrees) {
+    return qDegreesToRadians(degrees - 360.0 * floor(degrees / 360.0));
+}
+
+// Sum of A cos(B + C t) over a range of VSOP87 terms.
+static double sumTerms(const double *A, const double *B, const double *C, qsizetype count, double t) {
+    f64xN time = simd_set1(t);
+    f64xN sum = simd_set1(0.0);
+    for (qsizetype i = 0; i < count; i += SIMD_LANES) {
+        sum += simd_load(A + i) * simd_cos(simd_load(B + i) + simd_load(C + i) * time);
+    }
+    return simd_reduce_add(sum);
+}
+
+// Sum of A sin(i D + j l' + k l + m F) over a range of ELP2000 terms.
+static double sumMoonTerms(const double *A, const double *i_D, const double *j_l_sun, const double *k_l, const double *m_F,
+                           qsizetype count, double D, double l_sun, double l, double F) {
+    f64xN sum = simd_set1(0.0);
+    for (qsizetype i = 0; i < count; i += SIMD_LANES) {
+        f64xN argument = simd_load(i_D + i) * D + simd_load(j_l_sun + i) * l_sun + simd_load(k_l + i) * l + simd_load(m_F + i) * F;
+        sum += simd_load(A + i) * simd_sin(argument);
+    }
+    return simd_reduce_add(sum);
+}
+
+
+SeriesEphemeris::SeriesEphemeris() :
+    m_truncation(FullSeries),
+    m_light_time(true),
+    m_moon_longitude({0, {}}),
+    m_moon_latitude({0, {}})
+{
+}
+
+
+bool SeriesEphemeris::load(QString directory, const QList<CelestialBody> &bodies, SeriesTruncation truncation) {
+    static const struct { const char *name; const char *extension; } planet_files[] = {
+        {"mercury", "mer"}, {"venus", "ven"}, {"mars", "mar"}, {"jupiter", "jup"},
+        {"saturn", "sat"}, {"uranus", "ura"}, {"neptune", "nep"},
+    };
+
+    m_kinds.clear();
+    m_planet_index.clear();
+    m_planets.clear();
+    m_amplitude.clear();
+    m_phase.clear();
+    m_frequency.clear();
+    m_moon_amplitude.clear();
+    m_moon_D.clear();
+    m_moon_l_sun.clear();
+    m_moon_l.clear();
+    m_moon_F.clear();
+    m_truncation = truncation;
+
+    double threshold = truncationThreshold(truncation);
+    if (!loadPlanet(directory + "/VSOP87D.ear", threshold, &m_earth)) {
+        return false;
+    }
+
+    QList<BodyKind> kinds;
+    for (const CelestialBody &body : bodies) {
+        QString name = body.name.toLower();
+        if (name == "sun") {
+            kinds.append(SunBody);
+            m_planet_index.append(-1);
+            continue;
+        }
+        if (name == "moon") {
+            if (m_moon_amplitude.isEmpty() &&
+                (!loadMoon(directory + "/ELP1", threshold * ARCSECONDS_PER_RADIAN, &m_moon_longitude) ||
+                 !loadMoon(directory + "/ELP2", threshold * ARCSECONDS_PER_RADIAN, &m_moon_latitude))) {
+                return false;
+            }
+            kinds.append(MoonBody);
+            m_planet_index.append(-1);
+            continue;
+        }
+
+        QString extension;
+        for (const auto &planet : planet_files) {
+            if (name == planet.name) extension = planet.extension;
+        }
+        if (extension.isEmpty()) {
+            qWarning() << "VSOP87 has no series for" << body.name;
+            return false;
+        }
+
+        PlanetSeries series;
+        if (!loadPlanet(directory + "/VSOP87D." + extension, threshold, &series)) {
+            return false;
+        }
+        kinds.append(PlanetBody);
+        m_planet_index.append(m_planets.size());
+        m_planets.append(series);
+    }
+
+    m_kinds = kinds; // only set when everything loaded, since isLoaded() checks it
+    return true;
+}
+
+bool SeriesEphemeris::isLoaded() const {
+    return !m_kinds.isEmpty();
+}
+
+qsizetype SeriesEphemeris::bodyCount() const {
+    return m_kinds.size();
+}
+
+SeriesTruncation SeriesEphemeris::truncation() const {
+    return m_truncation;
+}
+
+qsizetype SeriesEphemeris::termCount(SeriesTruncation truncation) const {
+    qsizetype count = 0;
+    for (const PlanetSeries &series : m_planets) {
+        for (const QVarLengthArray<TermRange, 6> &powers : series.coordinates) {
+            for (const TermRange &range : powers) count += range.count[truncation];
+        }
+    }
+    for (const QVarLengthArray<TermRange, 6> &powers : m_earth.coordinates) {
+        for (const TermRange &range : powers) count += range.count[truncation];
+    }
+    return count + m_moon_longitude.count[truncation] + m_moon_latitude.count[truncation];
+}
+
+const char *SeriesEphemeris::truncationName(SeriesTruncation truncation) {
+    switch (truncation) {
+        case FullSeries:            return "full";
+        case FineSeries:            return "fine";
+        case ArcsecondSeries:       return "arcsecond";
+        case CoarseSeries:          return "coarse";
+        case SeriesTruncationCount: break;
+    }
+    return "";
+}
+
+void SeriesEphemeris::setLightTime(bool light_time) {
+    m_light_time = light_time;
+}
+
+
+// Finishes the range of terms from offset to the end of the columns, the first of which is the amplitude.
+// The terms are sorted by decreasing amplitude and padded with zero terms to fill whole registers, so that
+// the sums don't need a tail loop. A truncation sums the terms whose amplitude times scale is above its
+// threshold, rounded up to whole registers, which only adds terms too small to matter.
+static void finishRange(std::initializer_list<QList<double> *> columns, double scale, qsizetype offset, qsizetype *counts) {
+    QList<double> &amplitude = **columns.begin();
+    qsizetype count = amplitude.size() - offset;
+
+    QList<qsizetype> order(count);
+    for (qsizetype i = 0; i < count; i++) order[i] = offset + i;
+    std::stable_sort(order.begin(), order.end(), [&amplitude](qsizetype a, qsizetype b) {
+        return fabs(amplitude[a]) > fabs(amplitude[b]);
+    });
+    for (QList<double> *column : columns) {
+        QList<double> sorted(count);
+        for (qsizetype i = 0; i < count; i++) sorted[i] = (*column)[order[i]];
+        std::copy(sorted.cbegin(), sorted.cend(), column->begin() + offset);
+    }
+
+    qsizetype padded = (count + SIMD_LANES - 1) / SIMD_LANES * SIMD_LANES;
+    for (QList<double> *column : columns) column->resize(offset + padded, 0.0);
+
+    for (int truncation = 0; truncation < SeriesTruncationCount; truncation++) {
+        double threshold = truncationThreshold((SeriesTruncation)truncation);
+        qsizetype kept = 0;
+        while (kept < count && fabs(amplitude[offset + kept]) * scale >= threshold) kept++;
+        counts[truncation] = (kept + SIMD_LANES - 1) / SIMD_LANES * SIMD_LANES;
+    }
+}
+
+// The VSOP87 files have a header line for each coordinate and power of time, like
+//  VSOP87 VERSION D1    MERCURY   VARIABLE 1 (LBR)       *T**0   1583 TERMS    HIGH PRECISION
+// followed by one line per term, which ends with the amplitude A, phase B and frequency C.
+bool SeriesEphemeris::loadPlanet(QString path, double threshold, PlanetSeries *series) {
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly | QFile::Text)) {
+        qWarning() << "Could not find file " << path;
+        return false;
+    }
+
+    QTextStream in(&file);
+    TermRange *range = nullptr;
+    int power = 0;
+    while (!in.atEnd()) {
+        QString line = in.readLine();
+        if (line.contains("VSOP87")) {
+            if (range) finishRange({&m_amplitude, &m_phase, &m_frequency}, pow(SERIES_SPAN_MILLENNIA, power), range->offset, range->count);
+
+            qsizetype variable_at = line.indexOf("VARIABLE");
+            qsizetype power_at = line.indexOf("*T**");
+            int variable = variable_at < 0 ? 0 : line.mid(variable_at + 8, 2).trimmed().toInt();
+            power = power_at < 0 ? -1 : line.mid(power_at + 4, 1).toInt();
+            if (variable < 1 || variable > 3 || power < 0 || power > 5) {
+                qWarning() << "Unexpected VSOP87 header in" << path << ":" << line;
+                return false;
+            }
+
+            QVarLengthArray<TermRange, 6> &powers = series->coordinates[variable - 1];
+            while (powers.size() <= power) powers.append({m_amplitude.size(), {}});
+            range = &powers[power];
+            *range = {m_amplitude.size(), {}};
+            continue;
+        }
+
+        QStringList fields = line.split(' ', Qt::SkipEmptyParts);
+        if (!range || fields.size() < 3) continue;
+
+        double A = fields[fields.size() - 3].toDouble();
+        if (fabs(A) * pow(SERIES_SPAN_MILLENNIA, power) < threshold) continue;
+        m_amplitude.append(A);
+        m_phase.append(fields[fields.size() - 2].toDouble());
+        m_frequency.append(fields[fields.size() - 1].toDouble());
+    }
+    if (range) finishRange({&m_amplitude, &m_phase, &m_frequency}, pow(SERIES_SPAN_MILLENNIA, power), range->offset, range->count);
+
+    for (const QVarLengthArray<TermRange, 6> &powers : series->coordinates) {
+        if (powers.isEmpty()) {
+            qWarning() << "Missing VSOP87 coordinates in" << path;
+            return false;
+        }
+    }
+    return true;
+}
+
+// The ELP2000-82 main problem files (ELP1 longitude, ELP2 latitude) start with a title line, followed by
+// one line per term in the Fortran format (4i3,2x,f13.5,6(2x,f10.2)): the multipliers of D, l', l and F,
+// the amplitude in arcseconds, and derivatives for fitting the constants, which we don't need.
+bool SeriesEphemeris::loadMoon(QString path, double threshold, TermRange *range) {
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly | QFile::Text)) {
+        qWarning() << "Could not find file " << path;
+        return false;
+    }
+
+    *range = {m_moon_amplitude.size(), {}};
+    QTextStream in(&file);
+    while (!in.atEnd()) {
+        QString line = in.readLine();
+        if (line.length() < 14) continue;
+
+        int multipliers[4];
+        bool is_term = true;
+        for (int i = 0; i < 4; i++) {
+            bool ok;
+            multipliers[i] = line.mid(3 * i, 3).trimmed().toInt(&ok);
+            is_term = is_term && ok;
+        }
+        QStringList fields = line.mid(12).split(' ', Qt::SkipEmptyParts);
+        if (!is_term || fields.isEmpty()) continue; // the title line
+
+        double A = fields[0].toDouble();
+        if (fabs(A) < threshold) continue;
+        m_moon_amplitude.append(A);
+        m_moon_D.append(multipliers[0]);
+        m_moon_l_sun.append(multipliers[1]);
+        m_moon_l.append(multipliers[2]);
+        m_moon_F.append(multipliers[3]);
+    }
+    finishRange({&m_moon_amplitude, &m_moon_D, &m_moon_l_sun, &m_moon_l, &m_moon_F}, 1.0 / ARCSECONDS_PER_RADIAN,
+                range->offset, range->count);
+
+    if (range->count[FullSeries] == 0) {
+        qWarning() << "No ELP2000 terms in" << path;
+        return false;
+    }
+    return true;
+}
+
+
+// Heliocentric ecliptic coordinates in AU, for the mean ecliptic and equinox of date.
+void SeriesEphemeris::planetPosition(const PlanetSeries &series, SeriesTruncation truncation, double t, double *x, double *y, double *z) const {
+    double millennia = t / 365250.0;
+    double lbr[3];
+    for (int c = 0; c < 3; c++) {
+        const QVarLengthArray<TermRange, 6> &powers = series.coordinates[c];
+        double value = 0.0;
+        for (qsizetype p = powers.size() - 1; p >= 0; p--) {
+            const TermRange &range = powers[p];
+            value = value * millennia + sumTerms(m_amplitude.data() + range.offset, m_phase.data() + range.offset,
+                                                 m_frequency.data() + range.offset, range.count[truncation], millennia);
+        }
+        lbr[c] = value;
+    }
+
+    double cos_B = cos(lbr[1]);
+    *x = lbr[2] * cos_B * cos(lbr[0]);
+    *y = lbr[2] * cos_B * sin(lbr[0]);
+    *z = lbr[2] * sin(lbr[1]);
+}
+
+// Geocentric ecliptic direction of the moon, for the mean ecliptic and equinox of date. The mean arguments are
+// the ones of ELP2000-82, as given by Meeus (Astronomical Algorithms, chapter 47), in degrees.
+void SeriesEphemeris::moonPosition(SeriesTruncation truncation, double t, double *x, double *y, double *z) const {
+    double T  = t / 36525.0;
+    double T2 = T*T;
+    double T3 = T2*T;
+    double T4 = T3*T;
+
+    double L     = normalizedRadians(218.3164477 + 481267.88123421*T - 0.0015786*T2 + T3/538841.0 - T4/65194000.0);
+    double D     = normalizedRadians(297.8501921 + 445267.1114034*T - 0.0018819*T2 + T3/545868.0 - T4/113065000.0);
+    double l_sun = normalizedRadians(357.5291092 + 35999.0502909*T - 0.0001536*T2 + T3/24490000.0);
+    double l     = normalizedRadians(134.9633964 + 477198.8675055*T + 0.0087414*T2 + T3/69699.0 - T4/14712000.0);
+    double F     = normalizedRadians(93.2720950 + 483202.0175233*T - 0.0036539*T2 - T3/3526000.0 + T4/863310000.0);
+
+    double longitude = sumMoonTerms(m_moon_amplitude.data() + m_moon_longitude.offset, m_moon_D.data() + m_moon_longitude.offset,
+                                    m_moon_l_sun.data() + m_moon_longitude.offset, m_moon_l.data() + m_moon_longitude.offset,
+                                    m_moon_F.data() + m_moon_longitude.offset, m_moon_longitude.count[truncation], D, l_sun, l, F);
+    double latitude  = sumMoonTerms(m_moon_amplitude.data() + m_moon_latitude.offset, m_moon_D.data() + m_moon_latitude.offset,
+                                    m_moon_l_sun.data() + m_moon_latitude.offset, m_moon_l.data() + m_moon_latitude.offset,
+                                    m_moon_F.data() + m_moon_latitude.offset, m_moon_latitude.count[truncation], D, l_sun, l, F);
+
+    // The largest terms from the perturbations by Venus and Jupiter and the figure of the Earth, which are
+    // in other ELP2000 files. Amplitudes in millionths of a degree.
+    double A1 = normalizedRadians(119.75 + 131.849*T);
+    double A2 = normalizedRadians(53.09 + 479264.290*T);
+    double A3 = normalizedRadians(313.45 + 481266.484*T);
+    double extra_longitude = 3958*sin(A1) + 1962*sin(L - F) + 318*sin(A2);
+    double extra_latitude  = -2235*sin(L) + 382*sin(A3) + 175*sin(A1 - F) + 175*sin(A1 + F) + 127*sin(L - l) - 115*sin(L + l);
+
+    longitude = L + longitude / ARCSECONDS_PER_RADIAN + extra_longitude * 1E-6 * DEGREES_TO_RADIANS;
+    latitude  = latitude / ARCSECONDS_PER_RADIAN + extra_latitude * 1E-6 * DEGREES_TO_RADIANS;
+
+    double cos_latitude = cos(latitude);
+    *x = cos_latitude * cos(longitude);
+    *y = cos_latitude * sin(longitude);
+    *z = sin(latitude);
+}
+
+
+void SeriesEphemeris::evaluate(double t, dVector3D *positions, const bool *mask, SeriesTruncation truncation) const {
+    double earth_x, earth_y, earth_z;
+    planetPosition(m_earth, truncation, t, &earth_x, &earth_y, &earth_z);
+
+    // Mean obliquity of the ecliptic (IAU 1980).
+    double T = t / 36525.0;
+    double obliquity = (84381.448 - 46.8150*T - 0.00059*T*T + 0.001813*T*T*T) / ARCSECONDS_PER_RADIAN;
+    double sin_obliquity = sin(obliquity);
+    double cos_obliquity = cos(obliquity);
+
+    for (qsizetype b = 0; b < m_kinds.size(); b++) {
+        if (mask && !mask[b]) continue;
+
+        // geocentric, ecliptic
+        double xg, yg, zg;
+        if (m_kinds[b] == SunBody) {
+            xg = -earth_x;
+            yg = -earth_y;
+            zg = -earth_z;
+        }
+        else if (m_kinds[b] == MoonBody) {
+            moonPosition(truncation, m_light_time ? t - MOON_LIGHT_TIME_DAYS : t, &xg, &yg, &zg);
+        }
+        else {
+            // We see the planet where it was when the light left it. One iteration is plenty, the light time
+            // changes by less than a millisecond while the planet moves.
+            const PlanetSeries &series = m_planets[m_planet_index[b]];
+            double x, y, z;
+            planetPosition(series, truncation, t, &x, &y, &z);
+            if (m_light_time) {
+                double distance = sqrt((x - earth_x)*(x - earth_x) + (y - earth_y)*(y - earth_y) + (z - earth_z)*(z - earth_z));
+                planetPosition(series, truncation, t - LIGHT_DAYS_PER_AU * distance, &x, &y, &z);
+            }
+            xg = x - earth_x;
+            yg = y - earth_y;
+            zg = z - earth_z;
+        }
+
+        // geocentric, equatorial
+        double xe = xg;
+        double ye = yg * cos_obliquity - zg * sin_obliquity;
+        double ze = yg * sin_obliquity + zg * cos_obliquity;
+
+        double inv_len = 1.0 / sqrt(xe*xe + ye*ye + ze*ze);
+        positions[b] = {xe * inv_len, ye * inv_len, ze * inv_len};
+    }
+}
+
+double SeriesEphemeris::terrestrialDays(QDateTime datetime) {
+    QDateTime utc = datetime.toUTC();
+    QDate date = utc.date();
+    double year = date.year() + (date.dayOfYear() - 0.5) / date.daysInYear();
+    double julian_day = 2440587.5 + utc.toMSecsSinceEpoch() / 86400000.0;
+    return julian_day - 2451545.0 + deltaT(year) / 86400.0;
+}
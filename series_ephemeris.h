@@ -0,0 +1,110 @@
+#ifndef SERIESEPHEMERIS_H
+#define SERIESEPHEMERIS_H
+
+#include <QList>
+#include <QString>
+#include <QDateTime>
+#include <QVarLengthArray>
+#include "datastructures.h"
+#include "kepler.h"
+
+// How many terms of the series are summed. Terms whose amplitude over the supported date range is below the
+// threshold are left out. The threshold is in radians for angles and AU for distances. The error of a
+// truncated series is a small multiple of the threshold, since the dropped terms mostly don't add up.
+enum SeriesTruncation {
+    FullSeries,      // every term in the files
+    FineSeries,      // 1E-9 (0.0002"), indistinguishable from the full series
+    ArcsecondSeries, // 1E-7 (0.02"), within an arcsecond with a fraction of the terms
+    CoarseSeries,    // 1E-6 (0.2"), a few arcseconds
+    SeriesTruncationCount,
+};
+
+/*
+ * High precision positions from the VSOP87 theory of the planets (version D: heliocentric ecliptic spherical
+ * coordinates, equinox of date) and the main problem of the ELP2000-82 lunar theory. The coefficients are read
+ * from the original text files, VSOP87D.mer ... VSOP87D.nep and ELP1, ELP2, in a local directory.
+ *
+ * The results are astrometric: planets are corrected for light time (unless setLightTime turns it off), but there
+ * is no aberration or nutation, so they line up with the mean catalog places of the stars. They are in the same
+ * frame and units as calc::calculatePositions (unit vectors, equatorial, equinox of date), which is accurate to
+ * about an arcminute. With the full series this is accurate to about an arcsecond for the planets; the moon is
+ * limited to a few arcseconds by the perturbation series of ELP2000 that are not read (only their largest terms
+ * are added).
+ *
+ * Each series is summed SIMD_LANES terms at a time. Evaluating all bodies with the full series takes
+ * a few hundred microseconds, so WorkerThread can use it every frame.
+ */
+class SeriesEphemeris {
+public:
+    SeriesEphemeris();
+
+    // Reads the series for the bodies (matched by name) from directory. Bodies that the theories don't cover
+    // make this fail, since the positions are computed for the whole list at once. Terms below the threshold
+    // of truncation aren't kept, so no coarser truncation than this can be evaluated.
+    bool load(QString directory, const QList<CelestialBody> &bodies, SeriesTruncation truncation);
+    bool isLoaded() const;
+    qsizetype bodyCount() const;
+    SeriesTruncation truncation() const;
+    // Terms that evaluate sums at a truncation, all of the loaded ones for the truncation of load and finer.
+    qsizetype termCount(SeriesTruncation truncation = FullSeries) const;
+    // "full", "fine", "arcsecond" or "coarse".
+    static const char *truncationName(SeriesTruncation truncation);
+    // On by default. Off gives geometric positions, the convention of other theories to compare against.
+    void setLightTime(bool light_time);
+
+    // Positions of all bodies at t days since J2000.0 in Terrestrial Time, in the order they were loaded.
+    // With a mask, only the bodies whose entry is true are computed and written. Any truncation can be
+    // asked for, but it is never finer than the one the series were loaded with.
+    void evaluate(double t, dVector3D *positions, const bool *mask = nullptr, SeriesTruncation truncation = FullSeries) const;
+
+    // Days since J2000.0 in Terrestrial Time. Includes the difference TT - UT, which is more than a minute
+    // and would put the moon half a minute of arc off.
+    static double terrestrialDays(QDateTime datetime);
+
+private:
+    enum BodyKind {
+        SunBody,
+        MoonBody,
+        PlanetBody,
+    };
+
+    // A run of terms that multiply the same power of time, in m_amplitude etc. They are sorted by decreasing
+    // amplitude, so that every truncation sums the first count[truncation] of them, a multiple of SIMD_LANES.
+    struct TermRange {
+        qsizetype offset;
+        qsizetype count[SeriesTruncationCount];
+    };
+
+    // The powers of time 0..5 for L, B and R of one planet.
+    struct PlanetSeries {
+        QVarLengthArray<TermRange, 6> coordinates[3];
+    };
+
+    bool loadPlanet(QString path, double threshold, PlanetSeries *series);
+    bool loadMoon(QString path, double threshold, TermRange *range);
+    void planetPosition(const PlanetSeries &series, SeriesTruncation truncation, double t, double *x, double *y, double *z) const;
+    void moonPosition(SeriesTruncation truncation, double t, double *x, double *y, double *z) const;
+
+    SeriesTruncation m_truncation;
+    bool m_light_time;
+    QList<BodyKind> m_kinds;
+    QList<int> m_planet_index; // into m_planets for PlanetBody entries
+    QList<PlanetSeries> m_planets;
+    PlanetSeries m_earth;
+    TermRange m_moon_longitude;
+    TermRange m_moon_latitude;
+
+    // VSOP87 terms A cos(B + C t)
+    QList<double> m_amplitude;
+    QList<double> m_phase;
+    QList<double> m_frequency;
+
+    // ELP2000 terms A sin(i D + j l' + k l + m F), stored as doubles so that they load straight into registers.
+    QList<double> m_moon_amplitude;
+    QList<double> m_moon_D;
+    QList<double> m_moon_l_sun;
+    QList<double> m_moon_l;
+    QList<double> m_moon_F;
+};
+
+#endif // SERIESEPHEMERIS_H
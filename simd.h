@@ -0,0 +1,306 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "types.h"
+#include <math.h>
+#include <string.h> // for memcpy
+
+/*
+   A thin wrapper around the widest double precision SIMD register available at compile time.
+   AVX gives 4 lanes, SSE2 (always present on x86-64) gives 2, and everything else falls back to
+   a single scalar lane so the same code compiles everywhere.
+
+   Comparisons return masks with all bits set in the lanes where they hold, like the hardware
+   instructions do. Use simd_select to blend with a mask and simd_all/simd_any to branch on one.
+
+   The trig functions are branch-free ports of the fdlibm/Cephes polynomials, accurate to a couple
+   of ulps for the argument ranges the ephemeris code uses (|x| < 1e6).
+
+   Everything is in a namespace named after the instruction set, so that a translation unit
+   compiled with other flags (see position_kernel_avx2.cpp) gets its own copies of the inline
+   functions instead of sharing, or replacing, the ones of the rest of the program.
+*/
+
+#if defined(__AVX__)
+    #include <immintrin.h>
+    #define SIMD_LANES 4
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define SIMD_LANES 2
+#else
+    #define SIMD_LANES 1
+#endif
+
+#if SIMD_LANES == 4
+    #define SIMD_NAMESPACE simd_avx
+#elif SIMD_LANES == 2
+    #define SIMD_NAMESPACE simd_sse2
+#else
+    #define SIMD_NAMESPACE simd_scalar
+#endif
+
+namespace SIMD_NAMESPACE {
+
+struct f64xN {
+#if SIMD_LANES == 4
+    __m256d v;
+#elif SIMD_LANES == 2
+    __m128d v;
+#else
+    f64 v;
+#endif
+};
+
+#if SIMD_LANES == 4
+
+inline f64xN simd_set1(f64 a)                   { return {_mm256_set1_pd(a)}; }
+inline f64xN simd_load(const f64 *p)            { return {_mm256_loadu_pd(p)}; }
+inline void  simd_store(f64 *p, f64xN a)        { _mm256_storeu_pd(p, a.v); }
+inline f64xN operator+(f64xN a, f64xN b)        { return {_mm256_add_pd(a.v, b.v)}; }
+inline f64xN operator-(f64xN a, f64xN b)        { return {_mm256_sub_pd(a.v, b.v)}; }
+inline f64xN operator*(f64xN a, f64xN b)        { return {_mm256_mul_pd(a.v, b.v)}; }
+inline f64xN operator/(f64xN a, f64xN b)        { return {_mm256_div_pd(a.v, b.v)}; }
+inline f64xN simd_sqrt(f64xN a)                 { return {_mm256_sqrt_pd(a.v)}; }
+inline f64xN simd_min(f64xN a, f64xN b)         { return {_mm256_min_pd(a.v, b.v)}; }
+inline f64xN simd_max(f64xN a, f64xN b)         { return {_mm256_max_pd(a.v, b.v)}; }
+inline f64xN simd_and(f64xN a, f64xN b)         { return {_mm256_and_pd(a.v, b.v)}; }
+inline f64xN simd_or(f64xN a, f64xN b)          { return {_mm256_or_pd(a.v, b.v)}; }
+inline f64xN simd_andnot(f64xN a, f64xN b)      { return {_mm256_andnot_pd(a.v, b.v)}; } // ~a & b
+inline f64xN simd_lt(f64xN a, f64xN b)          { return {_mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ)}; }
+inline f64xN simd_le(f64xN a, f64xN b)          { return {_mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ)}; }
+inline f64xN simd_eq(f64xN a, f64xN b)          { return {_mm256_cmp_pd(a.v, b.v, _CMP_EQ_OQ)}; }
+inline f64xN simd_select(f64xN mask, f64xN a, f64xN b) { return {_mm256_blendv_pd(b.v, a.v, mask.v)}; }
+inline int   simd_movemask(f64xN mask)          { return _mm256_movemask_pd(mask.v); }
+inline f64xN simd_round(f64xN a)                { return {_mm256_round_pd(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)}; }
+inline f64xN simd_floor(f64xN a)                { return {_mm256_floor_pd(a.v)}; }
+
+#elif SIMD_LANES == 2
+
+inline f64xN simd_set1(f64 a)                   { return {_mm_set1_pd(a)}; }
+inline f64xN simd_load(const f64 *p)            { return {_mm_loadu_pd(p)}; }
+inline void  simd_store(f64 *p, f64xN a)        { _mm_storeu_pd(p, a.v); }
+inline f64xN operator+(f64xN a, f64xN b)        { return {_mm_add_pd(a.v, b.v)}; }
+inline f64xN operator-(f64xN a, f64xN b)        { return {_mm_sub_pd(a.v, b.v)}; }
+inline f64xN operator*(f64xN a, f64xN b)        { return {_mm_mul_pd(a.v, b.v)}; }
+inline f64xN operator/(f64xN a, f64xN b)        { return {_mm_div_pd(a.v, b.v)}; }
+inline f64xN simd_sqrt(f64xN a)                 { return {_mm_sqrt_pd(a.v)}; }
+inline f64xN simd_min(f64xN a, f64xN b)         { return {_mm_min_pd(a.v, b.v)}; }
+inline f64xN simd_max(f64xN a, f64xN b)         { return {_mm_max_pd(a.v, b.v)}; }
+inline f64xN simd_and(f64xN a, f64xN b)         { return {_mm_and_pd(a.v, b.v)}; }
+inline f64xN simd_or(f64xN a, f64xN b)          { return {_mm_or_pd(a.v, b.v)}; }
+inline f64xN simd_andnot(f64xN a, f64xN b)      { return {_mm_andnot_pd(a.v, b.v)}; } // ~a & b
+inline f64xN simd_lt(f64xN a, f64xN b)          { return {_mm_cmplt_pd(a.v, b.v)}; }
+inline f64xN simd_le(f64xN a, f64xN b)          { return {_mm_cmple_pd(a.v, b.v)}; }
+inline f64xN simd_eq(f64xN a, f64xN b)          { return {_mm_cmpeq_pd(a.v, b.v)}; }
+inline f64xN simd_select(f64xN mask, f64xN a, f64xN b) { return {_mm_or_pd(_mm_and_pd(mask.v, a.v), _mm_andnot_pd(mask.v, b.v))}; }
+inline int   simd_movemask(f64xN mask)          { return _mm_movemask_pd(mask.v); }
+
+// SSE2 has no rounding instruction. Adding and subtracting 1.5 * 2^52 pushes the fraction bits out
+// of the mantissa, which rounds to nearest for |a| < 2^51.
+inline f64xN simd_round(f64xN a) {
+    __m128d magic = _mm_set1_pd(6755399441055744.0);
+    return {_mm_sub_pd(_mm_add_pd(a.v, magic), magic)};
+}
+
+inline f64xN simd_floor(f64xN a) {
+    f64xN r = simd_round(a);
+    return r - simd_and(simd_lt(a, r), simd_set1(1.0));
+}
+
+#else
+
+inline f64 simd_mask_bits(bool b) {
+    u64 bits = b ? ~(u64)0 : 0;
+    f64 result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+inline u64 simd_bits(f64 a) {
+    u64 bits;
+    memcpy(&bits, &a, sizeof(bits));
+    return bits;
+}
+
+inline f64 simd_from_bits(u64 bits) {
+    f64 result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+inline f64xN simd_set1(f64 a)                   { return {a}; }
+inline f64xN simd_load(const f64 *p)            { return {*p}; }
+inline void  simd_store(f64 *p, f64xN a)        { *p = a.v; }
+inline f64xN operator+(f64xN a, f64xN b)        { return {a.v + b.v}; }
+inline f64xN operator-(f64xN a, f64xN b)        { return {a.v - b.v}; }
+inline f64xN operator*(f64xN a, f64xN b)        { return {a.v * b.v}; }
+inline f64xN operator/(f64xN a, f64xN b)        { return {a.v / b.v}; }
+inline f64xN simd_sqrt(f64xN a)                 { return {sqrt(a.v)}; }
+inline f64xN simd_min(f64xN a, f64xN b)         { return {a.v < b.v ? a.v : b.v}; }
+inline f64xN simd_max(f64xN a, f64xN b)         { return {a.v > b.v ? a.v : b.v}; }
+inline f64xN simd_and(f64xN a, f64xN b)         { return {simd_from_bits(simd_bits(a.v) & simd_bits(b.v))}; }
+inline f64xN simd_or(f64xN a, f64xN b)          { return {simd_from_bits(simd_bits(a.v) | simd_bits(b.v))}; }
+inline f64xN simd_andnot(f64xN a, f64xN b)      { return {simd_from_bits(~simd_bits(a.v) & simd_bits(b.v))}; }
+inline f64xN simd_lt(f64xN a, f64xN b)          { return {simd_mask_bits(a.v < b.v)}; }
+inline f64xN simd_le(f64xN a, f64xN b)          { return {simd_mask_bits(a.v <= b.v)}; }
+inline f64xN simd_eq(f64xN a, f64xN b)          { return {simd_mask_bits(a.v == b.v)}; }
+inline f64xN simd_select(f64xN mask, f64xN a, f64xN b) { return simd_bits(mask.v) ? a : b; }
+inline int   simd_movemask(f64xN mask)          { return simd_bits(mask.v) >> 63; }
+inline f64xN simd_round(f64xN a)                { return {nearbyint(a.v)}; }
+inline f64xN simd_floor(f64xN a)                { return {floor(a.v)}; }
+
+#endif
+
+// simd_movemask gives one bit per lane, with lane 0 in the lowest bit.
+inline bool simd_any(f64xN mask) { return simd_movemask(mask) != 0; }
+inline bool simd_all(f64xN mask) { return simd_movemask(mask) == (1 << SIMD_LANES) - 1; }
+
+inline int simd_count(f64xN mask) {
+    int bits = simd_movemask(mask);
+    int count = 0;
+    for (; bits; bits >>= 1) count += bits & 1;
+    return count;
+}
+
+// Mask of the first n lanes, for partially filled registers at the end of an array.
+inline f64xN simd_first_lanes(int n) {
+    static const f64 lane_index[4] = {0.0, 1.0, 2.0, 3.0};
+    return simd_lt(simd_load(lane_index), simd_set1((f64)n));
+}
+
+// Sum of all lanes, for reductions over arrays that were accumulated lane by lane.
+inline f64 simd_reduce_add(f64xN a) {
+    f64 lanes[SIMD_LANES];
+    simd_store(lanes, a);
+    f64 sum = 0.0;
+    for (int lane = 0; lane < SIMD_LANES; lane++) sum += lanes[lane];
+    return sum;
+}
+
+inline f64xN operator+(f64xN a, f64 b) { return a + simd_set1(b); }
+inline f64xN operator+(f64 a, f64xN b) { return simd_set1(a) + b; }
+inline f64xN operator-(f64xN a, f64 b) { return a - simd_set1(b); }
+inline f64xN operator-(f64 a, f64xN b) { return simd_set1(a) - b; }
+inline f64xN operator*(f64xN a, f64 b) { return a * simd_set1(b); }
+inline f64xN operator*(f64 a, f64xN b) { return simd_set1(a) * b; }
+inline f64xN operator/(f64xN a, f64 b) { return a / simd_set1(b); }
+inline f64xN operator/(f64 a, f64xN b) { return simd_set1(a) / b; }
+inline f64xN operator-(f64xN a)        { return simd_set1(0.0) - a; }
+
+inline f64xN& operator+=(f64xN &a, f64xN b) { a = a + b; return a; }
+inline f64xN& operator-=(f64xN &a, f64xN b) { a = a - b; return a; }
+inline f64xN& operator*=(f64xN &a, f64xN b) { a = a * b; return a; }
+inline f64xN& operator+=(f64xN &a, f64 b)   { a = a + b; return a; }
+inline f64xN& operator-=(f64xN &a, f64 b)   { a = a - b; return a; }
+inline f64xN& operator*=(f64xN &a, f64 b)   { a = a * b; return a; }
+
+inline f64xN simd_abs(f64xN a) {
+    return simd_andnot(simd_set1(-0.0), a); // clear the sign bit
+}
+
+// Reduces x to r in [-pi/4, pi/4] with x = r + q * pi/2, using a three part split of pi/2 so
+// that the subtraction stays exact (Cody-Waite). Returns q modulo 4 in *quadrant.
+inline f64xN simd_reduce_half_pi(f64xN x, f64xN *quadrant) {
+    const f64 two_over_pi = 6.36619772367581382433e-01;
+    const f64 pio2_1 = 1.57079632673412561417e+00;
+    const f64 pio2_2 = 6.07710050630396597660e-11;
+    const f64 pio2_3 = 2.02226624871116645580e-21;
+
+    f64xN q = simd_round(x * two_over_pi);
+    f64xN r = ((x - q * pio2_1) - q * pio2_2) - q * pio2_3;
+    *quadrant = q - 4.0 * simd_floor(q * 0.25);
+    return r;
+}
+
+inline f64xN simd_sin_kernel(f64xN r) {
+    f64xN z = r * r;
+    f64xN p = z * (8.33333333332248946124e-03 + z * (-1.98412698298579493134e-04 + z * (2.75573137070700676789e-06 +
+              z * (-2.50507602534068634195e-08 + z * 1.58969099521155010221e-10))));
+    return r + r * z * (-1.66666666666666324348e-01 + p);
+}
+
+inline f64xN simd_cos_kernel(f64xN r) {
+    f64xN z = r * r;
+    f64xN p = 4.16666666666666019037e-02 + z * (-1.38888888888741095749e-03 + z * (2.48015872894767294178e-05 +
+              z * (-2.75573143513906633035e-07 + z * (2.08757232129817482790e-09 + z * -1.13596475577881948265e-11))));
+    return 1.0 - 0.5 * z + z * z * p;
+}
+
+inline void simd_sincos(f64xN x, f64xN *sin_out, f64xN *cos_out) {
+    f64xN quadrant;
+    f64xN r = simd_reduce_half_pi(x, &quadrant);
+    f64xN s = simd_sin_kernel(r);
+    f64xN c = simd_cos_kernel(r);
+
+    // quadrant 0: ( s,  c)  1: ( c, -s)  2: (-s, -c)  3: (-c,  s)
+    f64xN swap     = simd_or(simd_eq(quadrant, simd_set1(1.0)), simd_eq(quadrant, simd_set1(3.0)));
+    f64xN sin_neg  = simd_le(simd_set1(2.0), quadrant);
+    f64xN cos_neg  = simd_or(simd_eq(quadrant, simd_set1(1.0)), simd_eq(quadrant, simd_set1(2.0)));
+
+    f64xN sin_val = simd_select(swap, c, s);
+    f64xN cos_val = simd_select(swap, s, c);
+    *sin_out = simd_select(sin_neg, -sin_val, sin_val);
+    *cos_out = simd_select(cos_neg, -cos_val, cos_val);
+}
+
+inline f64xN simd_sin(f64xN x) {
+    f64xN s, c;
+    simd_sincos(x, &s, &c);
+    return s;
+}
+
+inline f64xN simd_cos(f64xN x) {
+    f64xN s, c;
+    simd_sincos(x, &s, &c);
+    return c;
+}
+
+// Arctangent for x >= 0 (Cephes atan.c), with the range reduction done by selects instead of branches.
+inline f64xN simd_atan_positive(f64xN x) {
+    const f64 tan_3pi_8   = 2.41421356237309504880;
+    const f64 more_bits   = 6.123233995736765886130e-17;
+
+    f64xN big    = simd_lt(simd_set1(tan_3pi_8), x);
+    f64xN medium = simd_andnot(big, simd_lt(simd_set1(0.66), x));
+
+    f64xN offset = simd_select(big, simd_set1(1.57079632679489661923), simd_select(medium, simd_set1(0.78539816339744830962), simd_set1(0.0)));
+    f64xN extra  = simd_select(big, simd_set1(more_bits), simd_select(medium, simd_set1(0.5 * more_bits), simd_set1(0.0)));
+    f64xN t      = simd_select(big, -1.0 / x, simd_select(medium, (x - 1.0) / (x + 1.0), x));
+
+    f64xN z = t * t;
+    f64xN p = (((-8.750608600031904122785e-01 * z - 1.615753718733365076637e+01) * z - 7.500855792314704667340e+01) * z
+               - 1.228866684490136173410e+02) * z - 6.485021904942025371773e+01;
+    f64xN q = ((((z + 2.485846490142306297962e+01) * z + 1.650270098316988542046e+02) * z + 4.328810604912902668951e+02) * z
+               + 4.853903996359136964868e+02) * z + 1.945506571482613964425e+02;
+
+    return offset + (t + t * z * p / q + extra);
+}
+
+inline f64xN simd_atan2(f64xN y, f64xN x) {
+    f64xN ax = simd_abs(x);
+    f64xN ay = simd_abs(y);
+
+    // |y|/|x| is +inf for x == 0, which atan maps to pi/2 as it should. 0/0 is the only NaN case.
+    f64xN angle = simd_atan_positive(ay / ax);
+    f64xN both_zero = simd_and(simd_eq(ax, simd_set1(0.0)), simd_eq(ay, simd_set1(0.0)));
+    angle = simd_select(both_zero, simd_set1(0.0), angle);
+
+    angle = simd_select(simd_lt(x, simd_set1(0.0)), 3.14159265358979323846 - angle, angle);
+    angle = simd_select(simd_lt(y, simd_set1(0.0)), -angle, angle);
+    return angle;
+}
+
+// Overloads with the math.h names, so that code templated on the number type can be instantiated
+// with either f64 or f64xN.
+inline f64xN sin(f64xN x)             { return simd_sin(x); }
+inline f64xN cos(f64xN x)             { return simd_cos(x); }
+inline f64xN atan2(f64xN y, f64xN x)  { return simd_atan2(y, x); }
+inline f64xN sqrt(f64xN x)            { return simd_sqrt(x); }
+inline f64xN fabs(f64xN x)            { return simd_abs(x); }
+inline f64xN floor(f64xN x)           { return simd_floor(x); }
+
+} // namespace SIMD_NAMESPACE
+
+using namespace SIMD_NAMESPACE;
+
+#endif // SIMD_H
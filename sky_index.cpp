@@ -0,0 +1,146 @@
+#include "sky_index.h"
+#include "star_tiles.h"
+#include <QVarLengthArray>
+#include <QtMath>
+#include <algorithm>
+
+#define SKY_INDEX_ORDER 10    // HEALPix order of the finest buckets, about 3.4 arcminutes
+#define SKY_INDEX_LEAF_SIZE 8 // Nodes with this many points aren't split further
+
+// From the chord rather than acos of the dot product, which in float can't resolve angles below about an arcminute.
+static float angleBetween(QVector3D a, QVector3D b) {
+    return 2.0f * asinf(qMin(1.0f, (a - b).length() * 0.5f));
+}
+
+SkyIndex::SkyIndex() {
+}
+
+void SkyIndex::clear() {
+    m_x.clear();
+    m_y.clear();
+    m_z.clear();
+    m_indices.clear();
+    m_nodes.clear();
+}
+
+bool SkyIndex::isEmpty() const {
+    return m_nodes.isEmpty();
+}
+
+qsizetype SkyIndex::memoryUsage() const {
+    return m_x.size() * (3 * sizeof(f32) + sizeof(u32)) + m_nodes.size() * sizeof(Node);
+}
+
+
+void SkyIndex::build(const f32 *x, const f32 *y, const f32 *z, qsizetype count) {
+    clear();
+    if (count <= 0) return;
+
+    QList<u32> pixels(count);
+    QList<u32> order(count);
+    for (qsizetype i = 0; i < count; i++) {
+        pixels[i] = (u32)StarTileCatalog::tileIndex(SKY_INDEX_ORDER, QVector3D(x[i], y[i], z[i]));
+        order[i] = (u32)i;
+    }
+    std::sort(order.begin(), order.end(), [&](u32 a, u32 b) {
+        return pixels[a] < pixels[b];
+    });
+
+    m_x.resize(count);
+    m_y.resize(count);
+    m_z.resize(count);
+    m_indices = order;
+    QList<u32> sorted_pixels(count);
+    for (qsizetype i = 0; i < count; i++) {
+        m_x[i] = x[order[i]];
+        m_y[i] = y[order[i]];
+        m_z[i] = z[order[i]];
+        sorted_pixels[i] = pixels[order[i]];
+    }
+
+    // The root stands for the whole sphere, its children are the twelve base pixels that have points.
+    m_nodes.reserve(count / 2 + 16);
+    m_nodes.append(Node());
+    buildNode(0, -1, 0, (u32)count, sorted_pixels);
+}
+
+// Fills in the node at index for points [begin, end), which all lie in one pixel of the given order.
+void SkyIndex::buildNode(u32 index, int order, u32 begin, u32 end, const QList<u32> &pixels) {
+    QVector3D sum;
+    for (u32 i = begin; i < end; i++) sum += QVector3D(m_x[i], m_y[i], m_z[i]);
+    QVector3D center = sum.length() > 1E-6f ? sum.normalized() : QVector3D(m_x[begin], m_y[begin], m_z[begin]);
+    float radius = 0.0f;
+    for (u32 i = begin; i < end; i++) {
+        radius = qMax(radius, angleBetween(center, QVector3D(m_x[i], m_y[i], m_z[i])));
+    }
+
+    Node node = {};
+    node.center[0] = center.x();
+    node.center[1] = center.y();
+    node.center[2] = center.z();
+    node.radius    = radius + 1E-5f;
+    node.begin     = begin;
+    node.end       = end;
+    m_nodes[index] = node;
+    if (end - begin <= SKY_INDEX_LEAF_SIZE || order == SKY_INDEX_ORDER) return;
+
+    // The children are the runs of points that share a pixel one order finer. They get consecutive slots
+    // at the end of the list, and their own children go after those.
+    int shift = 2 * (SKY_INDEX_ORDER - (order + 1));
+    QVarLengthArray<u32, 13> bounds;
+    bounds.append(begin);
+    for (u32 i = begin + 1; i < end; i++) {
+        if ((pixels[i] >> shift) != (pixels[i - 1] >> shift)) bounds.append(i);
+    }
+    bounds.append(end);
+
+    u32 child_count = (u32)bounds.size() - 1;
+    u32 first_child = (u32)m_nodes.size();
+    m_nodes[index].first_child = first_child;
+    m_nodes[index].child_count = child_count;
+    m_nodes.resize(m_nodes.size() + child_count);
+    for (u32 c = 0; c < child_count; c++) {
+        buildNode(first_child + c, order + 1, bounds[c], bounds[c + 1], pixels);
+    }
+}
+
+
+qsizetype SkyIndex::nearest(QVector3D direction, float max_angle, float *angle) const {
+    if (isEmpty()) return -1;
+
+    float best_angle = max_angle;
+    float best_chord = 2.0f * sinf(qMin(max_angle, (float)M_PI) * 0.5f);
+    float best_chord_squared = best_chord * best_chord;
+    qsizetype best = -1;
+
+    QVarLengthArray<u32, 64> stack;
+    stack.append(0);
+    while (!stack.isEmpty()) {
+        const Node &node = m_nodes[stack.back()];
+        stack.removeLast();
+
+        QVector3D center(node.center[0], node.center[1], node.center[2]);
+        if (angleBetween(direction, center) - node.radius > best_angle) continue;
+
+        if (node.child_count == 0) {
+            for (u32 i = node.begin; i < node.end; i++) {
+                float dx = direction.x() - m_x[i];
+                float dy = direction.y() - m_y[i];
+                float dz = direction.z() - m_z[i];
+                float chord_squared = dx * dx + dy * dy + dz * dz;
+                if (chord_squared < best_chord_squared) {
+                    best_chord_squared = chord_squared;
+                    best_angle = 2.0f * asinf(qMin(1.0f, sqrtf(chord_squared) * 0.5f));
+                    best = i;
+                }
+            }
+        }
+        else {
+            for (u32 c = 0; c < node.child_count; c++) stack.append(node.first_child + c);
+        }
+    }
+
+    if (best < 0) return -1;
+    if (angle) *angle = best_angle;
+    return m_indices[best];
+}
@@ -0,0 +1,48 @@
+#ifndef SKYINDEX_H
+#define SKYINDEX_H
+
+#include <QList>
+#include <QVector3D>
+#include "types.h"
+
+/*
+ * Directions on the sky bucketed for cone queries. The points are sorted along the HEALPix nested numbering,
+ * so every pixel at every order is a contiguous range of them, and the non-empty pixels form a tree with
+ * up to four children per node. Each node stores the cone that bounds its points, and a query only descends
+ * into nodes whose cone comes closer than the best match so far.
+ *
+ * The index keeps its own copy of the directions, the columns it was built from may go away.
+ */
+class SkyIndex {
+public:
+    SkyIndex();
+
+    void build(const f32 *x, const f32 *y, const f32 *z, qsizetype count);
+    void clear();
+    bool isEmpty() const;
+    qsizetype memoryUsage() const;
+
+    // Index (into the columns given to build) of the point nearest to direction within max_angle radians,
+    // or -1. direction has to be normalized.
+    qsizetype nearest(QVector3D direction, float max_angle, float *angle = nullptr) const;
+
+private:
+    struct Node {
+        f32 center[3];
+        f32 radius; // radians
+        u32 begin;  // range of points
+        u32 end;
+        u32 first_child;
+        u32 child_count; // 0 for leaves
+    };
+
+    void buildNode(u32 index, int order, u32 begin, u32 end, const QList<u32> &pixels);
+
+    QList<f32> m_x;
+    QList<f32> m_y;
+    QList<f32> m_z;
+    QList<u32> m_indices; // of the points in the columns given to build
+    QList<Node> m_nodes; // the root first
+};
+
+#endif // SKYINDEX_H
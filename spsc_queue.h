@@ -0,0 +1,43 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <QAtomicInteger>
+#include "types.h"
+
+/*
+ * A fixed size ring of values from one producer thread to one consumer thread, without locks or allocation.
+ * The producer only writes the tail and the consumer only writes the head, each published with release
+ * ordering after the slot it covers, so either side sees complete values. Capacity has to be a power of two.
+ */
+template <typename T, u32 Capacity>
+class SpscQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "the capacity of SpscQueue has to be a power of two");
+
+public:
+    SpscQueue() : m_head(0), m_tail(0) {}
+
+    // Producer side. False if the queue is full, the value isn't added then.
+    bool push(const T &value) {
+        u32 tail = m_tail.loadRelaxed();
+        if (tail - m_head.loadAcquire() == Capacity) return false;
+        m_slots[tail & (Capacity - 1)] = value;
+        m_tail.storeRelease(tail + 1);
+        return true;
+    }
+
+    // Consumer side. False if the queue is empty.
+    bool pop(T *value) {
+        u32 head = m_head.loadRelaxed();
+        if (head == m_tail.loadAcquire()) return false;
+        *value = m_slots[head & (Capacity - 1)];
+        m_head.storeRelease(head + 1);
+        return true;
+    }
+
+private:
+    T m_slots[Capacity];
+    QAtomicInteger<u32> m_head; // next to pop, the counters wrap around
+    QAtomicInteger<u32> m_tail; // next to push
+};
+
+#endif // SPSCQUEUE_H
@@ -1,7 +1,15 @@
 void MAIN() {
     float scale = INSTANCE_DATA.w;
 
-    mat4 modelview_matrix_billboard = VIEW_MATRIX * INSTANCE_MODEL_MATRIX;
+    // Apparent place for the date: the J2000 direction moved by the proper motion (in INSTANCE_COLOR, radians
+    // per year) and rotated by the precession since J2000.
+    vec3 direction = normalize(INSTANCE_DATA.xyz + INSTANCE_COLOR.xyz * epoch);
+    vec3 apparent = mat3(precession) * direction;
+
+    mat4 model_matrix = INSTANCE_MODEL_MATRIX;
+    model_matrix[3].xyz = apparent * length(INSTANCE_MODEL_MATRIX[3].xyz);
+
+    mat4 modelview_matrix_billboard = VIEW_MATRIX * model_matrix;
     modelview_matrix_billboard[0][0] = scale;
     modelview_matrix_billboard[0][1] = 0;
     modelview_matrix_billboard[0][2] = 0;
@@ -1,33 +1,292 @@
 #include "starInstanceTable.h"
 #include <QFile>
+#include <QtMath>
+#include <algorithm>
+#include "calculate_positions.h"
+#include "trace.h"
+#include "metrics.h"
+
+#define STAR_REGION_ORDER 2 // HEALPix order of the regions BSC5 is culled by: 192 regions of about 15 degrees
+#define STAR_CULL_MARGIN_DEGREES 1.0 // so that the quads of stars right at the edge aren't cut off
+#define STAR_LIMITING_MAGNITUDE 6.5  // at the reference field of view, about what the eye sees on a dark night
+#define STAR_REFERENCE_FOV 90.0
+#define STAR_RECULL_YEARS 10.0 // precession moves the stars about 0.14 degrees in that time, well inside the margin
+#define STAR_CULL_FOV_SCALE 1.4 // the regions are culled for a view this much wider than the camera's
+#define STAR_RECULL_ZOOM 2.0    // and again once the camera's is wider than that view, or this much narrower
+#define STAR_MAX_CULL_FOV 170.0 // degrees, the frustum planes stop making sense towards 180
 
 StarInstanceTable::StarInstanceTable() {
     this->data_manager = DataManager::getInstance();
-    m_dirty = true;
+    m_instanceCount = 0;
+    m_has_view = false;
+    m_field_of_view = STAR_REFERENCE_FOV;
+    m_cull_field_of_view = STAR_REFERENCE_FOV;
+    m_aspect = 1.0f;
+    m_epoch = 0.0f;
+    m_culled_epoch = 0.0f;
+
+    QObject::connect(&data_manager->m_star_tiles, &StarTileCatalog::tilesChanged, this, [this]() {
+        updateVisibleRegions();
+    });
+    updateVisibleRegions();
 }
 
-QByteArray StarInstanceTable::getInstanceBuffer(int *instanceCount) {
-    if (m_dirty) {
-        for (int i = 0; i < data_manager->m_stars.length(); i++) {
-            dVector3D pos = data_manager->m_star_positions[i];
-            float scale = data_manager->m_stars[i].scale;
-
-            auto entry = calculateTableEntry(
-                {(float)pos.x, (float)pos.y, (float)pos.z},
-                {1, 1, 1},
-                {1, 1, 1},
-                QColor(255, 255, 255),
-                {(float)pos.x, (float)pos.y, (float)pos.z, scale}
-            );
-            m_instanceData.append((char*)&entry, sizeof(entry));
+void StarInstanceTable::setView(QVector3D forward, QVector3D up, float field_of_view, float aspect) {
+    bool turned = !m_has_view || forward != m_view_forward || up != m_view_up || aspect != m_aspect;
+    m_view_forward = forward;
+    m_view_up = up;
+    m_field_of_view = field_of_view;
+    m_aspect = aspect;
+    m_has_view = true;
+
+    // Zooming within the culled view only moves the limiting magnitude, which doesn't touch the buffer.
+    if (!turned && field_of_view <= m_cull_field_of_view && field_of_view * STAR_RECULL_ZOOM >= m_cull_field_of_view) {
+        updateLimitingMagnitude();
+        return;
+    }
+    applyView();
+}
+
+// The stars are stored and culled at their J2000 places, so the view is rotated back from the date's equator.
+void StarInstanceTable::applyView() {
+    auto toJ2000 = [this](QVector3D v) {
+        return QVector3D(m_precession(0, 0) * v.x() + m_precession(1, 0) * v.y() + m_precession(2, 0) * v.z(),
+                         m_precession(0, 1) * v.x() + m_precession(1, 1) * v.y() + m_precession(2, 1) * v.z(),
+                         m_precession(0, 2) * v.x() + m_precession(1, 2) * v.y() + m_precession(2, 2) * v.z());
+    };
+    TRACE_SCOPE("StarInstanceTable::applyView");
+    m_culled_epoch = m_epoch;
+    m_cull_field_of_view = qMin((float)STAR_MAX_CULL_FOV, m_field_of_view * (float)STAR_CULL_FOV_SCALE);
+    QVector3D forward = toJ2000(m_view_forward).normalized();
+    QVector3D right = QVector3D::crossProduct(forward, toJ2000(m_view_up)).normalized();
+    QVector3D up = QVector3D::crossProduct(right, forward);
+
+    float half_vertical = qDegreesToRadians(m_cull_field_of_view) * 0.5f;
+    float half_horizontal = atanf(tanf(half_vertical) * m_aspect);
+    m_planes[0] = forward * sinf(half_vertical) - up * cosf(half_vertical);   // top
+    m_planes[1] = forward * sinf(half_vertical) + up * cosf(half_vertical);   // bottom
+    m_planes[2] = forward * sinf(half_horizontal) - right * cosf(half_horizontal); // right
+    m_planes[3] = forward * sinf(half_horizontal) + right * cosf(half_horizontal); // left
+
+    // Emits tilesChanged if other tiles are visible now, which updates the regions.
+    data_manager->m_star_tiles.setView(forward, m_cull_field_of_view, m_aspect);
+    updateVisibleRegions();
+    updateLimitingMagnitude();
+}
+
+// Only a rotation matrix and the elapsed years change, the shader does the rest.
+void StarInstanceTable::setDate(QDateTime datetime) {
+    m_epoch = (float)(calc::daysSinceJ2000(datetime) / 365.25);
+    data_manager->m_star_epoch = m_epoch;
+
+    double matrix[3][3];
+    calc::precessionMatrix(m_epoch, matrix);
+    m_precession = QMatrix4x4(matrix[0][0], matrix[0][1], matrix[0][2], 0.0f,
+                              matrix[1][0], matrix[1][1], matrix[1][2], 0.0f,
+                              matrix[2][0], matrix[2][1], matrix[2][2], 0.0f,
+                              0.0f,         0.0f,         0.0f,         1.0f);
+    emit epochChanged();
+
+    if (m_has_view && fabs(m_epoch - m_culled_epoch) > STAR_RECULL_YEARS) applyView();
+}
+
+float StarInstanceTable::epoch() const {
+    return m_epoch;
+}
+
+QMatrix4x4 StarInstanceTable::precession() const {
+    return m_precession;
+}
+
+
+// Groups the BSC5 stars by HEALPix pixel. The cone of a region is that of its stars, not of the pixel.
+void StarInstanceTable::groupStars() {
+    const StarStore &stars = data_manager->m_stars;
+    const f32 *x = stars.x();
+    const f32 *y = stars.y();
+    const f32 *z = stars.z();
+    for (qsizetype i = 0; i < stars.size(); i++) {
+        int pixel = StarTileCatalog::tileIndex(STAR_REGION_ORDER, QVector3D(x[i], y[i], z[i]));
+        Region &region = m_regions[pixel];
+        region.stars.append((u32)i);
+        region.center += QVector3D(x[i], y[i], z[i]);
+    }
+
+    for (Region &region : m_regions) {
+        std::stable_sort(region.stars.begin(), region.stars.end(), [&stars](u32 a, u32 b) {
+            return stars.magnitude(a) < stars.magnitude(b);
+        });
+        region.center.normalize();
+        region.radius = 0.0f;
+        for (u32 i : region.stars) {
+            float cos_angle = QVector3D::dotProduct(region.center, QVector3D(x[i], y[i], z[i]));
+            region.radius = qMax(region.radius, acosf(qBound(-1.0f, cos_angle, 1.0f)));
         }
-        m_instanceCount = data_manager->m_stars.length();
-        m_dirty = false;
     }
+}
 
+// A cone around the origin intersects the frustum if it reaches inside all four side planes. The camera is
+// treated as being at the origin, it never gets far from it compared to the star sphere.
+bool StarInstanceTable::regionVisible(const Region &region) const {
+    if (!m_has_view) return true;
+
+    float reach = region.radius + qDegreesToRadians(STAR_CULL_MARGIN_DEGREES);
+    if (reach >= M_PI_2) return true;
+    float sin_reach = sinf(reach);
+    for (const QVector3D &plane : m_planes) {
+        if (QVector3D::dotProduct(plane, region.center) < -sin_reach) return false;
+    }
+    return true;
+}
+
+void StarInstanceTable::updateVisibleRegions() {
+    QList<int> visible;
+    StarTileCatalog &tiles = data_manager->m_star_tiles;
+    if (tiles.isOpen()) {
+        // Tiles the catalog dropped, or that aren't around the view any more, don't keep their entries.
+        QList<QSharedPointer<const StarTile>> loaded = tiles.visibleTiles();
+        QHash<int, Region> regions;
+        for (const QSharedPointer<const StarTile> &tile : loaded) {
+            Region region = m_regions.value(tile->index);
+            if (region.tile != tile) {
+                region = Region();
+                region.center = tile->center;
+                region.radius = tile->radius;
+                region.tile   = tile;
+            }
+            regions.insert(tile->index, region);
+            if (regionVisible(region)) visible.append(tile->index);
+        }
+        m_regions = regions;
+    }
+    else {
+        if (m_regions.isEmpty()) groupStars();
+        for (auto it = m_regions.constBegin(); it != m_regions.constEnd(); ++it) {
+            if (regionVisible(it.value())) visible.append(it.key());
+        }
+        std::sort(visible.begin(), visible.end());
+    }
+
+    if (visible != m_visible_regions || m_instanceData.isEmpty()) {
+        m_visible_regions = visible;
+        assembleBuffer();
+        markDirty();
+        updateLimitingMagnitude();
+    }
+}
+
+
+// The instance carries the J2000 direction in its data and the proper motion, as the change of that direction
+// in radians per year, in its color. star.vert moves and precesses the star from those.
+void StarInstanceTable::appendStar(Region *region, QVector3D direction, int16 magnitude, int16 proper_motion_ra, int16 proper_motion_decl) {
+    QVector3D pos = direction * STAR_DISTANCE;
+    float scale = calc::magnitudeToScale(magnitude);
+
+    // East and north on the sky at the star, the pole is along Y.
+    QVector3D east = QVector3D::crossProduct(QVector3D(0, 1, 0), direction);
+    east = east.lengthSquared() > 1E-12f ? east.normalized() : QVector3D(1, 0, 0);
+    QVector3D north = QVector3D::crossProduct(direction, east);
+    QVector3D motion = (east * proper_motion_ra + north * proper_motion_decl) / MILLIARCSECONDS_PER_RADIAN;
+
+    auto entry = calculateTableEntry(
+        pos,
+        {1, 1, 1},
+        {1, 1, 1},
+        QColor(255, 255, 255),
+        {direction.x(), direction.y(), direction.z(), scale}
+    );
+    entry.color = QVector4D(motion, 0.0f);
+    region->entries.append((char*)&entry, sizeof(entry));
+    region->magnitudes.append(magnitude);
+}
+
+// Both sources have the stars of a region brightest first.
+void StarInstanceTable::buildEntries(Region *region) {
+    if (region->tile) {
+        const StarTile &tile = *region->tile;
+        region->entries.reserve(tile.size() * sizeof(InstanceTableEntry));
+        region->magnitudes.reserve(tile.size());
+        for (qsizetype i = 0; i < tile.size(); i++) {
+            appendStar(region, QVector3D(tile.x[i], tile.y[i], tile.z[i]), tile.magnitudes[i],
+                       tile.proper_motion_ra[i], tile.proper_motion_decl[i]);
+        }
+    }
+    else {
+        StarStore &stars = data_manager->m_stars;
+        const QList<int16> &proper_motion_ra = stars.properMotionRA();
+        const QList<int16> &proper_motion_decl = stars.properMotionDeclination();
+        region->entries.reserve(region->stars.size() * sizeof(InstanceTableEntry));
+        region->magnitudes.reserve(region->stars.size());
+        for (u32 i : region->stars) {
+            appendStar(region, QVector3D(stars.x()[i], stars.y()[i], stars.z()[i]), stars.magnitude(i),
+                       proper_motion_ra.value(i), proper_motion_decl.value(i));
+        }
+    }
+}
+
+// Merges the sorted entries of the visible regions into one buffer sorted by magnitude. Only the regions that
+// just came into view are built.
+void StarInstanceTable::assembleBuffer() {
+    struct Cursor {
+        int16 magnitude;
+        Region *region;
+        qsizetype next;
+    };
+    auto fainter = [](const Cursor &a, const Cursor &b) { return a.magnitude > b.magnitude; };
+
+    QList<Cursor> heap;
+    qsizetype count = 0;
+    for (int key : m_visible_regions) {
+        Region &region = m_regions[key];
+        if (region.entries.isEmpty()) buildEntries(&region);
+        if (region.magnitudes.isEmpty()) continue;
+        heap.append({region.magnitudes[0], &region, 0});
+        count += region.magnitudes.size();
+    }
+    std::make_heap(heap.begin(), heap.end(), fainter);
+
+    // A new array rather than a resize, the old one may still be shared with the renderer.
+    m_instanceData = QByteArray(count * sizeof(InstanceTableEntry), Qt::Uninitialized);
+    m_magnitudes.resize(count);
+    char *out = m_instanceData.data();
+    for (qsizetype i = 0; i < count; i++) {
+        std::pop_heap(heap.begin(), heap.end(), fainter);
+        Cursor &cursor = heap.back();
+        memcpy(out + i * sizeof(InstanceTableEntry),
+               cursor.region->entries.constData() + cursor.next * sizeof(InstanceTableEntry), sizeof(InstanceTableEntry));
+        m_magnitudes[i] = cursor.magnitude;
+
+        cursor.next++;
+        if (cursor.next < cursor.region->magnitudes.size()) {
+            cursor.magnitude = cursor.region->magnitudes[cursor.next];
+            std::push_heap(heap.begin(), heap.end(), fainter);
+        }
+        else {
+            heap.removeLast();
+        }
+    }
+    m_instanceCount = count;
+}
+
+// The number of stars per degree squared grows by about a factor of ten every two magnitudes, so to draw
+// about as many stars at every zoom level the limit goes up by four magnitudes per tenfold narrower view.
+void StarInstanceTable::updateLimitingMagnitude() {
+    if (!m_has_view) return;
+
+    double limit = STAR_LIMITING_MAGNITUDE + 4.0 * log10(STAR_REFERENCE_FOV / qMax(1.0f, m_field_of_view));
+    int16 centimag = (int16)qBound(-32767.0, limit * 100.0, 32767.0);
+    qsizetype count = std::upper_bound(m_magnitudes.begin(), m_magnitudes.end(), centimag) - m_magnitudes.begin();
+    setInstanceCountOverride((int)count);
+    MetricsRegistry::getInstance()->set(MetricsRegistry::StarsDrawn, count);
+}
+
+QByteArray StarInstanceTable::getInstanceBuffer(int *instanceCount) {
+    TRACE_SCOPE("StarInstanceTable::getInstanceBuffer");
     if (instanceCount) {
         *instanceCount = m_instanceCount;
     }
 
+    // Qt Quick 3D asks for the buffer after markDirty and uploads all of it.
+    MetricsRegistry::getInstance()->add(MetricsRegistry::InstanceBytesUploaded, m_instanceData.size());
     return m_instanceData;
 }
@@ -4,23 +4,88 @@
 #include <QAbstractListModel>
 #include <QQuick3DInstancing>
 #include <QQmlEngine>
+#include <QVector3D>
+#include <QMatrix4x4>
+#include <QDateTime>
 #include "datamanager.h"
 
-
+/*
+ * The stars as instances of one quad. They are grouped by sky region: the HEALPix pixels of order
+ * STAR_REGION_ORDER for BSC5, the tiles for the tiled catalog. Only the regions that intersect the camera
+ * frustum are put in the instance buffer, so the GPU only transforms and the driver only uploads the visible
+ * fraction of the catalog.
+ *
+ * The instance entries of a region are built the first time it is visible and then reused, so turning the
+ * camera only costs building the regions that came into view and copying the others.
+ *
+ * The buffer is sorted by magnitude, brightest first, which makes the stars down to a limiting magnitude a
+ * prefix of it. The limit follows the field of view through instanceCountOverride, so zooming draws more or
+ * fewer stars without touching the buffer, and about the same number of them at every zoom level. For that
+ * the regions are culled for a somewhat wider view than the camera's, and only culled again when the camera's
+ * gets wider than that or a lot narrower.
+ *
+ * The entries hold the J2000 places and proper motions. star.vert applies the motion for the years since J2000
+ * and the precession matrix, both material uniforms bound to the properties here, so changing the date
+ * doesn't touch the buffer either.
+ */
 class StarInstanceTable : public QQuick3DInstancing {
     Q_OBJECT
     QML_ELEMENT
+    Q_PROPERTY(float epoch READ epoch NOTIFY epochChanged)
+    Q_PROPERTY(QMatrix4x4 precession READ precession NOTIFY epochChanged)
 
 public:
     StarInstanceTable();
 
     QByteArray getInstanceBuffer(int *instanceCount);
+    // Where the camera looks. Culls the regions outside the frustum and lets the tiled catalog load the stars
+    // around the view. field_of_view is the vertical angle in degrees, aspect is width / height.
+    Q_INVOKABLE void setView(QVector3D forward, QVector3D up, float field_of_view, float aspect);
+    // The date the stars are drawn for.
+    Q_INVOKABLE void setDate(QDateTime datetime);
+    float epoch() const; // Julian years since J2000
+    QMatrix4x4 precession() const; // from the J2000 equator to that of the date
+
+signals:
+    void epochChanged();
 
 private:
+    struct Region {
+        QVector3D center;
+        float radius = 0.0f; // radians
+        QList<u32> stars; // into m_stars brightest first, for BSC5
+        QSharedPointer<const StarTile> tile; // for the tiled catalog
+        QByteArray entries; // built on first use
+        QList<int16> magnitudes; // of the entries
+    };
+
+    void applyView();
+    void groupStars();
+    void updateVisibleRegions();
+    bool regionVisible(const Region &region) const;
+    void buildEntries(Region *region);
+    void appendStar(Region *region, QVector3D direction, int16 magnitude, int16 proper_motion_ra, int16 proper_motion_decl);
+    void assembleBuffer();
+    void updateLimitingMagnitude();
+
     DataManager *data_manager;
     QByteArray m_instanceData;
-    bool m_dirty;
+    QList<int16> m_magnitudes; // of the entries in m_instanceData, ascending
     size_t m_instanceCount;
+
+    QHash<int, Region> m_regions; // by HEALPix pixel or tile index
+    QList<int> m_visible_regions;
+    QVector3D m_planes[4]; // inward normals of the sides of the frustum through the camera, in the J2000 frame
+    QVector3D m_view_forward;
+    QVector3D m_view_up;
+    float m_field_of_view;
+    float m_cull_field_of_view; // of m_planes, wider than m_field_of_view
+    float m_aspect;
+    bool m_has_view;
+
+    float m_epoch;
+    float m_culled_epoch; // the epoch m_planes were computed for
+    QMatrix4x4 m_precession;
 };
 
 #endif // STARINSTANCETABLE_H
@@ -0,0 +1,190 @@
+#include "star_places.h"
+#include <QThread>
+#include <QRunnable>
+#include <QMutexLocker>
+#include "calculate_positions.h"
+#include "simd.h"
+
+// One share of a compute call. The arguments are set before each call, so the chunks can be reused.
+class StarPlaceKernel::Chunk : public QRunnable {
+public:
+    Chunk(StarPlaceKernel *kernel) : kernel(kernel) {
+        setAutoDelete(false);
+    }
+
+    void run() override {
+        kernel->computeRange(matrix, years, begin, end, x, y, z);
+        kernel->m_done.release();
+    }
+
+    StarPlaceKernel *kernel;
+    double matrix[3][3];
+    double years;
+    qsizetype begin;
+    qsizetype end;
+    f32 *x;
+    f32 *y;
+    f32 *z;
+};
+
+
+StarPlaceKernel::StarPlaceKernel() {
+    m_count = 0;
+    m_pool.setMaxThreadCount(qMax(1, QThread::idealThreadCount() - 1));
+    for (int i = 0; i < m_pool.maxThreadCount(); i++) {
+        m_chunks.append(new Chunk(this));
+    }
+}
+
+StarPlaceKernel::~StarPlaceKernel() {
+    m_pool.waitForDone();
+    qDeleteAll(m_chunks);
+}
+
+void StarPlaceKernel::load(StarStore &stars) {
+    QMutexLocker locker(&m_mutex);
+    const QList<int16> &proper_motion_ra = stars.properMotionRA();
+    const QList<int16> &proper_motion_decl = stars.properMotionDeclination();
+    m_count = stars.size();
+
+    // The padding is a fixed star on the X axis, so its lanes stay finite.
+    qsizetype padded = (m_count + SIMD_LANES - 1) / SIMD_LANES * SIMD_LANES;
+    m_x.fill(1.0, padded);
+    m_y.fill(0.0, padded);
+    m_z.fill(0.0, padded);
+    m_vx.fill(0.0, padded);
+    m_vy.fill(0.0, padded);
+    m_vz.fill(0.0, padded);
+
+    for (qsizetype i = 0; i < m_count; i++) {
+        f64 x = stars.x()[i], y = stars.y()[i], z = stars.z()[i];
+        m_x[i] = x;
+        m_y[i] = y;
+        m_z[i] = z;
+
+        // East is Y x p and north p x east, like StarInstanceTable::appendStar.
+        f64 east_x = z, east_z = -x;
+        f64 east_length = sqrt(east_x * east_x + east_z * east_z);
+        if (east_length < 1E-9) {
+            east_x = 1.0;
+            east_z = 0.0;
+        }
+        else {
+            east_x /= east_length;
+            east_z /= east_length;
+        }
+        f64 north_x = y * east_z;
+        f64 north_y = z * east_x - x * east_z;
+        f64 north_z = -y * east_x;
+
+        f64 east_motion = proper_motion_ra.value(i) / MILLIARCSECONDS_PER_RADIAN;
+        f64 north_motion = proper_motion_decl.value(i) / MILLIARCSECONDS_PER_RADIAN;
+        m_vx[i] = east_x * east_motion + north_x * north_motion;
+        m_vy[i] = north_y * north_motion;
+        m_vz[i] = east_z * east_motion + north_z * north_motion;
+    }
+}
+
+qsizetype StarPlaceKernel::size() const {
+    return m_count;
+}
+
+void StarPlaceKernel::compute(double years, bool nutation, StarPlaces *places) {
+    QMutexLocker locker(&m_mutex);
+    places->epoch = years;
+    places->nutation = nutation;
+    places->x.resize(m_count);
+    places->y.resize(m_count);
+    places->z.resize(m_count);
+    if (m_count == 0) return;
+
+    double matrix[3][3];
+    calc::precessionMatrix(years, matrix);
+    if (nutation) {
+        double N[3][3];
+        double P[3][3];
+        calc::nutationMatrix(years, N);
+        memcpy(P, matrix, sizeof(P));
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                matrix[i][j] = N[i][0] * P[0][j] + N[i][1] * P[1][j] + N[i][2] * P[2][j];
+            }
+        }
+    }
+
+    f32 *x = places->x.data();
+    f32 *y = places->y.data();
+    f32 *z = places->z.data();
+
+    // The calling thread takes the last share. Chunk boundaries stay on whole SIMD blocks.
+    qsizetype blocks = (m_count + SIMD_LANES - 1) / SIMD_LANES;
+    qsizetype shares = qBound((qsizetype)1, m_count / STAR_PLACES_MIN_CHUNK, (qsizetype)m_chunks.size() + 1);
+    qsizetype blocks_per_share = (blocks + shares - 1) / shares;
+    for (qsizetype i = 0; i < shares - 1; i++) {
+        Chunk *chunk = m_chunks[i];
+        memcpy(chunk->matrix, matrix, sizeof(matrix));
+        chunk->years = years;
+        chunk->begin = i * blocks_per_share * SIMD_LANES;
+        chunk->end = qMin((i + 1) * blocks_per_share * SIMD_LANES, m_count);
+        chunk->x = x;
+        chunk->y = y;
+        chunk->z = z;
+        m_pool.start(chunk);
+    }
+    computeRange(matrix, years, (shares - 1) * blocks_per_share * SIMD_LANES, m_count, x, y, z);
+    m_done.acquire((int)(shares - 1));
+}
+
+// p = M * normalize(p0 + v * years). The output columns aren't padded, so the last block only stores
+// the lanes of real stars.
+void StarPlaceKernel::computeRange(const double matrix[3][3], double years, qsizetype begin, qsizetype end, f32 *x, f32 *y, f32 *z) const {
+    const f64xN t = simd_set1(years);
+    f64xN m[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            m[i][j] = simd_set1(matrix[i][j]);
+        }
+    }
+
+    for (qsizetype i = begin; i < end; i += SIMD_LANES) {
+        f64xN px = simd_load(m_x.constData() + i) + simd_load(m_vx.constData() + i) * t;
+        f64xN py = simd_load(m_y.constData() + i) + simd_load(m_vy.constData() + i) * t;
+        f64xN pz = simd_load(m_z.constData() + i) + simd_load(m_vz.constData() + i) * t;
+        f64xN inverse_length = 1.0 / simd_sqrt(px * px + py * py + pz * pz);
+        px *= inverse_length;
+        py *= inverse_length;
+        pz *= inverse_length;
+
+        f64 out_x[SIMD_LANES], out_y[SIMD_LANES], out_z[SIMD_LANES];
+        simd_store(out_x, m[0][0] * px + m[0][1] * py + m[0][2] * pz);
+        simd_store(out_y, m[1][0] * px + m[1][1] * py + m[1][2] * pz);
+        simd_store(out_z, m[2][0] * px + m[2][1] * py + m[2][2] * pz);
+        qsizetype lanes = qMin((qsizetype)SIMD_LANES, end - i);
+        for (qsizetype lane = 0; lane < lanes; lane++) {
+            x[i + lane] = (f32)out_x[lane];
+            y[i + lane] = (f32)out_y[lane];
+            z[i + lane] = (f32)out_z[lane];
+        }
+    }
+}
+
+
+StarPlaceBuffer::StarPlaceBuffer() {
+    m_places.epoch = 0.0;
+    m_places.nutation = false;
+}
+
+void StarPlaceBuffer::publish(StarPlaces *places) {
+    QMutexLocker locker(&m_mutex);
+    std::swap(m_places, *places);
+}
+
+StarPlaces StarPlaceBuffer::places() const {
+    QMutexLocker locker(&m_mutex);
+    return m_places;
+}
+
+double StarPlaceBuffer::epoch() const {
+    QMutexLocker locker(&m_mutex);
+    return m_places.epoch;
+}
@@ -0,0 +1,309 @@
+#include "star_store.h"
+#include "calculate_positions.h"
+#include <QDebug>
+#include <QtMath>
+#include <algorithm>
+#include <string.h>
+
+// Reads fixed size values from a memory-mapped file. Every read is checked against the end of the mapping,
+// and goes through memcpy since the fields of the catalog records aren't aligned. swap_bytes is for files
+// written on big-endian machines.
+struct MappedReader {
+    const uchar *data;
+    qint64 size;
+    qint64 offset;
+    bool swap_bytes;
+    bool ok;
+
+    template <typename T>
+    T read() {
+        T value = {};
+        if (offset < 0 || offset + (qint64)sizeof(T) > size) {
+            ok = false;
+            return value;
+        }
+        uchar bytes[sizeof(T)];
+        memcpy(bytes, data + offset, sizeof(T));
+        if (swap_bytes) std::reverse(bytes, bytes + sizeof(T));
+        memcpy(&value, bytes, sizeof(T));
+        offset += sizeof(T);
+        return value;
+    }
+};
+
+// B1950.0 (FK4) to J2000.0 (FK5) rotation. Leaves out the E-terms of aberration, which are below an arcsecond.
+static const double B1950_TO_J2000[3][3] = {
+    {0.9999256782, -0.0111820611, -0.0048579477},
+    {0.0111820610,  0.9999374784, -0.0000271765},
+    {0.0048579479, -0.0000271474,  0.9999881997},
+};
+
+// Rotates a position and its proper motion (radians and radians per year, RA motion not scaled by cos(dec))
+// from B1950 to J2000.
+static void precessB1950ToJ2000(double *RA, double *declination, double *proper_motion_ra, double *proper_motion_decl) {
+    double sin_ra = sin(*RA), cos_ra = cos(*RA);
+    double sin_dec = sin(*declination), cos_dec = cos(*declination);
+    double p[3] = {cos_dec * cos_ra, cos_dec * sin_ra, sin_dec};
+    double v[3] = {
+        -*proper_motion_ra * cos_dec * sin_ra - *proper_motion_decl * sin_dec * cos_ra,
+         *proper_motion_ra * cos_dec * cos_ra - *proper_motion_decl * sin_dec * sin_ra,
+         *proper_motion_decl * cos_dec,
+    };
+
+    double p2[3], v2[3];
+    for (int i = 0; i < 3; i++) {
+        p2[i] = B1950_TO_J2000[i][0] * p[0] + B1950_TO_J2000[i][1] * p[1] + B1950_TO_J2000[i][2] * p[2];
+        v2[i] = B1950_TO_J2000[i][0] * v[0] + B1950_TO_J2000[i][1] * v[1] + B1950_TO_J2000[i][2] * v[2];
+    }
+
+    *RA = atan2(p2[1], p2[0]);
+    if (*RA < 0.0) *RA += 2.0 * M_PI;
+    *declination = asin(qBound(-1.0, p2[2], 1.0));
+
+    double cos_dec2 = cos(*declination);
+    if (cos_dec2 > 1E-12) {
+        *proper_motion_ra   = (-sin(*RA) * v2[0] + cos(*RA) * v2[1]) / cos_dec2;
+        *proper_motion_decl = v2[2] / cos_dec2;
+    }
+}
+
+static int16 quantizeProperMotion(double radians_per_year) {
+    return (int16)qBound(-32767.0, round(radians_per_year * MILLIARCSECONDS_PER_RADIAN), 32767.0);
+}
+
+
+StarStore::StarStore() :
+    m_data(nullptr),
+    m_size(0),
+    m_layout(),
+    m_ids_loaded(false),
+    m_spectral_types_loaded(false),
+    m_proper_motions_loaded(false)
+{
+}
+
+StarStore::~StarStore() {
+    clear();
+}
+
+void StarStore::clear() {
+    if (m_data) {
+        m_file.unmap((uchar *)m_data);
+        m_file.close();
+        m_data = nullptr;
+    }
+    m_size = 0;
+    m_x.clear();
+    m_y.clear();
+    m_z.clear();
+    m_magnitudes.clear();
+    m_ids.clear();
+    m_spectral_types.clear();
+    m_proper_motion_ra.clear();
+    m_proper_motion_declination.clear();
+    m_ids_loaded = false;
+    m_spectral_types_loaded = false;
+    m_proper_motions_loaded = false;
+}
+
+
+// The format of the Yale Bright Star Catalog (BSC5) as distributed by the SAO, which other catalogs use as well.
+// A 28 byte header is followed by one fixed size record per star:
+//   catalog number (none, float, int32, or a name of -STNUM characters), RA and declination in radians (double),
+//   spectral type (2 chars), NMAG magnitudes times 100 (int16), and if MPROP > 0 the proper motion in RA and
+//   declination in radians per year (float), and if MPROP == 2 the radial velocity in km/s (double).
+bool StarStore::load(QString path) {
+    clear();
+
+    m_file.setFileName(path);
+    if (!m_file.exists()) {
+        qWarning() << "Could not find file " << path;
+        return false;
+    }
+    if (!m_file.open(QIODevice::ReadOnly)) {
+        qWarning() << "Could not open file " << path;
+        return false;
+    }
+
+    m_size = m_file.size();
+    m_data = m_file.map(0, m_size);
+    if (!m_data) {
+        qWarning() << "Could not map file " << path;
+        m_file.close();
+        return false;
+    }
+
+    // Parse the header first. The files exist in both byte orders, a record size that makes no sense tells them apart.
+    MappedReader header = {m_data, m_size, 0, false, true};
+    int32_t header_values[7];
+    for (int32_t &value : header_values) value = header.read<int32_t>();
+    if (header_values[6] <= 0 || header_values[6] > 4096) {
+        header = {m_data, m_size, 0, true, true};
+        for (int32_t &value : header_values) value = header.read<int32_t>();
+    }
+
+    int32_t num_stars      = header_values[2]; // Number of stars in the file. If negative, J2000 is used. If positive, B1950.
+    m_layout.first_star     = header_values[1]; // First star number in file
+    m_layout.id_number_type = header_values[3]; // 0: none, 1: float, 2: int32, negative: name of that many characters
+    m_layout.proper_motion  = header_values[4]; // 0: none, 1: proper motion, 2: proper motion and radial velocity
+    m_layout.num_magnitudes = abs(header_values[5]); // Negative also means J2000 in some files
+    m_layout.bytes_per_star = header_values[6];
+    m_layout.header_bytes   = header.offset;
+    m_layout.J2000          = num_stars < 0 || header_values[5] < 0;
+    m_layout.swap_bytes     = header.swap_bytes;
+    m_layout.id_bytes       = m_layout.id_number_type > 0 ? 4 : -m_layout.id_number_type;
+    num_stars = abs(num_stars);
+
+    int record_bytes = m_layout.id_bytes + 8 + 8 + 2 + 2 * m_layout.num_magnitudes +
+                       (m_layout.proper_motion > 0 ? 8 : 0) + (m_layout.proper_motion == 2 ? 8 : 0);
+    if (!header.ok || m_layout.num_magnitudes > 10 || m_layout.proper_motion < 0 || m_layout.proper_motion > 2 ||
+        m_layout.id_number_type > 2 || record_bytes > m_layout.bytes_per_star ||
+        m_layout.header_bytes + (qint64)num_stars * m_layout.bytes_per_star > m_size) {
+        qWarning() << "The star catalog" << path << "has an unexpected header or is truncated";
+        clear();
+        return false;
+    }
+
+    m_x.resize(num_stars);
+    m_y.resize(num_stars);
+    m_z.resize(num_stars);
+    m_magnitudes.resize(num_stars);
+
+    MappedReader reader = header;
+    for (qsizetype i = 0; i < num_stars; i++) {
+        reader.offset = record(i) - m_data + m_layout.id_bytes;
+        double RA          = reader.read<double>();
+        double declination = reader.read<double>();
+        reader.offset += 2; // spectral type
+        int16 magnitude = m_layout.num_magnitudes > 0 ? reader.read<int16_t>() : 0; // The first magnitude is V where there are several.
+
+        if (!m_layout.J2000) {
+            double no_motion[2] = {0.0, 0.0};
+            precessB1950ToJ2000(&RA, &declination, &no_motion[0], &no_motion[1]);
+        }
+        dVector3D position = calc::RADeclinationToCartesian(RA, declination, 1.0);
+        m_x[i] = (f32)position.x;
+        m_y[i] = (f32)position.y;
+        m_z[i] = (f32)position.z;
+        m_magnitudes[i] = (u8)qBound(0, (magnitude - STAR_MAGNITUDE_MIN + STAR_MAGNITUDE_STEP / 2) / STAR_MAGNITUDE_STEP, 255);
+    }
+
+    m_ids_loaded = false;
+    m_spectral_types_loaded = false;
+    m_proper_motions_loaded = m_layout.proper_motion == 0;
+    return true;
+}
+
+qsizetype StarStore::size() const {
+    return m_x.size();
+}
+
+const f32 *StarStore::x() const {
+    return m_x.constData();
+}
+
+const f32 *StarStore::y() const {
+    return m_y.constData();
+}
+
+const f32 *StarStore::z() const {
+    return m_z.constData();
+}
+
+const u8 *StarStore::magnitudes() const {
+    return m_magnitudes.constData();
+}
+
+int16 StarStore::magnitude(qsizetype i) const {
+    return (int16)(STAR_MAGNITUDE_MIN + m_magnitudes[i] * STAR_MAGNITUDE_STEP);
+}
+
+
+const QList<f32> &StarStore::ids() {
+    if (!m_ids_loaded) loadIds();
+    return m_ids;
+}
+
+const QList<u16> &StarStore::spectralTypes() {
+    if (!m_spectral_types_loaded) loadSpectralTypes();
+    return m_spectral_types;
+}
+
+const QList<int16> &StarStore::properMotionRA() {
+    if (!m_proper_motions_loaded) loadProperMotions();
+    return m_proper_motion_ra;
+}
+
+const QList<int16> &StarStore::properMotionDeclination() {
+    if (!m_proper_motions_loaded) loadProperMotions();
+    return m_proper_motion_declination;
+}
+
+
+// Records are only handed out for indices below size(), and load() checked that all of those are in the mapping.
+const uchar *StarStore::record(qsizetype i) const {
+    return m_data + m_layout.header_bytes + (qint64)i * m_layout.bytes_per_star;
+}
+
+void StarStore::loadIds() {
+    m_ids_loaded = true;
+    if (!m_data) return;
+
+    m_ids.resize(size());
+    MappedReader reader = {m_data, m_size, 0, m_layout.swap_bytes, true};
+    for (qsizetype i = 0; i < size(); i++) {
+        reader.offset = record(i) - m_data;
+        if      (m_layout.id_number_type == 1) m_ids[i] = reader.read<float>();
+        else if (m_layout.id_number_type == 2) m_ids[i] = (f32)reader.read<int32_t>();
+        else                                   m_ids[i] = (f32)(m_layout.first_star + i); // no number, or a name in its place
+    }
+    unmapIfDone();
+}
+
+void StarStore::loadSpectralTypes() {
+    m_spectral_types_loaded = true;
+    if (!m_data) return;
+
+    m_spectral_types.resize(size());
+    MappedReader reader = {m_data, m_size, 0, false, true};
+    for (qsizetype i = 0; i < size(); i++) {
+        reader.offset = record(i) - m_data + m_layout.id_bytes + 16;
+        u8 first  = reader.read<u8>();
+        u8 second = reader.read<u8>();
+        m_spectral_types[i] = first | (second << 8);
+    }
+    unmapIfDone();
+}
+
+void StarStore::loadProperMotions() {
+    m_proper_motions_loaded = true;
+    if (!m_data || m_layout.proper_motion == 0) return;
+
+    m_proper_motion_ra.resize(size());
+    m_proper_motion_declination.resize(size());
+    MappedReader reader = {m_data, m_size, 0, m_layout.swap_bytes, true};
+    for (qsizetype i = 0; i < size(); i++) {
+        reader.offset = record(i) - m_data + m_layout.id_bytes;
+        double RA          = reader.read<double>();
+        double declination = reader.read<double>();
+        reader.offset += 2 + 2 * m_layout.num_magnitudes;
+        double proper_motion_ra   = reader.read<float>();
+        double proper_motion_decl = reader.read<float>();
+
+        if (!m_layout.J2000) {
+            precessB1950ToJ2000(&RA, &declination, &proper_motion_ra, &proper_motion_decl);
+        }
+        m_proper_motion_ra[i]          = quantizeProperMotion(proper_motion_ra * cos(declination));
+        m_proper_motion_declination[i] = quantizeProperMotion(proper_motion_decl);
+    }
+    unmapIfDone();
+}
+
+// The mapping is only needed for the lazy columns.
+void StarStore::unmapIfDone() {
+    if (m_data && m_ids_loaded && m_spectral_types_loaded && m_proper_motions_loaded) {
+        m_file.unmap((uchar *)m_data);
+        m_file.close();
+        m_data = nullptr;
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef STARSTORE_H
+#define STARSTORE_H
+
+#include <QList>
+#include <QFile>
+#include <QString>
+#include "types.h"
+
+#define STAR_MAGNITUDE_STEP 10   // hundredths of a magnitude per step of the quantized magnitudes
+#define STAR_MAGNITUDE_MIN -250  // hundredths of a magnitude at step 0, so steps 0..255 cover -2.5 to 23
+#define STAR_DISTANCE 200.0f     // radius of the sphere the stars are drawn on
+#define MILLIARCSECONDS_PER_RADIAN 206264806.24709636
+
+/*
+ * The star catalog as a structure of arrays, so that loops over many stars only stream the columns they use.
+ * Positions are float unit vectors in the scene frame (Y up, see calc::RADeclinationToCartesian) and magnitudes
+ * are quantized to a tenth of a magnitude in one byte, which is 13 bytes per star for what drawing needs.
+ *
+ * The optional fields (catalog numbers, spectral types and proper motions) are only parsed the first time they
+ * are asked for. The catalog file stays memory-mapped until then, so the pages are shared with the file cache
+ * rather than copied.
+ *
+ * The lazy columns are loaded by non-const accessors and aren't thread safe. Load them on the thread that owns
+ * the store before handing it to others.
+ */
+class StarStore {
+public:
+    StarStore();
+    ~StarStore();
+
+    // Reads a catalog in the binary format of the Yale Bright Star Catalog (BSC5). Replaces what was loaded before.
+    bool load(QString path);
+    void clear();
+    qsizetype size() const;
+
+    const f32 *x() const;
+    const f32 *y() const;
+    const f32 *z() const;
+    const u8 *magnitudes() const; // quantized, see magnitude()
+    // Hundredths of a magnitude, like the catalog stores them.
+    int16 magnitude(qsizetype i) const;
+
+    // Optional columns, parsed on first use. Empty if the catalog doesn't have them.
+    const QList<f32> &ids();
+    const QList<u16> &spectralTypes(); // the two characters, first one in the low byte
+    const QList<int16> &properMotionRA(); // milliarcseconds per year, times cos(declination)
+    const QList<int16> &properMotionDeclination(); // milliarcseconds per year
+
+private:
+    struct Layout {
+        qint64 header_bytes;
+        qint64 bytes_per_star;
+        int id_number_type;
+        int id_bytes;
+        int num_magnitudes;
+        int proper_motion;
+        int first_star;
+        bool J2000;
+        bool swap_bytes;
+    };
+
+    const uchar *record(qsizetype i) const;
+    void loadIds();
+    void loadSpectralTypes();
+    void loadProperMotions();
+    void unmapIfDone();
+
+    QFile m_file;
+    const uchar *m_data;
+    qint64 m_size;
+    Layout m_layout;
+
+    QList<f32> m_x;
+    QList<f32> m_y;
+    QList<f32> m_z;
+    QList<u8> m_magnitudes;
+
+    bool m_ids_loaded;
+    bool m_spectral_types_loaded;
+    bool m_proper_motions_loaded;
+    QList<f32> m_ids;
+    QList<u16> m_spectral_types;
+    QList<int16> m_proper_motion_ra;
+    QList<int16> m_proper_motion_declination;
+};
+
+#endif // STARSTORE_H
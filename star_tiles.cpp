@@ -0,0 +1,454 @@
+#include "star_tiles.h"
+#include <QDebug>
+#include <QThread>
+#include <QSaveFile>
+#include <QVarLengthArray>
+#include <QtMath>
+#include <algorithm>
+#include <string.h>
+
+#define TILES_MAGIC "OBSTILES"
+#define TILES_VERSION 1
+#define MAX_TILE_ORDER 10
+
+/*
+   File layout. Everything is little-endian, the table is 8 byte aligned.
+
+   TileHeader
+   TileEntry   tile_count times, indexed by the HEALPix nested pixel number
+   TileStar    the stars of tile 0 sorted by magnitude, then those of tile 1, and so on
+*/
+struct TileHeader {
+    char magic[8];
+    u32 version;
+    u32 order;
+    u32 tile_count;
+    u32 star_count;
+};
+
+struct TileEntry {
+    u64 offset; // from the start of the file to the first star
+    u32 count;
+    f32 center[3]; // mean direction of the stars
+    f32 radius;    // largest angle between the center and a star, radians
+    int16 brightest;
+    int16 faintest;
+};
+
+
+// The pixel number in the nested scheme is the face number followed by the bits of x and y interleaved.
+static u32 interleaveBits(u32 x, u32 y) {
+    u32 result = 0;
+    for (int bit = 0; bit < 16; bit++) {
+        result |= ((x >> bit) & 1) << (2 * bit);
+        result |= ((y >> bit) & 1) << (2 * bit + 1);
+    }
+    return result;
+}
+
+// HEALPix ang2pix_nest (Gorski et al. 2005). The scene frame has the celestial pole along Y, and RA increasing
+// towards -Z.
+int StarTileCatalog::tileIndex(int order, QVector3D direction) {
+    direction.normalize();
+    const int nside = 1 << order;
+    double z   = qBound(-1.0, (double)direction.y(), 1.0);
+    double phi = atan2(-(double)direction.z(), (double)direction.x());
+    double za  = fabs(z);
+    double tt  = phi * M_2_PI; // in [-2, 2]
+    if (tt < 0.0) tt += 4.0;   // in [0, 4)
+
+    int face, ix, iy;
+    if (za <= 2.0 / 3.0) {
+        // Equatorial region
+        double temp1 = nside * (0.5 + tt);
+        double temp2 = nside * z * 0.75;
+        int jp = (int)(temp1 - temp2); // index of the ascending edge line
+        int jm = (int)(temp1 + temp2); // index of the descending edge line
+        int ifp = jp / nside;
+        int ifm = jm / nside;
+        face = ifp == ifm ? (ifp | 4) : (ifp < ifm ? ifp : ifm + 8);
+        ix = jm & (nside - 1);
+        iy = nside - (jp & (nside - 1)) - 1;
+    }
+    else {
+        // Polar caps
+        int ntt = qMin(3, (int)tt);
+        double tp  = tt - ntt;
+        double tmp = nside * sqrt(3.0 * (1.0 - za));
+        int jp = qMin((int)(tp * tmp), nside - 1);
+        int jm = qMin((int)((1.0 - tp) * tmp), nside - 1);
+        if (z >= 0.0) {
+            face = ntt;
+            ix = nside - jm - 1;
+            iy = nside - jp - 1;
+        }
+        else {
+            face = ntt + 8;
+            ix = jp;
+            iy = jm;
+        }
+    }
+    return face * nside * nside + (int)interleaveBits(ix, iy);
+}
+
+static TileEntry readEntry(const uchar *data, int index) {
+    TileEntry entry;
+    memcpy(&entry, data + sizeof(TileHeader) + (qint64)index * sizeof(TileEntry), sizeof(entry));
+    return entry;
+}
+
+
+bool StarTileCatalog::build(QList<TileStar> stars, QString path, int order) {
+    if (order < 0 || order > MAX_TILE_ORDER) {
+        qWarning() << "HEALPix order" << order << "is out of range";
+        return false;
+    }
+    const int tile_count = 12 << (2 * order);
+
+    QList<int> tiles(stars.size());
+    for (qsizetype i = 0; i < stars.size(); i++) {
+        QVector3D direction = QVector3D(stars[i].x, stars[i].y, stars[i].z).normalized();
+        stars[i].x = direction.x();
+        stars[i].y = direction.y();
+        stars[i].z = direction.z();
+        tiles[i] = tileIndex(order, direction);
+    }
+
+    QList<qsizetype> sorted(stars.size());
+    for (qsizetype i = 0; i < sorted.size(); i++) sorted[i] = i;
+    std::stable_sort(sorted.begin(), sorted.end(), [&](qsizetype a, qsizetype b) {
+        if (tiles[a] != tiles[b]) return tiles[a] < tiles[b];
+        return stars[a].magnitude < stars[b].magnitude;
+    });
+
+    QList<TileEntry> table(tile_count);
+    QList<TileStar> records(stars.size());
+    u64 offset = sizeof(TileHeader) + (u64)tile_count * sizeof(TileEntry);
+    qsizetype next = 0;
+    for (int t = 0; t < tile_count; t++) {
+        TileEntry &entry = table[t];
+        entry = {};
+        entry.offset = offset + (u64)next * sizeof(TileStar);
+
+        qsizetype first = next;
+        QVector3D sum;
+        while (next < sorted.size() && tiles[sorted[next]] == t) {
+            const TileStar &star = stars[sorted[next]];
+            records[next] = star;
+            sum += QVector3D(star.x, star.y, star.z);
+            next++;
+        }
+        entry.count = (u32)(next - first);
+        if (entry.count == 0) continue;
+
+        QVector3D center = sum.length() > 1E-6f ? sum.normalized() : QVector3D(records[first].x, records[first].y, records[first].z);
+        float radius = 0.0f;
+        for (qsizetype i = first; i < next; i++) {
+            float cos_angle = QVector3D::dotProduct(center, QVector3D(records[i].x, records[i].y, records[i].z));
+            radius = qMax(radius, acosf(qBound(-1.0f, cos_angle, 1.0f)));
+        }
+        entry.center[0] = center.x();
+        entry.center[1] = center.y();
+        entry.center[2] = center.z();
+        entry.radius    = radius + 1E-5f; // float rounding of the star positions
+        entry.brightest = records[first].magnitude;
+        entry.faintest  = records[next - 1].magnitude;
+    }
+
+    TileHeader header = {};
+    memcpy(header.magic, TILES_MAGIC, sizeof(header.magic));
+    header.version    = TILES_VERSION;
+    header.order      = order;
+    header.tile_count = tile_count;
+    header.star_count = (u32)stars.size();
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Could not write star tiles" << path;
+        return false;
+    }
+    file.write((const char *)&header, sizeof(header));
+    file.write((const char *)table.constData(), table.size() * sizeof(TileEntry));
+    file.write((const char *)records.constData(), records.size() * sizeof(TileStar));
+    return file.commit();
+}
+
+
+StarTileCatalog::StarTileCatalog(QObject *parent) :
+    QObject(parent),
+    m_data(nullptr),
+    m_size(0),
+    m_tile_count(0),
+    m_star_count(0),
+    m_generation(0),
+    m_bytes(0),
+    m_budget(STAR_TILE_MEMORY_BUDGET),
+    m_use_counter(0)
+{
+    m_pool.setMaxThreadCount(qBound(1, QThread::idealThreadCount() / 2, 4));
+}
+
+StarTileCatalog::~StarTileCatalog() {
+    close();
+}
+
+bool StarTileCatalog::open(QString path) {
+    close();
+
+    m_file.setFileName(path);
+    if (!m_file.exists() || !m_file.open(QIODevice::ReadOnly)) return false;
+
+    m_size = m_file.size();
+    if (m_size >= (qint64)sizeof(TileHeader)) {
+        m_data = m_file.map(0, m_size);
+    }
+    if (!m_data) {
+        close();
+        return false;
+    }
+
+    TileHeader header;
+    memcpy(&header, m_data, sizeof(header));
+    bool valid = memcmp(header.magic, TILES_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.version == TILES_VERSION &&
+                 header.order <= MAX_TILE_ORDER &&
+                 header.tile_count == (12u << (2 * header.order)) &&
+                 m_size >= (qint64)(sizeof(TileHeader) + (u64)header.tile_count * sizeof(TileEntry));
+
+    u64 stars = 0;
+    for (u32 t = 0; valid && t < header.tile_count; t++) {
+        TileEntry entry = readEntry(m_data, t);
+        valid = entry.offset + (u64)entry.count * sizeof(TileStar) <= (u64)m_size;
+        stars += entry.count;
+    }
+    if (!valid || stars != header.star_count) {
+        qWarning() << "The star tiles" << path << "are malformed or truncated";
+        close();
+        return false;
+    }
+
+    m_tile_count = header.tile_count;
+    m_star_count = header.star_count;
+    buildCones(header.order);
+    return true;
+}
+
+// The tiles' cones come from the table, each coarser pixel gets a cone around those of its four children.
+void StarTileCatalog::buildCones(int order) {
+    m_cones.resize(order + 1);
+    m_cones[order].resize(m_tile_count);
+    for (int t = 0; t < m_tile_count; t++) {
+        TileEntry entry = readEntry(m_data, t);
+        QVector3D center(entry.center[0], entry.center[1], entry.center[2]);
+        m_cones[order][t] = {center, entry.count > 0 ? entry.radius : -1.0f};
+    }
+
+    for (int level = order - 1; level >= 0; level--) {
+        const QList<Cone> &children = m_cones[level + 1];
+        QList<Cone> &pixels = m_cones[level];
+        pixels.resize(12 << (2 * level));
+        for (qsizetype p = 0; p < pixels.size(); p++) {
+            QVector3D sum;
+            for (qsizetype c = 4 * p; c < 4 * p + 4; c++) {
+                if (children[c].radius >= 0.0f) sum += children[c].center;
+            }
+            float radius = -1.0f;
+            QVector3D center = sum.length() > 1E-6f ? sum.normalized() : QVector3D(0, 1, 0);
+            for (qsizetype c = 4 * p; c < 4 * p + 4; c++) {
+                if (children[c].radius < 0.0f) continue;
+                float angle = acosf(qBound(-1.0f, QVector3D::dotProduct(center, children[c].center), 1.0f));
+                radius = qMax(radius, angle + children[c].radius + 1E-5f);
+            }
+            pixels[p] = {center, radius};
+        }
+    }
+}
+
+void StarTileCatalog::close() {
+    // Loads in flight read from the mapping.
+    m_pool.waitForDone();
+    m_generation++;
+
+    if (m_data) {
+        m_file.unmap((uchar *)m_data);
+    }
+    m_file.close();
+    m_data = nullptr;
+    m_size = 0;
+    m_tile_count = 0;
+    m_star_count = 0;
+    m_cones.clear();
+    m_tiles.clear();
+    m_pending.clear();
+    m_visible.clear();
+    m_bytes = 0;
+}
+
+bool StarTileCatalog::isOpen() const {
+    return m_data != nullptr;
+}
+
+int StarTileCatalog::tileCount() const {
+    return m_tile_count;
+}
+
+qint64 StarTileCatalog::starCount() const {
+    return m_star_count;
+}
+
+qint64 StarTileCatalog::loadedBytes() const {
+    return m_bytes;
+}
+
+void StarTileCatalog::setMemoryBudget(qint64 bytes) {
+    m_budget = bytes;
+    evictFor(0);
+}
+
+qint64 StarTileCatalog::tileBytes(int index) const {
+    return readEntry(m_data, index).count * StarTile::bytesPerStar();
+}
+
+
+void StarTileCatalog::setView(QVector3D direction, float field_of_view, float aspect) {
+    if (!isOpen()) return;
+
+    // The frustum fits in a cone around the view direction reaching to its corners.
+    direction.normalize();
+    double half_angle = atan(tan(qDegreesToRadians(field_of_view) * 0.5) * sqrt(1.0 + (double)aspect * aspect));
+    half_angle += qDegreesToRadians(STAR_TILE_MARGIN_DEGREES);
+
+    struct Candidate {
+        int index;
+        float angle;
+    };
+    QList<Candidate> candidates;
+
+    // Depth first from the base pixels. In the nested scheme the children of pixel p are 4p to 4p + 3.
+    struct Pixel {
+        int level;
+        int index;
+    };
+    const int tile_level = m_cones.size() - 1;
+    QVarLengthArray<Pixel, 64> stack;
+    for (int p = 11; p >= 0; p--) stack.append({0, p});
+    while (!stack.isEmpty()) {
+        Pixel pixel = stack.takeLast();
+        const Cone &cone = m_cones[pixel.level][pixel.index];
+        if (cone.radius < 0.0f) continue;
+        float angle = acosf(qBound(-1.0f, QVector3D::dotProduct(cone.center, direction), 1.0f));
+        if (angle > half_angle + cone.radius) continue;
+
+        if (pixel.level == tile_level) {
+            candidates.append({pixel.index, angle});
+            continue;
+        }
+        for (int c = 3; c >= 0; c--) stack.append({pixel.level + 1, 4 * pixel.index + c});
+    }
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+        return a.angle < b.angle;
+    });
+
+    // Tiles used by this view carry the newest stamp, eviction only takes older ones.
+    m_use_counter++;
+    QList<int> visible;
+    visible.reserve(candidates.size());
+    for (const Candidate &candidate : candidates) {
+        visible.append(candidate.index);
+        auto cached = m_tiles.find(candidate.index);
+        if (cached != m_tiles.end()) cached->last_used = m_use_counter;
+    }
+
+    bool out_of_memory = false;
+    for (int index : visible) {
+        if (out_of_memory) break;
+        if (m_tiles.contains(index) || m_pending.contains(index)) continue;
+        if (evictFor(tileBytes(index))) {
+            requestTile(index);
+        }
+        else {
+            out_of_memory = true; // the tiles further out stay unloaded
+        }
+    }
+
+    if (visible != m_visible) {
+        m_visible = visible;
+        emit tilesChanged();
+    }
+}
+
+QList<QSharedPointer<const StarTile>> StarTileCatalog::visibleTiles() const {
+    QList<QSharedPointer<const StarTile>> result;
+    result.reserve(m_visible.size());
+    for (int index : m_visible) {
+        auto cached = m_tiles.constFind(index);
+        if (cached != m_tiles.constEnd()) result.append(cached->tile);
+    }
+    return result;
+}
+
+
+// Drops least recently used tiles outside the current view until bytes more fit in the budget.
+bool StarTileCatalog::evictFor(qint64 bytes) {
+    while (m_bytes + bytes > m_budget) {
+        auto oldest = m_tiles.end();
+        for (auto it = m_tiles.begin(); it != m_tiles.end(); ++it) {
+            if (it->last_used < m_use_counter && (oldest == m_tiles.end() || it->last_used < oldest->last_used)) {
+                oldest = it;
+            }
+        }
+        if (oldest == m_tiles.end()) return false;
+        m_bytes -= oldest->tile->size() * StarTile::bytesPerStar();
+        m_tiles.erase(oldest);
+    }
+    return true;
+}
+
+void StarTileCatalog::requestTile(int index) {
+    m_pending.append(index);
+    m_bytes += tileBytes(index);
+
+    const uchar *data = m_data;
+    TileEntry entry = readEntry(m_data, index);
+    u64 generation = m_generation;
+    m_pool.start([this, data, entry, index, generation]() {
+        QSharedPointer<StarTile> tile(new StarTile);
+        tile->index = index;
+        tile->center = QVector3D(entry.center[0], entry.center[1], entry.center[2]);
+        tile->radius = entry.radius;
+        tile->x.resize(entry.count);
+        tile->y.resize(entry.count);
+        tile->z.resize(entry.count);
+        tile->magnitudes.resize(entry.count);
+        tile->proper_motion_ra.resize(entry.count);
+        tile->proper_motion_decl.resize(entry.count);
+        tile->ids.resize(entry.count);
+        tile->spectral_types.resize(entry.count);
+        for (u32 i = 0; i < entry.count; i++) {
+            TileStar star;
+            memcpy(&star, data + entry.offset + (u64)i * sizeof(TileStar), sizeof(star));
+            tile->x[i] = star.x;
+            tile->y[i] = star.y;
+            tile->z[i] = star.z;
+            tile->magnitudes[i] = star.magnitude;
+            tile->proper_motion_ra[i] = star.proper_motion_ra;
+            tile->proper_motion_decl[i] = star.proper_motion_decl;
+            tile->ids[i] = star.id;
+            tile->spectral_types[i] = star.spectral_type;
+        }
+        tile->sky_index.build(tile->x.constData(), tile->y.constData(), tile->z.constData(), tile->size());
+        QMetaObject::invokeMethod(this, [this, generation, tile]() {
+            insertTile(generation, tile);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void StarTileCatalog::insertTile(u64 generation, QSharedPointer<const StarTile> tile) {
+    if (generation != m_generation) return; // from a file that has been closed since
+
+    m_pending.removeOne(tile->index);
+    m_tiles.insert(tile->index, {tile, m_use_counter});
+    if (m_visible.contains(tile->index)) {
+        emit tilesChanged();
+    }
+}
@@ -0,0 +1,124 @@
+#ifndef STARTILES_H
+#define STARTILES_H
+
+#include <QObject>
+#include <QList>
+#include <QHash>
+#include <QFile>
+#include <QString>
+#include <QVector3D>
+#include <QThreadPool>
+#include <QSharedPointer>
+#include "types.h"
+#include "sky_index.h"
+
+#define STAR_TILE_ORDER 3 // Default HEALPix order of the tiles: 12 * 4^3 = 768 tiles of about 7 degrees
+#define STAR_TILE_MARGIN_DEGREES 5.0 // Tiles this close to the edge of the view are loaded before they come into it
+#define STAR_TILE_MEMORY_BUDGET (32 * 1024 * 1024)
+
+// One star as the converter gets it and as it is stored in the tile file.
+struct TileStar {
+    f32 x, y, z;           // unit vector in the scene frame, see calc::RADeclinationToCartesian
+    int16 magnitude;       // hundredths of a magnitude
+    u16 spectral_type;     // the two characters, first one in the low byte
+    int16 proper_motion_ra;   // milliarcseconds per year, times cos(declination)
+    int16 proper_motion_decl; // milliarcseconds per year
+    f32 id;
+};
+
+// The stars of one tile, brightest first, as columns like StarStore.
+struct StarTile {
+    int index;
+    QVector3D center; // of the cone bounding the stars
+    float radius;     // radians
+    QList<f32> x;
+    QList<f32> y;
+    QList<f32> z;
+    QList<int16> magnitudes;
+    QList<int16> proper_motion_ra;   // milliarcseconds per year, times cos(declination)
+    QList<int16> proper_motion_decl; // milliarcseconds per year
+    QList<f32> ids;
+    QList<u16> spectral_types;
+    SkyIndex sky_index; // for picking
+
+    qsizetype size() const { return x.size(); }
+    // The sky index takes about 28 bytes per star on top of the columns.
+    static qint64 bytesPerStar() { return 4 * sizeof(f32) + 3 * sizeof(int16) + sizeof(u16) + 28; }
+};
+
+/*
+ * A star catalog too large to keep in memory, partitioned into HEALPix tiles (nested scheme) in a file that the
+ * observe-tiles tool writes. The file is memory-mapped, and only the tiles around the current view are decoded,
+ * on a small thread pool so the UI thread never waits for the disk.
+ *
+ * setView finds the tiles in view by walking down the nested HEALPix hierarchy from the 12 base pixels, only into
+ * the pixels whose stars can reach the view, rather than looking at every tile.
+ *
+ * Decoded tiles are kept until they exceed the memory budget, then the least recently visible ones are dropped.
+ * Tiles in view are never dropped, instead the ones furthest from the view direction aren't loaded.
+ *
+ * Apart from the pool's work, everything here runs on the thread that owns the catalog. tilesChanged is emitted
+ * there whenever a tile finished loading.
+ */
+class StarTileCatalog : public QObject {
+    Q_OBJECT
+
+public:
+    StarTileCatalog(QObject *parent = nullptr);
+    ~StarTileCatalog();
+
+    static int tileIndex(int order, QVector3D direction);
+    // Sorts the stars by tile and magnitude and writes them to path. order is the HEALPix order of the tiles.
+    static bool build(QList<TileStar> stars, QString path, int order = STAR_TILE_ORDER);
+
+    bool open(QString path);
+    void close();
+    bool isOpen() const;
+    int tileCount() const;
+    qint64 starCount() const;
+    void setMemoryBudget(qint64 bytes);
+    qint64 loadedBytes() const; // of the loaded and pending tiles, up to the budget
+
+    // direction is where the camera looks, field_of_view the vertical angle in degrees and aspect width / height.
+    void setView(QVector3D direction, float field_of_view, float aspect);
+    // The loaded tiles in the current view, nearest to the view direction first.
+    QList<QSharedPointer<const StarTile>> visibleTiles() const;
+
+signals:
+    void tilesChanged();
+
+private:
+    struct CachedTile {
+        QSharedPointer<const StarTile> tile;
+        u64 last_used;
+    };
+    // Bounds the stars under a pixel of the HEALPix hierarchy. The radius is negative for pixels without stars.
+    struct Cone {
+        QVector3D center;
+        float radius; // radians
+    };
+
+    void buildCones(int order);
+    void requestTile(int index);
+    void insertTile(u64 generation, QSharedPointer<const StarTile> tile);
+    bool evictFor(qint64 bytes);
+    qint64 tileBytes(int index) const;
+
+    QFile m_file;
+    const uchar *m_data;
+    qint64 m_size;
+    int m_tile_count;
+    qint64 m_star_count;
+    u64 m_generation; // bumped by close(), so loads of a previous file are ignored
+    QList<QList<Cone>> m_cones; // per HEALPix order, from the 12 base pixels down to the tiles
+
+    QThreadPool m_pool;
+    QHash<int, CachedTile> m_tiles;
+    QList<int> m_pending;
+    QList<int> m_visible;
+    qint64 m_bytes; // of the loaded and pending tiles
+    qint64 m_budget;
+    u64 m_use_counter;
+};
+
+#endif // STARTILES_H
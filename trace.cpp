@@ -0,0 +1,155 @@
+#include "trace.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QList>
+#include <QMutex>
+#include <QThread>
+#include <QDebug>
+#include <stdio.h>
+
+enum EventType {
+    Complete,
+    FlowStart,
+    FlowEnd,
+};
+
+struct TraceEvent {
+    const char *name;
+    qint64 start_ns;
+    qint64 end_ns; // the same as start_ns for flows
+    u64 id;        // of flows
+    int type;
+};
+
+struct TraceRing {
+    QList<TraceEvent> events; // TRACE_EVENTS_PER_THREAD, only written by the thread that owns the ring
+    QAtomicInteger<u64> written;
+    QString thread_name;
+    int thread_id;
+};
+
+// Started before main, so every thread gets the same zero.
+static QElapsedTimer trace_clock = []() { QElapsedTimer timer; timer.start(); return timer; }();
+
+// Rings are never freed, the events of a thread that ended stay in the trace.
+static QMutex rings_mutex;
+static QList<TraceRing*> rings;
+static QString output_path;
+
+static thread_local TraceRing *thread_ring = nullptr;
+
+static TraceRing *ring() {
+    if (thread_ring) return thread_ring;
+
+    TraceRing *ring = new TraceRing;
+    ring->events.resize(TRACE_EVENTS_PER_THREAD);
+    ring->written.storeRelaxed(0);
+    ring->thread_name = QThread::currentThread()->objectName();
+    QMutexLocker locker(&rings_mutex);
+    ring->thread_id = rings.size() + 1;
+    if (ring->thread_name.isEmpty()) {
+        bool main_thread = QCoreApplication::instance() && QCoreApplication::instance()->thread() == QThread::currentThread();
+        ring->thread_name = main_thread ? QString("main") : QString("thread %1").arg(ring->thread_id);
+    }
+    rings.append(ring);
+    thread_ring = ring;
+    return ring;
+}
+
+// The event is written before the count that makes it visible to save().
+static void record(int type, const char *name, qint64 start_ns, qint64 end_ns, u64 id) {
+    TraceRing *r = ring();
+    u64 index = r->written.loadRelaxed();
+    r->events[(qsizetype)(index % TRACE_EVENTS_PER_THREAD)] = {name, start_ns, end_ns, id, type};
+    r->written.storeRelease(index + 1);
+}
+
+static QByteArray escaped(QString text) {
+    return text.replace("\\", "\\\\").replace("\"", "\\\"").toUtf8();
+}
+
+QAtomicInteger<int> trace::active(0);
+
+void trace::start(QString path) {
+    {
+        QMutexLocker locker(&rings_mutex);
+        output_path = path;
+    }
+    active.storeRelaxed(1);
+}
+
+void trace::stop() {
+    active.storeRelaxed(0);
+}
+
+qint64 trace::now() {
+    return trace_clock.nsecsElapsed();
+}
+
+void trace::complete(const char *name, qint64 start_ns, qint64 end_ns) {
+    record(Complete, name, start_ns, end_ns, 0);
+}
+
+void trace::flowStart(const char *name, u64 id) {
+    qint64 time = now();
+    record(FlowStart, name, time, time, id);
+}
+
+void trace::flowEnd(const char *name, u64 id) {
+    qint64 time = now();
+    record(FlowEnd, name, time, time, id);
+}
+
+// Times in the JSON are in microseconds. Flows end at the slice that encloses them ("bp":"e"), not the next one.
+bool trace::save() {
+    QMutexLocker locker(&rings_mutex);
+    if (output_path.isEmpty()) return false;
+
+    qint64 pid = QCoreApplication::applicationPid();
+    QByteArray json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    QList<TraceEvent> events;
+    char line[512];
+    bool first = true;
+    for (TraceRing *ring : rings) {
+        int length = snprintf(line, sizeof(line), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lld,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                              first ? "" : ",\n", (long long)pid, ring->thread_id, escaped(ring->thread_name).constData());
+        json.append(line, qMin(length, (int)sizeof(line) - 1));
+        first = false;
+
+        u64 end = ring->written.loadAcquire();
+        u64 begin = end > TRACE_EVENTS_PER_THREAD ? end - TRACE_EVENTS_PER_THREAD : 0;
+        events.resize(0);
+        for (u64 i = begin; i < end; i++) {
+            events.append(ring->events[(qsizetype)(i % TRACE_EVENTS_PER_THREAD)]);
+        }
+        // The slot the owner writes next is that of the oldest event, it may have been half written meanwhile.
+        u64 end_after = ring->written.loadAcquire();
+        u64 valid = end_after >= TRACE_EVENTS_PER_THREAD ? end_after - TRACE_EVENTS_PER_THREAD + 1 : 0;
+
+        for (u64 i = begin; i < end; i++) {
+            if (i < valid) continue;
+            const TraceEvent &event = events[(qsizetype)(i - begin)];
+            double ts = event.start_ns * 1E-3;
+            if (event.type == Complete) {
+                length = snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%lld,\"tid\":%d}",
+                                  event.name, ts, (event.end_ns - event.start_ns) * 1E-3, (long long)pid, ring->thread_id);
+            }
+            else {
+                length = snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"cat\":\"flow\",\"ph\":\"%s\",%s\"id\":%llu,\"ts\":%.3f,\"pid\":%lld,\"tid\":%d}",
+                                  event.name, event.type == FlowStart ? "s" : "f", event.type == FlowStart ? "" : "\"bp\":\"e\",",
+                                  (unsigned long long)event.id, ts, (long long)pid, ring->thread_id);
+            }
+            json.append(line, qMin(length, (int)sizeof(line) - 1));
+        }
+    }
+    json.append("\n]}\n");
+
+    QFile file(output_path);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate) || file.write(json) != json.size()) {
+        qWarning() << "Could not write the trace to" << output_path;
+        return false;
+    }
+    qDebug() << "Wrote the trace of" << rings.size() << "threads to" << output_path;
+    return true;
+}
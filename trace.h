@@ -0,0 +1,71 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <QString>
+#include <QAtomicInteger>
+#include "types.h"
+
+#define TRACE_EVENTS_PER_THREAD 16384 // the last this many events of each thread are kept, 40 bytes each
+
+/*
+ * Records where the time of a frame goes, for viewing in chrome://tracing or ui.perfetto.dev.
+ *
+ * Each thread writes its events into a ring of its own, allocated the first time it records one, so recording
+ * never takes a lock and never allocates after that. Only the owning thread writes a ring, and it publishes how
+ * many events it has written after writing them, like TrailBuffer. save() can run on any thread while the others
+ * keep recording: it copies each ring and drops the events that were overwritten while it copied.
+ *
+ * While tracing is off, a TRACE_SCOPE costs one relaxed load and a branch. Building with OBSERVE_TRACING off
+ * removes the trace points altogether.
+ *
+ * Flows connect an event on one thread to one on another, like the worker publishing a frame and the UI thread
+ * fetching it, so the trace shows how long a frame waited in between.
+ */
+namespace trace {
+    extern QAtomicInteger<int> active;
+
+    inline bool enabled() {
+        return active.loadRelaxed() != 0;
+    }
+
+    // Starts recording, for save() to write to path.
+    void start(QString path);
+    void stop();
+    // Writes the events all threads kept so far as Chrome trace event JSON. False if tracing never started or
+    // the file can't be written.
+    bool save();
+
+    // Nanoseconds on a clock that all threads share.
+    qint64 now();
+    void complete(const char *name, qint64 start_ns, qint64 end_ns);
+    // Call the start inside one TRACE_SCOPE and the end inside another, with the same id.
+    void flowStart(const char *name, u64 id);
+    void flowEnd(const char *name, u64 id);
+}
+
+// Records the time from its construction to its destruction. The name has to outlive the trace, like a literal.
+class TraceScope {
+public:
+    explicit TraceScope(const char *name) : m_name(name), m_start(trace::enabled() ? trace::now() : -1) {}
+    ~TraceScope() {
+        if (m_start >= 0) trace::complete(m_name, m_start, trace::now());
+    }
+
+private:
+    const char *m_name;
+    qint64 m_start; // -1 while tracing is off
+};
+
+#ifdef OBSERVE_TRACING
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_FLOW_START(name, id) do { if (trace::enabled()) trace::flowStart(name, id); } while (0)
+#define TRACE_FLOW_END(name, id) do { if (trace::enabled()) trace::flowEnd(name, id); } while (0)
+#else
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_FLOW_START(name, id) do {} while (0)
+#define TRACE_FLOW_END(name, id) do {} while (0)
+#endif
+
+#endif // TRACE_H
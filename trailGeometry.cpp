@@ -0,0 +1,111 @@
+#include "trailGeometry.h"
+#include "trace.h"
+
+#define TRAIL_VERTEX_STRIDE (7 * sizeof(float)) // position, then color
+#define TRAIL_SEGMENT_STRIDE (2 * TRAIL_VERTEX_STRIDE)
+
+TrailGeometry::TrailGeometry() {
+    this->data_manager = DataManager::getInstance();
+    m_length = 4096;
+    m_body_count = 0;
+    m_start = 0;
+    m_end = 0;
+    m_extent = 0.0f;
+
+    setPrimitiveType(QQuick3DGeometry::PrimitiveType::Lines);
+    setStride(TRAIL_VERTEX_STRIDE);
+    addAttribute(QQuick3DGeometry::Attribute::PositionSemantic, 0, QQuick3DGeometry::Attribute::F32Type);
+    addAttribute(QQuick3DGeometry::Attribute::ColorSemantic, 3 * sizeof(float), QQuick3DGeometry::Attribute::F32Type);
+}
+
+int TrailGeometry::length() const {
+    return m_length;
+}
+
+void TrailGeometry::setLength(int length) {
+    length = qBound(0, length, TRAIL_MAX_LENGTH);
+    if (length == m_length) return;
+    m_length = length;
+    rebuild();
+    emit lengthChanged();
+}
+
+void TrailGeometry::updateTrails(u64 end) {
+    TRACE_SCOPE("TrailGeometry::updateTrails");
+    const TrailBuffer &trails = data_manager->m_trails;
+    u64 start = trails.start();
+    if (m_body_count != trails.bodyCount() || start != m_start || end < m_end || end - m_end >= (u64)m_length) {
+        m_start = start;
+        m_end = end;
+        rebuild();
+        return;
+    }
+    if (end == m_end) return;
+
+    // The new samples take one run of slots, or two where they wrap around the end of the ring.
+    u64 index = m_end;
+    QByteArray vertices;
+    while (index < end) {
+        qsizetype slot = (qsizetype)(index % m_length);
+        qsizetype run = (qsizetype)qMin(end - index, (u64)(m_length - slot));
+        for (qsizetype b = 0; b < m_body_count; b++) {
+            vertices.resize(run * TRAIL_SEGMENT_STRIDE);
+            for (qsizetype i = 0; i < run; i++) {
+                writeSegment(vertices.data() + i * TRAIL_SEGMENT_STRIDE, b, index + i);
+            }
+            setVertexData((int)((b * m_length + slot) * TRAIL_SEGMENT_STRIDE), vertices);
+        }
+        index += run;
+    }
+    m_end = end;
+    updateBounds();
+    update();
+}
+
+// Writes every slot, for a new length or when the trails started over.
+void TrailGeometry::rebuild() {
+    m_body_count = data_manager->m_trails.bodyCount();
+    m_extent = 0.0f;
+    QByteArray vertices(m_body_count * m_length * TRAIL_SEGMENT_STRIDE, 0);
+    u64 first = qMax(m_start, m_end - qMin(m_end, (u64)m_length));
+    for (qsizetype b = 0; b < m_body_count; b++) {
+        for (u64 index = first; index < m_end; index++) {
+            char *segment = vertices.data() + (b * m_length + (qsizetype)(index % m_length)) * TRAIL_SEGMENT_STRIDE;
+            writeSegment(segment, b, index);
+        }
+    }
+    setVertexData(vertices);
+    updateBounds();
+    update();
+}
+
+// The segment from the sample before index to it. The first sample of a trail has none, its slot is left at the
+// origin like those of samples from before the trail started.
+void TrailGeometry::writeSegment(char *vertices, qsizetype body, u64 index) {
+    float *vertex = (float*)vertices;
+    if (index <= m_start) {
+        memset(vertices, 0, TRAIL_SEGMENT_STRIDE);
+        return;
+    }
+
+    const TrailBuffer &trails = data_manager->m_trails;
+    QColor color = data_manager->m_planets.value(body).color;
+    const f32 *samples[2] = {trails.sample(body, index - 1), trails.sample(body, index)};
+    for (int i = 0; i < 2; i++) {
+        const f32 *p = samples[i];
+        vertex[0] = p[0];
+        vertex[1] = p[2];
+        vertex[2] = -p[1];
+        vertex[3] = color.redF();
+        vertex[4] = color.greenF();
+        vertex[5] = color.blueF();
+        vertex[6] = 1.0f;
+        vertex += 7;
+        m_extent = qMax(m_extent, qMax(fabsf(p[0]), qMax(fabsf(p[1]), fabsf(p[2]))));
+    }
+}
+
+// Only grows until the next rebuild, which is enough to keep the trails from being culled.
+void TrailGeometry::updateBounds() {
+    setBounds(QVector3D(-m_extent, -m_extent, -m_extent), QVector3D(m_extent, m_extent, m_extent));
+}
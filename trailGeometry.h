@@ -0,0 +1,50 @@
+#ifndef TRAILGEOMETRY_H
+#define TRAILGEOMETRY_H
+
+#include <QQuick3DGeometry>
+#include <QQmlEngine>
+#include "datamanager.h"
+
+/*
+ * The recent paths of all bodies across the sky, as one mesh of line segments. Every body has length slots of
+ * one segment each, from a sample of DataManager::m_trails to the one before it, used as a ring like the
+ * samples themselves. A new frame only writes the slots of its new samples and uploads those ranges of the
+ * vertex buffer, so a frame costs the same however long the trails are.
+ *
+ * Slots without a segment yet are at the origin, where the camera is, so the near plane clips them. The
+ * positions are those of the ephemeris, in the Z up frame of the math turned to Y up, and unscaled: the model
+ * is scaled by PlanetModel::distanceScale like the planets.
+ */
+class TrailGeometry : public QQuick3DGeometry {
+    Q_OBJECT
+    QML_ELEMENT
+    Q_PROPERTY(int length READ length WRITE setLength NOTIFY lengthChanged) // samples per body, up to TRAIL_MAX_LENGTH
+
+public:
+    TrailGeometry();
+
+    int length() const;
+    void setLength(int length);
+
+public slots:
+    // end is the number of samples written up to the frame shown, see PlanetModel::trailEnd. Connected to
+    // PlanetModel::positionsChanged.
+    void updateTrails(u64 end);
+
+signals:
+    void lengthChanged();
+
+private:
+    void rebuild();
+    void writeSegment(char *vertices, qsizetype body, u64 index);
+    void updateBounds();
+
+    DataManager *data_manager;
+    int m_length;
+    qsizetype m_body_count;
+    u64 m_start; // of the trails drawn, as in TrailBuffer::start
+    u64 m_end;   // samples drawn up to
+    float m_extent; // largest coordinate drawn, for the bounds
+};
+
+#endif // TRAILGEOMETRY_H
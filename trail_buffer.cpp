@@ -0,0 +1,45 @@
+#include "trail_buffer.h"
+
+TrailBuffer::TrailBuffer() : m_body_count(0), m_written(0), m_start(0) {
+}
+
+void TrailBuffer::setBodyCount(qsizetype body_count) {
+    m_body_count = body_count;
+    m_samples.fill(0.0f, body_count * TRAIL_CAPACITY * 3);
+    m_written.storeRelease(0);
+    m_start.storeRelease(0);
+}
+
+qsizetype TrailBuffer::bodyCount() const {
+    return m_body_count;
+}
+
+// The samples are written before the count that makes them visible to the reader.
+void TrailBuffer::append(const dVector3D *positions) {
+    u64 index = m_written.loadRelaxed();
+    qsizetype slot = (qsizetype)(index % TRAIL_CAPACITY);
+    f32 *samples = m_samples.data();
+    for (qsizetype b = 0; b < m_body_count; b++) {
+        f32 *sample = samples + (b * TRAIL_CAPACITY + slot) * 3;
+        sample[0] = (f32)positions[b].x;
+        sample[1] = (f32)positions[b].y;
+        sample[2] = (f32)positions[b].z;
+    }
+    m_written.storeRelease(index + 1);
+}
+
+void TrailBuffer::clear() {
+    m_start.storeRelease(m_written.loadRelaxed());
+}
+
+u64 TrailBuffer::written() const {
+    return m_written.loadAcquire();
+}
+
+u64 TrailBuffer::start() const {
+    return m_start.loadAcquire();
+}
+
+const f32 *TrailBuffer::sample(qsizetype body, u64 index) const {
+    return m_samples.constData() + (body * TRAIL_CAPACITY + (qsizetype)(index % TRAIL_CAPACITY)) * 3;
+}
@@ -0,0 +1,45 @@
+#ifndef TRAILBUFFER_H
+#define TRAILBUFFER_H
+
+#include <QList>
+#include <QAtomicInteger>
+#include "types.h"
+#include "datastructures.h"
+
+#define TRAIL_CAPACITY 65536 // samples kept per body
+#define TRAIL_MAX_LENGTH (TRAIL_CAPACITY / 2) // longest trail drawn, the rest is slack for a reader that falls behind
+
+/*
+ * The recent positions of every body, one sample per computed frame, in a ring per body. One thread appends
+ * (WorkerThread) and one other reads (TrailGeometry), without locks: samples are numbered from the start, and
+ * the writer publishes how many it has written after writing them. A reader that only reads samples it knows to
+ * be written, and less than TRAIL_CAPACITY - TRAIL_MAX_LENGTH behind the writer, always reads complete ones.
+ *
+ * The storage is allocated once by setBodyCount, before the writer starts.
+ */
+class TrailBuffer {
+public:
+    TrailBuffer();
+
+    void setBodyCount(qsizetype body_count);
+    qsizetype bodyCount() const;
+
+    // Writer side. Appends one sample for every body.
+    void append(const dVector3D *positions);
+    // Writer side. Ends the trails, like when the date jumps. Samples before this aren't part of them any more.
+    void clear();
+
+    // Samples written per body so far, and the number of the first one of the current trails.
+    u64 written() const;
+    u64 start() const;
+    // x, y and z of one sample, by its number.
+    const f32 *sample(qsizetype body, u64 index) const;
+
+private:
+    QList<f32> m_samples; // body after body, TRAIL_CAPACITY samples of x, y, z each
+    qsizetype m_body_count;
+    QAtomicInteger<u64> m_written;
+    QAtomicInteger<u64> m_start;
+};
+
+#endif // TRAILBUFFER_H
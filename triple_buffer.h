@@ -0,0 +1,60 @@
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include <QAtomicInteger>
+#include "types.h"
+
+/*
+ * Hands the latest value from one writer thread to one reader thread without locks or allocation. There are
+ * three slots: the writer fills one, the reader looks at another, and the third holds the latest published
+ * value. Publishing and fetching swap a slot with that middle one in a single atomic exchange, so neither side
+ * ever waits for the other and the reader always sees a complete value.
+ *
+ * A value the reader didn't fetch before the next publish is overwritten, so a slow reader skips to the
+ * latest value instead of falling behind.
+ *
+ * The slots are reused, so values that keep their capacity (like a QVarLengthArray of the same size) make
+ * the handoff free of allocations after the first round.
+ */
+template <typename T>
+class TripleBuffer {
+public:
+    TripleBuffer() : m_middle(1), m_write(0), m_read(2) {}
+
+    // The writer's slot. It still holds what was written three publishes ago, or the reader's old value.
+    T &writeBuffer() {
+        return m_slots[m_write];
+    }
+
+    // Makes the writer's slot the latest value and gives the writer another one.
+    void publish() {
+        u8 previous = m_middle.fetchAndStoreAcquireRelease(m_write | FRESH);
+        m_write = previous & INDEX;
+    }
+
+    // Moves the latest value into the reader's slot. False if nothing was published since the last fetch,
+    // in which case readBuffer() still holds the previous value.
+    bool fetch() {
+        if (!(m_middle.loadRelaxed() & FRESH)) return false;
+        u8 previous = m_middle.fetchAndStoreAcquireRelease(m_read);
+        m_read = previous & INDEX;
+        return true;
+    }
+
+    const T &readBuffer() const {
+        return m_slots[m_read];
+    }
+
+private:
+    enum : u8 {
+        INDEX = 0x3,
+        FRESH = 0x4, // set by publish, cleared by fetch
+    };
+
+    T m_slots[3];
+    QAtomicInteger<u8> m_middle; // index of the middle slot and the FRESH bit
+    u8 m_write; // only touched by the writer
+    u8 m_read;  // only touched by the reader
+};
+
+#endif // TRIPLEBUFFER_H